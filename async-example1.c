@@ -24,25 +24,45 @@
 
 #include <mysql/mysql.h>
 
+#include "mysql_async.h"
+
 #define SL(s) (s), sizeof(s)
 
 static char *my_groups[]= { "client", NULL };
 
-static void
-wait_for_mysql(MYSQL *mysql, int status)
+/*
+  Wait for the condition(s) in status to occur, and return the ones that
+  did, to pass to the foo_cont() call.
+*/
+static MYSQL_ASYNC_STATUS
+wait_for_mysql(MYSQL *mysql, MYSQL_ASYNC_STATUS status)
 {
   struct pollfd pfd;
-  p.fd= mysql_get_socket_fd(&mysql);
-  p.events=
+  int timeout, res;
+
+  pfd.fd= mysql_get_socket_fd(mysql);
+  pfd.events=
     (status & MYSQL_WAIT_READ ? POLLIN : 0) |
     (status & MYSQL_WAIT_WRITE ? POLLOUT : 0);
-  poll(&pfd, 1, 0);
+  if (status & MYSQL_WAIT_TIMEOUT)
+    timeout= 1000 * mysql_get_timeout_value(mysql);
+  else
+    timeout= -1;
+  res= poll(&pfd, 1, timeout);
+  if (res == 0)
+    return MYSQL_WAIT_TIMEOUT;
+  else if (res < 0)
+    /* Let the library retry and report the error. */
+    return status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE);
+  return (MYSQL_ASYNC_STATUS)
+    ((pfd.revents & (POLLIN | POLLERR | POLLHUP) ? MYSQL_WAIT_READ : 0) |
+     (pfd.revents & (POLLOUT | POLLERR | POLLHUP) ? MYSQL_WAIT_WRITE : 0));
 }
 
 static void
 fatal(MYSQL *mysql, const char *msg)
 {
-  fprintf(stderr, "%s: %s\n", msg, mysql_error(&mysql));
+  fprintf(stderr, "%s: %s\n", msg, mysql_error(mysql));
   exit(1);
 }
 
@@ -63,8 +83,8 @@ doit(void)
                                    0, NULL, 0);
   while (status)
   {
-    wait_for_mysql(&mysql, status);
-    status= mysql_real_connect_cont(&ret, &mysql);
+    status= wait_for_mysql(&mysql, status);
+    status= mysql_real_connect_cont(&ret, &mysql, status);
   }
 
   if (!ret)
@@ -73,8 +93,8 @@ doit(void)
   status= mysql_real_query_start(&err, &mysql, SL("SHOW STATUS"));
   while (status)
   {
-    wait_for_mysql(&mysql, status);
-    status= mysql_real_query_cont(&err, &mysql);
+    status= wait_for_mysql(&mysql, status);
+    status= mysql_real_query_cont(&err, &mysql, status);
   }
   if (err)
     fatal(&mysql, "mysql_real_query() returns error");
@@ -89,8 +109,8 @@ doit(void)
     status= mysql_fetch_row_start(&row, res);
     while (status)
     {
-      wait_for_mysql(&mysql, status);
-      status= mysql_fetch_row_cont(&row, res);
+      status= wait_for_mysql(&mysql, status);
+      status= mysql_fetch_row_cont(&row, res, status);
     }
     if (!row)
       break;
@@ -99,8 +119,19 @@ doit(void)
   if (mysql_errno(&mysql))
     fatal(&mysql, "Got error while retrieving rows");
 
-  /* I suppose this must be non-blocking too. */
-  mysql_close(&mysql);
+  status= mysql_free_result_start(res);
+  while (status)
+  {
+    status= wait_for_mysql(&mysql, status);
+    status= mysql_free_result_cont(res, status);
+  }
+
+  status= mysql_close_start(&mysql);
+  while (status)
+  {
+    status= wait_for_mysql(&mysql, status);
+    status= mysql_close_cont(&mysql, status);
+  }
 }
 
 int
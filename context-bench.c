@@ -0,0 +1,289 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Micro-benchmark of the my_context operations.
+
+  The same source is linked against each my_context implementation (see the
+  Makefile), and BENCH_BACKEND names the implementation in the output.
+
+  Each benchmark runs a number of samples, each sample timing a batch of
+  operations. The per-operation time of each sample is computed, and the
+  min, median and 99th percentile over all samples are reported, both in
+  nanoseconds and (on x86) in TSC cycles.
+
+  Output is CSV, one line per benchmark, so results from different backends
+  can simply be concatenated and compared:
+
+    backend,benchmark,ops_per_sample,samples,ns_min,ns_median,ns_p99,
+      cycles_min,cycles_median,cycles_p99
+
+  The benchmarks are:
+
+    spawn_noyield   my_context_spawn() of a function that returns without
+                    yielding (the common case of eg. fetching a row that is
+                    already buffered).
+    spawn_yield_N   my_context_spawn() of a function that yields N times,
+                    including the N my_context_continue() calls needed to
+                    complete it. Reported per complete call.
+    yield_continue  One my_context_continue() plus the my_context_yield()
+                    that switches back; ie. two context switches.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "my_context.h"
+#include "my_stack_pool.h"
+
+#ifndef BENCH_BACKEND
+#define BENCH_BACKEND "unknown"
+#endif
+
+#define STACK_SIZE 16384
+
+struct bench_result {
+  double ns;
+  double cycles;
+};
+
+static struct my_context ctx;
+static struct my_stack *stack;
+static int yields_left;
+
+static inline uint64_t
+read_cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  uint32_t lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+#else
+  return 0;
+#endif
+}
+
+static inline uint64_t
+read_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void
+func_noyield(void *d)
+{
+  (void)d;
+}
+
+static void
+func_yield(void *d)
+{
+  int n= *(int *)d;
+  while (n-- > 0)
+    my_context_yield(&ctx);
+}
+
+static void
+func_yield_forever(void *d)
+{
+  (void)d;
+  while (yields_left-- > 0)
+    my_context_yield(&ctx);
+}
+
+
+static void
+run_spawn_noyield(int ops)
+{
+  int i;
+  for (i= 0; i < ops; i++)
+    my_context_spawn(&ctx, func_noyield, NULL, stack->stack,
+                     stack->stack_size);
+}
+
+static int spawn_yields;
+
+static void
+run_spawn_yield(int ops)
+{
+  int i;
+  for (i= 0; i < ops; i++)
+  {
+    if (my_context_spawn(&ctx, func_yield, &spawn_yields, stack->stack,
+                         stack->stack_size) > 0)
+      while (my_context_continue(&ctx) > 0)
+        ;
+  }
+}
+
+static void
+run_yield_continue(int ops)
+{
+  int i;
+  for (i= 0; i < ops; i++)
+    my_context_continue(&ctx);
+}
+
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x= *(const double *)a, y= *(const double *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void
+report(const char *name, int ops, int samples, struct bench_result *res)
+{
+  double *ns, *cycles;
+  int i, p99;
+
+  ns= malloc(samples * sizeof(double));
+  cycles= malloc(samples * sizeof(double));
+  if (!ns || !cycles)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i= 0; i < samples; i++)
+  {
+    ns[i]= res[i].ns;
+    cycles[i]= res[i].cycles;
+  }
+  qsort(ns, samples, sizeof(double), cmp_double);
+  qsort(cycles, samples, sizeof(double), cmp_double);
+  p99= (int)((samples - 1) * 0.99);
+  printf("%s,%s,%d,%d,%.2f,%.2f,%.2f,%.1f,%.1f,%.1f\n",
+         BENCH_BACKEND, name, ops, samples,
+         ns[0], ns[samples/2], ns[p99],
+         cycles[0], cycles[samples/2], cycles[p99]);
+  free(ns);
+  free(cycles);
+}
+
+static void
+bench(const char *name, void (*run)(int), int ops, int samples,
+      struct bench_result *res)
+{
+  int i;
+
+  /* Warm up caches and branch predictors. */
+  run(ops);
+  for (i= 0; i < samples; i++)
+  {
+    uint64_t c0, c1, t0, t1;
+    t0= read_ns();
+    c0= read_cycles();
+    run(ops);
+    c1= read_cycles();
+    t1= read_ns();
+    res[i].ns= (double)(t1 - t0) / ops;
+    res[i].cycles= (double)(c1 - c0) / ops;
+  }
+  report(name, ops, samples, res);
+}
+
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-s samples] [-k ops_per_sample] [-y yields] [-H]\n"
+          "  -H  omit the CSV header line\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int samples= 1000;
+  int ops= 1000;
+  int yields= 8;
+  int header= 1;
+  int opt;
+  char name[64];
+  struct bench_result *res;
+
+  while ((opt= getopt(argc, argv, "s:k:y:H")) != -1)
+  {
+    switch (opt)
+    {
+    case 's': samples= atoi(optarg); break;
+    case 'k': ops= atoi(optarg); break;
+    case 'y': yields= atoi(optarg); break;
+    case 'H': header= 0; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (samples < 1 || ops < 1 || yields < 1)
+    usage(argv[0]);
+
+  if (!(stack= my_stack_alloc(STACK_SIZE)) ||
+      !(res= malloc(samples * sizeof(*res))))
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  if (header)
+    printf("backend,benchmark,ops_per_sample,samples,ns_min,ns_median,"
+           "ns_p99,cycles_min,cycles_median,cycles_p99\n");
+
+  bench("spawn_noyield", run_spawn_noyield, ops, samples, res);
+
+  spawn_yields= 1;
+  bench("spawn_yield_1", run_spawn_yield, ops, samples, res);
+  if (yields != 1)
+  {
+    spawn_yields= yields;
+    snprintf(name, sizeof(name), "spawn_yield_%d", yields);
+    bench(name, run_spawn_yield, ops, samples, res);
+  }
+
+  /*
+    One long-running context that yields once when spawned and once for
+    every continue, for the (samples + 1) * ops continues including the
+    warm-up round. Then one last continue lets it finish.
+  */
+  yields_left= (samples + 1) * ops + 1;
+  if (my_context_spawn(&ctx, func_yield_forever, NULL, stack->stack,
+                       stack->stack_size) <= 0)
+  {
+    fprintf(stderr, "Error: my_context_spawn() did not yield\n");
+    exit(1);
+  }
+  bench("yield_continue", run_yield_continue, ops, samples, res);
+  if (my_context_continue(&ctx) != 0)
+  {
+    fprintf(stderr, "Error: context did not finish\n");
+    exit(1);
+  }
+
+  free(res);
+  my_stack_free(stack);
+  my_stack_pool_thread_end();
+  return 0;
+}
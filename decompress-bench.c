@@ -0,0 +1,427 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Decompression throughput of the compressed protocol, per core.
+
+  A result set of generated rows (id, name, amount, timestamp, as text
+  protocol row packets) is cut into compressed packets of each size in the
+  -s list and compressed like the server does (zlib level 6, zstd level
+  3). It is then decompressed, single-threaded, in two ways:
+
+    whole   Each compressed packet is uncompressed in one go once it is
+            all there, into a buffer for the whole packet, like the NET
+            layer does.
+    stream  The compressed stream is fed to my_decompress_run() in pieces
+            of each size in the -b list (as recv() would return them),
+            decompressing into a 16 kB buffer, as
+            my_recv_decompress_async() does.
+
+  Each line of the CSV output gives the compression ratio, the compressed
+  and uncompressed MB per second of CPU time, and first_out_bytes: how many
+  compressed bytes of a packet must have arrived before its first
+  uncompressed byte is available, on average.
+
+  zstd is included when built with HAVE_ZSTD.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "my_decompress.h"
+
+#define OUT_BUF_SIZE 16384
+#define ZLIB_LEVEL 6
+#define ZSTD_LEVEL 3
+
+static size_t opt_mb= 64;
+static double opt_duration= 1.0;
+
+/* The plain row stream, and the same compressed. */
+static unsigned char *plain;
+static size_t plain_len;
+static unsigned char *comp;
+static size_t comp_len;
+static unsigned long comp_packets;
+
+static double
+cpu_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *
+xmalloc(size_t size)
+{
+  void *p= malloc(size);
+
+  if (!p)
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static unsigned char *
+put3(unsigned char *p, size_t v)
+{
+  p[0]= v;
+  p[1]= v >> 8;
+  p[2]= v >> 16;
+  return p + 3;
+}
+
+static size_t
+get3(const unsigned char *p)
+{
+  return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16);
+}
+
+/* Append a column value as a length-prefixed string (all are < 251). */
+static unsigned char *
+put_col(unsigned char *p, const char *s, int len)
+{
+  *p++= (unsigned char)len;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+/* Generate opt_mb MB of row packets. */
+static void
+make_rows(void)
+{
+  static const char *names[]= {
+    "alice", "bob", "carol", "dave", "eve", "mallory", "oscar", "peggy",
+    "trent", "victor", "walter", "sybil"
+  };
+  unsigned char *p, *row;
+  unsigned long id= 1;
+  char buf[32];
+  const char *name;
+  unsigned int seq= 1;
+
+  plain_len= opt_mb << 20;
+  plain= xmalloc(plain_len + 256);
+  srandom(1);
+  for (p= plain; p < plain + plain_len; id++)
+  {
+    row= p;
+    p+= 4;
+    p= put_col(p, buf, sprintf(buf, "%lu", id));
+    name= names[random() % 12];
+    p= put_col(p, name, strlen(name));
+    p= put_col(p, buf, sprintf(buf, "%ld.%02ld", random() % 100000,
+                               random() % 100));
+    p= put_col(p, buf, sprintf(buf, "2011-%02ld-%02ld %02ld:%02ld:%02ld",
+                               1 + random() % 12, 1 + random() % 28,
+                               random() % 24, random() % 60,
+                               random() % 60));
+    put3(row, p - row - 4);
+    row[3]= seq++;
+  }
+  plain_len= p - plain;
+}
+
+/* Compress the row stream into packets of at most packet bytes. */
+static int
+make_comp(enum my_decompress_codec codec, size_t packet)
+{
+  size_t pos, n, bound;
+  unsigned char *p;
+
+  bound= compressBound(packet);
+#ifdef HAVE_ZSTD
+  if (ZSTD_compressBound(packet) > bound)
+    bound= ZSTD_compressBound(packet);
+#endif
+  free(comp);
+  comp= xmalloc((plain_len / packet + 1) *
+                (bound + MY_DECOMPRESS_HEADER_SIZE));
+  comp_packets= 0;
+  for (pos= 0, p= comp; pos < plain_len; pos+= n)
+  {
+    unsigned char *data= p + MY_DECOMPRESS_HEADER_SIZE;
+    size_t len= bound;
+
+    n= plain_len - pos < packet ? plain_len - pos : packet;
+    if (codec == MY_DECOMPRESS_ZLIB)
+    {
+      uLongf zlen= len;
+      if (compress2(data, &zlen, plain + pos, n, ZLIB_LEVEL) != Z_OK)
+        return 1;
+      len= zlen;
+    }
+#ifdef HAVE_ZSTD
+    else
+    {
+      len= ZSTD_compress(data, len, plain + pos, n, ZSTD_LEVEL);
+      if (ZSTD_isError(len))
+        return 1;
+    }
+#endif
+    put3(p, len);
+    p[3]= comp_packets++;
+    put3(p + 4, n);
+    p= data + len;
+  }
+  comp_len= p - comp;
+  return 0;
+}
+
+/* One pass of the whole mode. Returns 0 if the output was right. */
+static int
+run_whole(enum my_decompress_codec codec, unsigned char *out)
+{
+  const unsigned char *p= comp;
+  size_t pos= 0;
+
+  while (p < comp + comp_len)
+  {
+    size_t len= get3(p), n= get3(p + 4);
+    const unsigned char *data= p + MY_DECOMPRESS_HEADER_SIZE;
+
+    if (codec == MY_DECOMPRESS_ZLIB)
+    {
+      uLongf zlen= n;
+      if (uncompress(out, &zlen, data, len) != Z_OK || zlen != n)
+        return 1;
+    }
+#ifdef HAVE_ZSTD
+    else if (ZSTD_decompress(out, n, data, len) != n)
+      return 1;
+#endif
+    if (pos + n > plain_len || out[n - 1] != plain[pos + n - 1])
+      return 1;
+    pos+= n;
+    p= data + len;
+  }
+  return pos != plain_len;
+}
+
+/*
+  One pass of the stream mode, feeding chunk bytes at a time. With
+  first_out non-NULL, also sum up the compressed bytes of each packet fed
+  before its first output.
+*/
+static int
+run_stream(struct my_decompress *d, size_t chunk, unsigned char *out,
+           double *first_out)
+{
+  size_t in_pos= 0, fed= 0, out_total= 0, used, packet;
+  /* Offset in the row stream of the next packet not yet seen, its header. */
+  size_t next_start= 0;
+  const unsigned char *next_hdr= comp;
+  ssize_t res;
+
+  while (fed < comp_len)
+  {
+    fed= fed + chunk < comp_len ? fed + chunk : comp_len;
+    while ((res= my_decompress_run(d, comp + in_pos, fed - in_pos, &used,
+                                   out, OUT_BUF_SIZE)) > 0)
+    {
+      in_pos+= used;
+      if (out_total + res > plain_len ||
+          out[res - 1] != plain[out_total + res - 1])
+        return 1;
+      out_total+= res;
+      /* Packets whose first byte came out with this. */
+      while (first_out && next_hdr < comp + comp_len &&
+             out_total > next_start)
+      {
+        /* Bytes fed past the packet's end do not count. */
+        packet= MY_DECOMPRESS_HEADER_SIZE + get3(next_hdr);
+        *first_out+= fed - (next_hdr - comp) < packet ?
+          fed - (next_hdr - comp) : packet;
+        next_start+= get3(next_hdr + 4);
+        next_hdr+= packet;
+      }
+    }
+    if (res < 0)
+      return 1;
+    in_pos+= used;
+  }
+  return out_total != plain_len || !my_decompress_idle(d);
+}
+
+static const char *
+codec_name(enum my_decompress_codec codec)
+{
+  return codec == MY_DECOMPRESS_ZLIB ? "zlib" : "zstd";
+}
+
+static void
+report(enum my_decompress_codec codec, size_t packet, size_t chunk,
+       const char *mode, unsigned long passes, double cpu, double first_out)
+{
+  printf("%s,%d,%zu,%zu,%s,%.2f,%.1f,%.1f,%.0f\n", codec_name(codec),
+         codec == MY_DECOMPRESS_ZLIB ? ZLIB_LEVEL : ZSTD_LEVEL, packet,
+         chunk, mode, (double)plain_len / comp_len,
+         passes * comp_len / cpu / 1e6, passes * plain_len / cpu / 1e6,
+         first_out);
+  fflush(stdout);
+}
+
+static int
+bench(enum my_decompress_codec codec, size_t packet, const char *chunk_list)
+{
+  unsigned char *out;
+  unsigned long passes;
+  double start, cpu, first_out;
+  const char *p;
+  char *end;
+  size_t chunk;
+  struct my_decompress *d;
+
+  if (make_comp(codec, packet))
+  {
+    fprintf(stderr, "Compression failed\n");
+    return 1;
+  }
+
+  out= xmalloc(packet);
+  start= cpu_now();
+  for (passes= 0, cpu= 0; cpu < opt_duration; passes++, cpu= cpu_now() - start)
+    if (run_whole(codec, out))
+    {
+      fprintf(stderr, "%s: wrong output in whole mode\n", codec_name(codec));
+      return 1;
+    }
+  report(codec, packet, 0, "whole", passes, cpu,
+         (double)comp_len / comp_packets);
+  free(out);
+
+  out= xmalloc(OUT_BUF_SIZE);
+  if (!(d= my_decompress_new(codec)))
+  {
+    perror("my_decompress_new");
+    return 1;
+  }
+  for (p= chunk_list; *p; p= *end ? end + 1 : end)
+  {
+    chunk= strtoul(p, &end, 10);
+    if (end == p || (*end && *end != ',') || !chunk)
+      return 1;
+    first_out= 0;
+    if (run_stream(d, chunk, out, &first_out))
+      goto wrong;
+    start= cpu_now();
+    for (passes= 0, cpu= 0; cpu < opt_duration;
+         passes++, cpu= cpu_now() - start)
+      if (run_stream(d, chunk, out, NULL))
+        goto wrong;
+    report(codec, packet, chunk, "stream", passes, cpu,
+           first_out / comp_packets);
+  }
+  my_decompress_free(d);
+  free(out);
+  return 0;
+
+wrong:
+  fprintf(stderr, "%s: wrong output in stream mode\n", codec_name(codec));
+  return 1;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -c codec        zlib, zstd or all (the default)\n"
+          "  -s list         Comma-separated compressed packet sizes\n"
+          "                  (default 16384,1048576)\n"
+          "  -b list         Comma-separated sizes of the pieces fed in\n"
+          "                  stream mode (default 1448,16384,65536)\n"
+          "  -m mb           Size of the row data (default 64)\n"
+          "  -d secs         CPU time per measurement (default 1)\n"
+          "  -H              Omit the CSV header\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *packet_list= "16384,1048576";
+  const char *chunk_list= "1448,16384,65536";
+  int codecs= 0;
+  int header= 1, opt;
+  enum my_decompress_codec codec;
+  const char *p;
+  char *end;
+  size_t packet;
+
+  while ((opt= getopt(argc, argv, "c:s:b:m:d:H")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      if (!strcmp(optarg, "zlib"))
+        codecs= 1 << MY_DECOMPRESS_ZLIB;
+#ifdef HAVE_ZSTD
+      else if (!strcmp(optarg, "zstd"))
+        codecs= 1 << MY_DECOMPRESS_ZSTD;
+#endif
+      else if (!strcmp(optarg, "all"))
+        codecs= 0;
+      else
+        usage(argv[0]);
+      break;
+    case 's': packet_list= optarg; break;
+    case 'b': chunk_list= optarg; break;
+    case 'm': opt_mb= atoi(optarg); break;
+    case 'd': opt_duration= atof(optarg); break;
+    case 'H': header= 0; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (!opt_mb || opt_duration <= 0)
+    usage(argv[0]);
+  if (!codecs)
+  {
+    codecs= 1 << MY_DECOMPRESS_ZLIB;
+#ifdef HAVE_ZSTD
+    codecs|= 1 << MY_DECOMPRESS_ZSTD;
+#endif
+  }
+
+  make_rows();
+  if (header)
+    printf("codec,level,packet,chunk,mode,ratio,in_mb_per_s,out_mb_per_s,"
+           "first_out_bytes\n");
+  for (p= packet_list; *p; p= *end ? end + 1 : end)
+  {
+    packet= strtoul(p, &end, 10);
+    if (end == p || (*end && *end != ',') || !packet || packet > 0xffffff)
+      usage(argv[0]);
+    for (codec= MY_DECOMPRESS_ZLIB; codec <= MY_DECOMPRESS_ZSTD; codec++)
+      if ((codecs & (1 << codec)) && bench(codec, packet, chunk_list))
+        return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,350 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Test of the streaming decompression of the compressed protocol.
+
+  A random but compressible plain stream is cut into compressed packets of
+  random size, one in five of them stored uncompressed (as the server does
+  when compression does not pay), and fed to my_decompress_run() in pieces
+  of random size, or one byte at a time, with output space of random size
+  or one byte. The output must be the plain stream again. One-byte output
+  makes the codec see the end of its stream (the zlib checksum) only after
+  the last byte of the packet is out; that case is also checked on its
+  own, along with a bad checksum.
+
+  my_recv_decompress_async() is tested through mysql_ping_start() /
+  mysql_ping_cont() (see libmysql-stub.h), reading from a non-blocking
+  socketpair that gets a few bytes more of the compressed stream before
+  each _cont().
+
+  zstd is included when built with HAVE_ZSTD. The random seed is printed,
+  and can be given as argument to repeat a run:
+
+    ./decompress-test [seed]
+*/
+
+#include "libmysql-stub.h"
+
+static int mysql_ping(MYSQL *mysql);
+
+#include "mysql_async.c"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define MAX_PLAIN (1 << 20)
+#define ZLIB_LEVEL 6
+#define ZSTD_LEVEL 3
+/* Round trips with random pieces, and with one-byte pieces. */
+#define ROUNDS 100
+#define ROUNDS_ONE_BYTE 20
+/* Bytes written to the socket before each _cont(). */
+#define SOCKET_PIECE 50
+
+static const char *codec_names[]= { "none", "zlib", "zstd" };
+
+static unsigned char plain[MAX_PLAIN], out[MAX_PLAIN];
+/* Small packets compress to more than their size, with the header. */
+static unsigned char comp[MAX_PLAIN * 4];
+
+static int failures;
+
+static void
+check(int ok, const char *codec, const char *what)
+{
+  printf("%s: %s%s%s\n", ok ? "ok" : "FAILED", codec ? codec : "",
+         codec ? ": " : "", what);
+  if (!ok)
+    failures++;
+}
+
+
+static void
+put3(unsigned char *p, size_t v)
+{
+  p[0]= v;
+  p[1]= v >> 8;
+  p[2]= v >> 16;
+}
+
+
+/* Bytes from a small alphabet, with some noise, so that they compress. */
+static void
+make_plain(void)
+{
+  static const char alphabet[]= "abcdefgh row data 12345\n";
+  size_t i;
+
+  for (i= 0; i < MAX_PLAIN; i++)
+  {
+    plain[i]= alphabet[random() % (sizeof(alphabet) - 1)];
+    if (random() % 50 == 0)
+      plain[i]^= random();
+  }
+}
+
+
+/* Compress len bytes into at most size bytes. Returns the length. */
+static size_t
+compress_packet(enum my_decompress_codec codec, unsigned char *to,
+                size_t size, const unsigned char *from, size_t len)
+{
+  if (codec == MY_DECOMPRESS_ZLIB)
+  {
+    uLongf to_len= size;
+
+    if (compress2(to, &to_len, from, len, ZLIB_LEVEL) != Z_OK)
+      abort();
+    return to_len;
+  }
+#ifdef HAVE_ZSTD
+  {
+    size_t to_len= ZSTD_compress(to, size, from, len, ZSTD_LEVEL);
+
+    if (ZSTD_isError(to_len))
+      abort();
+    return to_len;
+  }
+#else
+  abort();
+#endif
+}
+
+
+/*
+  Cut plain[0, len) into compressed packets of at most max_pkt bytes, one
+  in stored_one_in of them stored (0 for none). Returns the stream length.
+*/
+static size_t
+make_comp(enum my_decompress_codec codec, size_t len, size_t max_pkt,
+          int stored_one_in)
+{
+  size_t pos= 0, comp_len= 0;
+  unsigned int seq= 0;
+
+  while (pos < len)
+  {
+    unsigned char *header= comp + comp_len;
+    unsigned char *data= header + MY_DECOMPRESS_HEADER_SIZE;
+    size_t n= MY_MIN(len - pos, max_pkt), data_len;
+
+    if (stored_one_in && random() % stored_one_in == 0)
+    {
+      memcpy(data, plain + pos, n);
+      data_len= n;
+      put3(header + 4, 0);
+    }
+    else
+    {
+      data_len= compress_packet(codec, data, comp + sizeof(comp) - data,
+                                plain + pos, n);
+      put3(header + 4, n);
+    }
+    put3(header, data_len);
+    header[3]= (unsigned char)seq++;
+    comp_len+= MY_DECOMPRESS_HEADER_SIZE + data_len;
+    pos+= n;
+  }
+  return comp_len;
+}
+
+
+/*
+  Decompress a stream of len plain bytes in random pieces, or one byte at
+  a time. Returns non-zero if the output is right.
+*/
+static int
+round_trip(enum my_decompress_codec codec, size_t len, size_t max_pkt,
+           int one_byte)
+{
+  struct my_decompress *d;
+  size_t comp_len= make_comp(codec, len, max_pkt, 5);
+  size_t in_pos= 0, out_pos= 0;
+  unsigned long stalls= 0;
+
+  if (!(d= my_decompress_new(codec)))
+    return 0;
+  while (in_pos < comp_len || out_pos < len)
+  {
+    size_t in_n, out_n, used;
+    ssize_t res;
+
+    if (one_byte)
+      in_n= out_n= 1;
+    else
+    {
+      in_n= random() % 4 ? random() % 5000 : random() % 8;
+      out_n= random() % 4 ? 1 + random() % 20000 : 1 + random() % 4;
+    }
+    in_n= MY_MIN(in_n, comp_len - in_pos);
+    out_n= MY_MIN(out_n, sizeof(out) - out_pos);
+    res= my_decompress_run(d, comp + in_pos, in_n, &used,
+                           out + out_pos, out_n);
+    /* 0 must mean that all input was used, unless the output is full. */
+    if (res < 0 || (res == 0 && used < in_n && out_n > 0))
+      break;
+    in_pos+= used;
+    out_pos+= res;
+    if (used || res)
+      stalls= 0;
+    else if (++stalls > 1000)
+      break;
+  }
+  my_decompress_free(d);
+  return in_pos == comp_len && out_pos == len && !memcmp(out, plain, len);
+}
+
+
+/*
+  zlib ends a stream with a checksum, read after the last output byte.
+  Feed a packet without it, then the checksum alone with no output space.
+*/
+static void
+test_trailer(void)
+{
+  struct my_decompress *d;
+  size_t len= 1000, comp_len, used;
+  ssize_t res;
+
+  comp_len= make_comp(MY_DECOMPRESS_ZLIB, len, len, 0);
+  d= my_decompress_new(MY_DECOMPRESS_ZLIB);
+  res= my_decompress_run(d, comp, comp_len - 4, &used, out, sizeof(out));
+  check(res == (ssize_t)len && used == comp_len - 4 && !my_decompress_idle(d),
+        "zlib", "all output before the checksum");
+  res= my_decompress_run(d, comp + comp_len - 4, 4, &used, out + len, 0);
+  check(res == 0 && used == 4 && my_decompress_idle(d), "zlib",
+        "checksum read after the output");
+  my_decompress_free(d);
+
+  comp[comp_len - 1]^= 1;
+  d= my_decompress_new(MY_DECOMPRESS_ZLIB);
+  res= my_decompress_run(d, comp, comp_len, &used, out, sizeof(out));
+  check(res == -1 && errno == EBADMSG, "zlib", "bad checksum");
+  my_decompress_free(d);
+}
+
+
+/* The async read, run as the body of mysql_ping_start(). */
+static int async_fd;
+static size_t async_len, async_got;
+
+static int
+mysql_ping(MYSQL *mysql)
+{
+  struct mysql_async_context *b= mysql->async_context;
+  ssize_t res;
+
+  while (async_got < async_len)
+  {
+    /* Reads smaller than a packet, as the NET layer may do. */
+    size_t n= MY_MIN(async_len - async_got, 1 + (size_t)random() % 3000);
+
+    if ((res= my_recv_decompress_async(b, async_fd, out + async_got, n,
+                                       5)) <= 0)
+      return 1;
+    async_got+= res;
+  }
+  return 0;
+}
+
+
+static void
+test_async(enum my_decompress_codec codec)
+{
+  static MYSQL mysql;
+  int fds[2];
+  int ret= 1;
+  size_t comp_len, sent= 0;
+  MYSQL_ASYNC_STATUS status;
+
+  memset(&mysql, 0, sizeof(mysql));
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    abort();
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  async_fd= fds[0];
+  async_len= 200000;
+  async_got= 0;
+  comp_len= make_comp(codec, async_len, 16384, 5);
+
+  if (mysql_async_set_decompress(&mysql, codec))
+  {
+    check(0, codec_names[codec], "mysql_async_set_decompress()");
+    return;
+  }
+  status= mysql_ping_start(&ret, &mysql);
+  while ((status & MYSQL_WAIT_READ) && sent < comp_len)
+  {
+    size_t n= MY_MIN(comp_len - sent, SOCKET_PIECE);
+
+    if (write(fds[1], comp + sent, n) != (ssize_t)n)
+      abort();
+    sent+= n;
+    status= mysql_ping_cont(&ret, &mysql, MYSQL_WAIT_READ);
+  }
+  check(!status && ret == 0 && sent == comp_len && async_got == async_len &&
+        !memcmp(out, plain, async_len), codec_names[codec],
+        "my_recv_decompress_async() through _start()/_cont()");
+  if (!status)
+    mysql_async_free_context(mysql.async_context);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  unsigned int seed= argc > 1 ? (unsigned int)atoi(argv[1]) :
+                                (unsigned int)time(NULL);
+  int codec, i, ok;
+  struct my_decompress *d;
+
+  printf("seed %u\n", seed);
+  srandom(seed);
+  make_plain();
+
+  for (codec= MY_DECOMPRESS_ZLIB; codec <= MY_DECOMPRESS_ZSTD; codec++)
+  {
+    const char *name= codec_names[codec];
+
+    if (!(d= my_decompress_new((enum my_decompress_codec)codec)))
+    {
+      printf("skipped: %s: not built in\n", name);
+      continue;
+    }
+    my_decompress_free(d);
+
+    for (i= 0, ok= 1; ok && i < ROUNDS; i++)
+      ok= round_trip((enum my_decompress_codec)codec, 1 + random() % MAX_PLAIN,
+                     32 + random() % 70000, 0);
+    check(ok, name, "round trip in random pieces");
+    for (i= 0, ok= 1; ok && i < ROUNDS_ONE_BYTE; i++)
+      ok= round_trip((enum my_decompress_codec)codec, 1 + random() % 20000,
+                     32 + random() % 3000, 1);
+    check(ok, name, "round trip in one-byte pieces");
+    test_async((enum my_decompress_codec)codec);
+  }
+  test_trailer();
+  return failures ? 1 : 0;
+}
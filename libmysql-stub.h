@@ -0,0 +1,176 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Minimal stand-in for the parts of libmysql that mysql_async.c uses, for
+  tests that include mysql_async.c directly, so that they need neither the
+  client library nor a server:
+
+    #include "libmysql-stub.h"
+    static int mysql_ping(MYSQL *mysql);
+    #include "mysql_async.c"
+
+  The test then defines mysql_ping() as the body of an async call, run by
+  mysql_ping_start() / mysql_ping_cont(). The other client functions that
+  mysql_async.c wraps abort if called.
+*/
+
+#ifndef LIBMYSQL_STUB_H
+#define LIBMYSQL_STUB_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+typedef char my_bool;
+typedef unsigned int uint;
+typedef unsigned long ulong;
+typedef unsigned char uchar;
+typedef int my_socket;
+
+typedef struct st_vio {
+  char *read_pos, *read_end;
+  void *ssl_arg;
+} Vio;
+typedef struct st_net {
+  Vio *vio;
+  my_bool compress;
+  uint pkt_nr, compress_pkt_nr;
+} NET;
+typedef struct st_mysql {
+  struct mysql_async_context *async_context;
+  NET net;
+  int status;
+  my_bool reconnect;
+} MYSQL;
+typedef struct st_mysql_res {
+  MYSQL *handle;
+  my_bool eof;
+  uint field_count;
+} MYSQL_RES;
+typedef char **MYSQL_ROW;
+typedef struct st_mysql_rows { struct st_mysql_rows *next; } MYSQL_ROWS;
+typedef struct st_mysql_stmt {
+  MYSQL *mysql;
+  MYSQL_ROWS *data_cursor;
+  uint field_count;
+} MYSQL_STMT;
+typedef struct st_mem_root { void *unused; } MEM_ROOT;
+typedef struct mysql_async_context mysql_async_context;
+
+#define NET_HEADER_SIZE 4
+#define MAX_PACKET_LENGTH 0xffffffUL
+#define uint3korr(p) ((ulong)(uchar)(p)[0] | ((ulong)(uchar)(p)[1] << 8) | \
+                      ((ulong)(uchar)(p)[2] << 16))
+#define MY_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MY_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MYF(x) (x)
+#define MY_ZEROFILL 32
+#define MY_ALLOW_ZERO_PTR 64
+#define MY_MARK_BLOCKS_FREE 2
+#define MYSQL_STATUS_READY 0
+#define MYSQL_STATUS_USE_RESULT 2
+#define COM_QUIT 1
+#define COM_QUERY 3
+#define CR_OUT_OF_MEMORY 2008
+#define CR_SERVER_GONE_ERROR 2006
+#define CR_SERVER_LOST 2013
+#define CR_COMMANDS_OUT_OF_SYNC 2014
+
+static __thread int my_errno;
+static const char *unknown_sqlstate= "HY000";
+
+static void *
+my_malloc(size_t size, int flags)
+{
+  return flags & MY_ZEROFILL ? calloc(1, size) : malloc(size);
+}
+
+static void
+my_free(void *ptr, int flags)
+{
+  (void)flags;
+  free(ptr);
+}
+
+static void
+init_alloc_root(MEM_ROOT *root, size_t block_size, size_t prealloc)
+{
+  (void)root;
+  (void)block_size;
+  (void)prealloc;
+}
+
+static void
+free_root(MEM_ROOT *root, int flags)
+{
+  (void)root;
+  (void)flags;
+}
+
+static int last_error;
+
+static void
+set_mysql_error(MYSQL *mysql, int err, const char *sqlstate)
+{
+  (void)mysql;
+  (void)sqlstate;
+  last_error= err;
+}
+
+/* The rest of the client library is not used by the test. */
+#define NOT_USED(ret, name, args) static ret name args { abort(); }
+NOT_USED(MYSQL *, mysql_real_connect,
+         (MYSQL *, const char *, const char *, const char *, const char *,
+          uint, const char *, ulong))
+NOT_USED(int, mysql_query, (MYSQL *, const char *))
+NOT_USED(int, mysql_real_query, (MYSQL *, const char *, ulong))
+NOT_USED(int, mysql_send_query, (MYSQL *, const char *, ulong))
+NOT_USED(my_bool, mysql_read_query_result, (MYSQL *))
+NOT_USED(MYSQL_RES *, mysql_store_result, (MYSQL *))
+NOT_USED(MYSQL_ROW, mysql_fetch_row, (MYSQL_RES *))
+NOT_USED(ulong *, mysql_fetch_lengths, (MYSQL_RES *))
+NOT_USED(void, mysql_free_result, (MYSQL_RES *))
+NOT_USED(int, mysql_next_result, (MYSQL *))
+NOT_USED(int, mysql_select_db, (MYSQL *, const char *))
+NOT_USED(my_bool, mysql_change_user,
+         (MYSQL *, const char *, const char *, const char *))
+NOT_USED(my_bool, mysql_commit, (MYSQL *))
+NOT_USED(my_bool, mysql_rollback, (MYSQL *))
+NOT_USED(my_bool, mysql_autocommit, (MYSQL *, my_bool))
+NOT_USED(void, mysql_close, (MYSQL *))
+NOT_USED(int, mysql_stmt_prepare, (MYSQL_STMT *, const char *, ulong))
+NOT_USED(int, mysql_stmt_execute, (MYSQL_STMT *))
+NOT_USED(int, mysql_stmt_store_result, (MYSQL_STMT *))
+NOT_USED(int, mysql_stmt_fetch, (MYSQL_STMT *))
+NOT_USED(my_bool, mysql_stmt_send_long_data,
+         (MYSQL_STMT *, uint, const char *, ulong))
+NOT_USED(void, free_old_query, (MYSQL *))
+NOT_USED(int, simple_command, (MYSQL *, int, uchar *, int, int))
+NOT_USED(void, end_server, (MYSQL *))
+NOT_USED(my_bool, net_write_command,
+         (NET *, uchar, const uchar *, size_t, const uchar *, size_t))
+NOT_USED(void *, alloc_root, (MEM_ROOT *, size_t))
+
+#endif  /* LIBMYSQL_STUB_H */
@@ -0,0 +1,920 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A stand-in for a MySQL server, for testing and benchmarking the client
+  on localhost without a real server.
+
+  It speaks just enough of the client/server protocol: the handshake
+  (accepting any user and password, with mysql_native_password), COM_QUERY,
+  COM_PING, COM_INIT_DB and COM_QUIT. A query starting with SELECT or SHOW
+  returns a text result set, anything else an OK packet. The result set
+  has -r rows of -c columns, each row -s bytes of data in total; a query
+  can override these by containing eg. "rows=1000", "cols=3" or
+  "size=50", so one server can serve a whole query mix.
+
+  To exercise the client's handling of slow and partial reads, each
+  packet can be delayed by -d microseconds (before the first packet of a
+  reply, this acts as the query execution time), and the output can be
+  written in fragments of -f bytes, with -F microseconds between them.
+
+  The server runs -t worker threads, each with its own epoll set and
+  timer wheel (in microsecond ticks, driven by a timerfd), sharing the
+  listening sockets.
+*/
+
+#define _GNU_SOURCE                             /* For accept4() */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "my_timer_wheel.h"
+
+#define MAX_EVENTS 256
+/* Without a packet delay, fill the output buffer up to this before sending. */
+#define FILL_TARGET 16384
+/* Largest packet accepted from a client. */
+#define MAX_PACKET 0xffffff
+
+/* Command bytes. */
+#define COM_QUIT 0x01
+#define COM_INIT_DB 0x02
+#define COM_QUERY 0x03
+#define COM_PING 0x0e
+
+/* Capabilities offered: protocol 4.1 with plugin auth, no SSL/compression. */
+#define SERVER_CAPABILITIES                                             \
+  (0x00000001 /* LONG_PASSWORD */ | 0x00000002 /* FOUND_ROWS */ |       \
+   0x00000004 /* LONG_FLAG */ | 0x00000008 /* CONNECT_WITH_DB */ |      \
+   0x00000200 /* PROTOCOL_41 */ | 0x00002000 /* TRANSACTIONS */ |       \
+   0x00008000 /* SECURE_CONNECTION */ | 0x00010000 /* MULTI_STATEMENTS */ | \
+   0x00020000 /* MULTI_RESULTS */ | 0x00080000 /* PLUGIN_AUTH */)
+#define SERVER_STATUS_AUTOCOMMIT 0x0002
+#define MYSQL_TYPE_VAR_STRING 0xfd
+#define CHARSET_LATIN1 8
+
+struct options {
+  int port;
+  const char *unix_socket;
+  int threads;
+  unsigned long long rows;
+  unsigned int cols;
+  size_t row_size;
+  unsigned long packet_delay_us;
+  size_t frag_size;
+  unsigned long frag_delay_us;
+};
+
+static struct options opt= { 3306, NULL, 1, 10, 1, 100, 0, 0, 0 };
+
+/* What an epoll event refers to. */
+enum ev_type { EV_LISTEN, EV_TIMER, EV_CONN };
+
+struct listener {
+  enum ev_type type;
+  int fd;
+};
+
+/* The reply being generated on a connection. */
+enum reply {
+  REPLY_NONE, REPLY_GREETING, REPLY_OK, REPLY_ERR, REPLY_RS_HEADER,
+  REPLY_RS_COLS, REPLY_RS_COLS_EOF, REPLY_RS_ROWS, REPLY_RS_EOF
+};
+
+struct worker;
+
+struct conn {
+  enum ev_type type;
+  int fd;
+  struct worker *w;
+  int authenticated;
+  /* Sequence number of the next packet sent. */
+  unsigned char seq;
+  /* Received data not yet processed. */
+  unsigned char *in;
+  size_t in_pos, in_len, in_size;
+  /* Generated data not yet sent. */
+  unsigned char *out;
+  size_t out_pos, out_len, out_size;
+  enum reply reply;
+  const char *err_msg;
+  unsigned int cols, col;
+  unsigned long long rows_left;
+  size_t col_size;
+  /* The packet delay for the next packet has been waited. */
+  int delayed;
+  /* Waiting for a packet or fragment delay. */
+  struct my_timer timer;
+};
+
+struct worker {
+  enum ev_type type;
+  int epfd;
+  int tfd;
+  /* The tick the timerfd is set for, or MY_TIMER_NEVER. */
+  unsigned long long armed;
+  struct my_timer_wheel wheel;
+  pthread_t thread;
+};
+
+static struct listener listeners[2];
+static int listener_count= 0;
+static unsigned int next_conn_id= 1;
+
+
+static unsigned long long
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int
+buf_reserve(unsigned char **buf, size_t *size, size_t needed)
+{
+  size_t new_size;
+  unsigned char *p;
+
+  if (needed <= *size)
+    return 0;
+  for (new_size= *size ? *size : 1024; new_size < needed; new_size*= 2)
+    ;
+  if (!(p= realloc(*buf, new_size)))
+    return -1;
+  *buf= p;
+  *size= new_size;
+  return 0;
+}
+
+
+static void
+conn_close(struct conn *c)
+{
+  my_timer_cancel(&c->w->wheel, &c->timer);
+  /* Closing also removes it from the epoll set. */
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+
+/*
+  Start a packet of at most max_len payload bytes in the output buffer.
+  Returns where to write the payload, or NULL if out of memory.
+*/
+static unsigned char *
+pkt_begin(struct conn *c, size_t max_len)
+{
+  if (buf_reserve(&c->out, &c->out_size, c->out_len + 4 + max_len))
+    return NULL;
+  return c->out + c->out_len + 4;
+}
+
+static void
+pkt_end(struct conn *c, unsigned char *end)
+{
+  unsigned char *hdr= c->out + c->out_len;
+  size_t len= end - (hdr + 4);
+
+  hdr[0]= len & 0xff;
+  hdr[1]= (len >> 8) & 0xff;
+  hdr[2]= (len >> 16) & 0xff;
+  hdr[3]= c->seq++;
+  c->out_len+= 4 + len;
+}
+
+static unsigned char *
+put_int(unsigned char *p, unsigned long long v, int bytes)
+{
+  while (bytes-- > 0)
+  {
+    *p++= v & 0xff;
+    v>>= 8;
+  }
+  return p;
+}
+
+static unsigned char *
+put_lenenc(unsigned char *p, unsigned long long v)
+{
+  if (v < 251)
+    return put_int(p, v, 1);
+  if (v < 0x10000)
+  {
+    *p++= 0xfc;
+    return put_int(p, v, 2);
+  }
+  if (v < 0x1000000)
+  {
+    *p++= 0xfd;
+    return put_int(p, v, 3);
+  }
+  *p++= 0xfe;
+  return put_int(p, v, 8);
+}
+
+static unsigned char *
+put_lenenc_str(unsigned char *p, const char *s, size_t len)
+{
+  p= put_lenenc(p, len);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+
+static int
+put_greeting(struct conn *c)
+{
+  static const char version[]= "5.5.99-mock";
+  static const char plugin[]= "mysql_native_password";
+  unsigned char *p;
+
+  if (!(p= pkt_begin(c, 128)))
+    return -1;
+  *p++= 10;                                     /* Protocol version */
+  memcpy(p, version, sizeof(version));
+  p+= sizeof(version);
+  p= put_int(p, __atomic_fetch_add(&next_conn_id, 1, __ATOMIC_RELAXED), 4);
+  memcpy(p, "abcdefgh", 8);                     /* Scramble, part 1 */
+  p+= 8;
+  *p++= 0;
+  p= put_int(p, SERVER_CAPABILITIES & 0xffff, 2);
+  *p++= CHARSET_LATIN1;
+  p= put_int(p, SERVER_STATUS_AUTOCOMMIT, 2);
+  p= put_int(p, SERVER_CAPABILITIES >> 16, 2);
+  *p++= 21;                                     /* Length of scramble */
+  memset(p, 0, 10);
+  p+= 10;
+  memcpy(p, "ijklmnopqrst", 13);                /* Part 2, with NUL */
+  p+= 13;
+  memcpy(p, plugin, sizeof(plugin));
+  p+= sizeof(plugin);
+  pkt_end(c, p);
+  return 0;
+}
+
+static int
+put_ok(struct conn *c)
+{
+  unsigned char *p;
+
+  if (!(p= pkt_begin(c, 7)))
+    return -1;
+  *p++= 0x00;
+  *p++= 0;                                      /* Affected rows */
+  *p++= 0;                                      /* Insert id */
+  p= put_int(p, SERVER_STATUS_AUTOCOMMIT, 2);
+  p= put_int(p, 0, 2);                          /* Warnings */
+  pkt_end(c, p);
+  return 0;
+}
+
+static int
+put_eof(struct conn *c)
+{
+  unsigned char *p;
+
+  if (!(p= pkt_begin(c, 5)))
+    return -1;
+  *p++= 0xfe;
+  p= put_int(p, 0, 2);                          /* Warnings */
+  p= put_int(p, SERVER_STATUS_AUTOCOMMIT, 2);
+  pkt_end(c, p);
+  return 0;
+}
+
+static int
+put_err(struct conn *c, unsigned int code, const char *msg)
+{
+  unsigned char *p;
+  size_t len= strlen(msg);
+
+  if (!(p= pkt_begin(c, 9 + len)))
+    return -1;
+  *p++= 0xff;
+  p= put_int(p, code, 2);
+  memcpy(p, "#HY000", 6);
+  p+= 6;
+  memcpy(p, msg, len);
+  pkt_end(c, p + len);
+  return 0;
+}
+
+static int
+put_column(struct conn *c, unsigned int i)
+{
+  char name[16];
+  size_t len= snprintf(name, sizeof(name), "c%u", i + 1);
+  unsigned char *p;
+
+  if (!(p= pkt_begin(c, 64)))
+    return -1;
+  p= put_lenenc_str(p, "def", 3);               /* Catalog */
+  p= put_lenenc_str(p, "test", 4);              /* Schema */
+  p= put_lenenc_str(p, "t1", 2);                /* Table */
+  p= put_lenenc_str(p, "t1", 2);                /* Original table */
+  p= put_lenenc_str(p, name, len);              /* Name */
+  p= put_lenenc_str(p, name, len);              /* Original name */
+  *p++= 0x0c;                                   /* Length of the rest */
+  p= put_int(p, CHARSET_LATIN1, 2);
+  p= put_int(p, c->col_size, 4);
+  *p++= MYSQL_TYPE_VAR_STRING;
+  p= put_int(p, 0, 2);                          /* Flags */
+  *p++= 0;                                      /* Decimals */
+  p= put_int(p, 0, 2);
+  pkt_end(c, p);
+  return 0;
+}
+
+static int
+put_row(struct conn *c)
+{
+  unsigned char *p;
+  unsigned int i;
+  /* Vary the data a bit from row to row. */
+  int fill= 'a' + (int)(c->rows_left % 26);
+
+  if (!(p= pkt_begin(c, c->cols * (9 + c->col_size))))
+    return -1;
+  for (i= 0; i < c->cols; i++)
+  {
+    p= put_lenenc(p, c->col_size);
+    memset(p, fill, c->col_size);
+    p+= c->col_size;
+  }
+  pkt_end(c, p);
+  return 0;
+}
+
+
+/*
+  Generate the next packet of the reply into the output buffer, or (without
+  a packet delay) packets up to FILL_TARGET bytes.
+  Returns 0 if ok, -1 if out of memory.
+*/
+static int
+reply_fill(struct conn *c)
+{
+  int res= 0;
+
+  do
+  {
+    switch (c->reply)
+    {
+    case REPLY_NONE:
+      return 0;
+    case REPLY_GREETING:
+      res= put_greeting(c);
+      c->reply= REPLY_NONE;
+      break;
+    case REPLY_OK:
+      res= put_ok(c);
+      c->reply= REPLY_NONE;
+      break;
+    case REPLY_ERR:
+      res= put_err(c, 1047, c->err_msg);
+      c->reply= REPLY_NONE;
+      break;
+    case REPLY_RS_HEADER:
+      if (!(res= -!pkt_begin(c, 9)))
+        pkt_end(c, put_lenenc(c->out + c->out_len + 4, c->cols));
+      c->col= 0;
+      c->reply= REPLY_RS_COLS;
+      break;
+    case REPLY_RS_COLS:
+      res= put_column(c, c->col);
+      if (++c->col == c->cols)
+        c->reply= REPLY_RS_COLS_EOF;
+      break;
+    case REPLY_RS_COLS_EOF:
+      res= put_eof(c);
+      c->reply= c->rows_left ? REPLY_RS_ROWS : REPLY_RS_EOF;
+      break;
+    case REPLY_RS_ROWS:
+      res= put_row(c);
+      if (!--c->rows_left)
+        c->reply= REPLY_RS_EOF;
+      break;
+    case REPLY_RS_EOF:
+      res= put_eof(c);
+      c->reply= REPLY_NONE;
+      break;
+    }
+  } while (!res && !opt.packet_delay_us && c->reply != REPLY_NONE &&
+           c->out_len < FILL_TARGET);
+  return res;
+}
+
+
+/* Get a "name=N" setting from a query, or def if not present. */
+static unsigned long long
+query_setting(const char *q, size_t len, const char *name,
+              unsigned long long def)
+{
+  size_t n= strlen(name);
+  const char *p;
+
+  for (p= q; p + n < q + len; p++)
+  {
+    if (!memcmp(p, name, n) && p[n] == '=')
+    {
+      unsigned long long v= 0;
+      for (p+= n + 1; p < q + len && *p >= '0' && *p <= '9'; p++)
+        v= v * 10 + (*p - '0');
+      return v;
+    }
+  }
+  return def;
+}
+
+static void
+start_query(struct conn *c, const char *q, size_t len)
+{
+  unsigned long long row_size;
+
+  while (len && (*q == ' ' || *q == '\t' || *q == '\n' || *q == '('))
+  {
+    q++;
+    len--;
+  }
+  if (!(len >= 6 && !strncasecmp(q, "SELECT", 6)) &&
+      !(len >= 4 && !strncasecmp(q, "SHOW", 4)))
+  {
+    c->reply= REPLY_OK;
+    return;
+  }
+  c->rows_left= query_setting(q, len, "rows", opt.rows);
+  c->cols= query_setting(q, len, "cols", opt.cols);
+  row_size= query_setting(q, len, "size", opt.row_size);
+  if (c->cols < 1 || c->cols > 4096 ||
+      row_size / c->cols + 9 > MAX_PACKET / c->cols)
+  {
+    c->err_msg= "Bad cols= or size= for mock server";
+    c->reply= REPLY_ERR;
+    return;
+  }
+  c->col_size= row_size / c->cols;
+  c->reply= REPLY_RS_HEADER;
+}
+
+
+/*
+  Start the reply to the next complete command packet received, if any.
+  Returns 1 if a reply was started, 0 if there is no complete command,
+  -1 if the connection is to be closed.
+*/
+static int
+conn_command(struct conn *c)
+{
+  unsigned char *p= c->in + c->in_pos;
+  size_t avail= c->in_len - c->in_pos;
+  size_t len;
+
+  if (avail < 4)
+    return 0;
+  len= p[0] | (p[1] << 8) | (p[2] << 16);
+  if (len == MAX_PACKET)
+    return -1;                      /* Multi-packet, not supported */
+  if (avail < 4 + len)
+    return 0;
+  c->seq= p[3] + 1;
+  c->in_pos+= 4 + len;
+  if (c->in_pos == c->in_len)
+    c->in_pos= c->in_len= 0;
+  p+= 4;
+
+  if (!c->authenticated)
+  {
+    /* Handshake response; any user and password will do. */
+    c->authenticated= 1;
+    c->reply= REPLY_OK;
+    return 1;
+  }
+  if (!len)
+    return -1;
+  switch (p[0])
+  {
+  case COM_QUIT:
+    return -1;
+  case COM_QUERY:
+    start_query(c, (const char *)p + 1, len - 1);
+    break;
+  case COM_INIT_DB:
+  case COM_PING:
+    c->reply= REPLY_OK;
+    break;
+  default:
+    c->err_msg= "Unknown command";
+    c->reply= REPLY_ERR;
+    break;
+  }
+  return 1;
+}
+
+
+/*
+  Send (part of) the output buffer. Returns 1 if something was sent and we
+  can go on, 0 if we have to wait (for the socket or a fragment delay),
+  -1 if the connection is to be closed.
+*/
+static int
+conn_send(struct conn *c)
+{
+  size_t n= c->out_len - c->out_pos;
+  ssize_t res;
+
+  if (opt.frag_size && n > opt.frag_size)
+    n= opt.frag_size;
+  res= send(c->fd, c->out + c->out_pos, n, MSG_NOSIGNAL);
+  if (res < 0)
+    return errno == EAGAIN ? 0 : -1;
+  c->out_pos+= res;
+  if (opt.frag_delay_us && c->out_pos < c->out_len)
+  {
+    my_timer_add(&c->w->wheel, &c->timer, now_us() + opt.frag_delay_us);
+    return 0;
+  }
+  return 1;
+}
+
+
+/*
+  Make as much progress as possible: send pending output, generate more of
+  the reply, start replying to the next command. Frees the connection if
+  it is to be closed.
+*/
+static void
+conn_run(struct conn *c)
+{
+  int res;
+
+  for (;;)
+  {
+    if (c->out_pos < c->out_len)
+    {
+      if ((res= conn_send(c)) <= 0)
+        break;
+      continue;
+    }
+    c->out_pos= c->out_len= 0;
+    if (c->reply == REPLY_NONE && (res= conn_command(c)) <= 0)
+      break;
+    if (opt.packet_delay_us && !c->delayed)
+    {
+      c->delayed= 1;
+      my_timer_add(&c->w->wheel, &c->timer, now_us() + opt.packet_delay_us);
+      return;
+    }
+    c->delayed= 0;
+    if (reply_fill(c))
+    {
+      res= -1;
+      break;
+    }
+  }
+  if (res < 0)
+    conn_close(c);
+}
+
+
+/* Read all that is available. Returns -1 on EOF or error. */
+static int
+conn_read(struct conn *c)
+{
+  ssize_t res;
+
+  for (;;)
+  {
+    if (c->in_size - c->in_len < 1024)
+    {
+      if (c->in_len > 4 + MAX_PACKET ||
+          buf_reserve(&c->in, &c->in_size, c->in_len + 1024))
+        return -1;
+    }
+    res= recv(c->fd, c->in + c->in_len, c->in_size - c->in_len, 0);
+    if (res > 0)
+      c->in_len+= res;
+    else if (res == 0 || errno != EAGAIN)
+      return -1;
+    else
+      return 0;
+  }
+}
+
+
+static void
+conn_event(struct conn *c, unsigned int events)
+{
+  if ((events & EPOLLIN) && conn_read(c))
+  {
+    conn_close(c);
+    return;
+  }
+  if (!my_timer_pending(&c->timer))
+    conn_run(c);
+}
+
+
+static void
+accept_conns(struct worker *w, struct listener *l)
+{
+  int fd, one= 1;
+  struct conn *c;
+  struct epoll_event ev;
+
+  while ((fd= accept4(l->fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+  {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!(c= calloc(1, sizeof(*c))))
+    {
+      close(fd);
+      continue;
+    }
+    c->type= EV_CONN;
+    c->fd= fd;
+    c->w= w;
+    my_timer_init(&c->timer);
+    ev.events= EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr= c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev))
+    {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->reply= REPLY_GREETING;
+    conn_run(c);
+  }
+}
+
+
+static void
+timer_expired(struct my_timer *timer, void *arg)
+{
+  struct conn *c= (struct conn *)
+    ((char *)timer - offsetof(struct conn, timer));
+
+  (void)arg;
+  conn_run(c);
+}
+
+
+/* Set the timerfd for the next timer in the wheel, if that changed. */
+static void
+worker_arm_timer(struct worker *w)
+{
+  unsigned long long next= my_timer_wheel_next(&w->wheel);
+  struct itimerspec its;
+
+  if (next == w->armed)
+    return;
+  memset(&its, 0, sizeof(its));
+  if (next != MY_TIMER_NEVER)
+  {
+    /* A zero it_value would disarm the timer. */
+    if (!next)
+      next= 1;
+    its.it_value.tv_sec= next / 1000000;
+    its.it_value.tv_nsec= (next % 1000000) * 1000;
+  }
+  timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+  w->armed= next;
+}
+
+
+static void *
+worker_run(void *arg)
+{
+  struct worker *w= (struct worker *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  unsigned long long expirations;
+  int i, n;
+
+  for (;;)
+  {
+    n= epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+    if (n < 0 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (i= 0; i < n; i++)
+    {
+      enum ev_type type= *(enum ev_type *)events[i].data.ptr;
+
+      if (type == EV_LISTEN)
+        accept_conns(w, (struct listener *)events[i].data.ptr);
+      else if (type == EV_TIMER)
+      {
+        if (read(w->tfd, &expirations, sizeof(expirations)) < 0)
+          continue;
+        w->armed= MY_TIMER_NEVER;
+      }
+      else
+        conn_event((struct conn *)events[i].data.ptr, events[i].events);
+    }
+    my_timer_wheel_expire(&w->wheel, now_us(), timer_expired, NULL);
+    worker_arm_timer(w);
+  }
+  return NULL;
+}
+
+
+static int
+worker_init(struct worker *w)
+{
+  struct epoll_event ev;
+  int i;
+
+  w->type= EV_TIMER;
+  w->armed= MY_TIMER_NEVER;
+  my_timer_wheel_init(&w->wheel, now_us());
+  if ((w->epfd= epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      (w->tfd= timerfd_create(CLOCK_MONOTONIC,
+                              TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    return -1;
+  ev.events= EPOLLIN;
+  ev.data.ptr= w;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &ev))
+    return -1;
+  for (i= 0; i < listener_count; i++)
+  {
+    /* Wake only one worker per new connection. */
+    ev.events= EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr= &listeners[i];
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev))
+      return -1;
+  }
+  return 0;
+}
+
+
+static int
+listen_tcp(int port)
+{
+  struct sockaddr_in addr;
+  int fd, one= 1;
+
+  if ((fd= socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family= AF_INET;
+  addr.sin_port= htons(port);
+  addr.sin_addr.s_addr= htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(fd, SOMAXCONN))
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+listen_unix(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path) ||
+      (fd= socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family= AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(fd, SOMAXCONN))
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-p port] [-S unix_socket] [-t threads] [-r rows]\n"
+          "          [-c cols] [-s row_size] [-d packet_delay_us]\n"
+          "          [-f frag_size] [-F frag_delay_us]\n"
+          "  -p 0 disables TCP.\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct worker *workers;
+  struct rlimit rl;
+  int i, c;
+
+  while ((c= getopt(argc, argv, "p:S:t:r:c:s:d:f:F:")) != -1)
+  {
+    switch (c)
+    {
+    case 'p': opt.port= atoi(optarg); break;
+    case 'S': opt.unix_socket= optarg; break;
+    case 't': opt.threads= atoi(optarg); break;
+    case 'r': opt.rows= strtoull(optarg, NULL, 10); break;
+    case 'c': opt.cols= atoi(optarg); break;
+    case 's': opt.row_size= strtoul(optarg, NULL, 10); break;
+    case 'd': opt.packet_delay_us= strtoul(optarg, NULL, 10); break;
+    case 'f': opt.frag_size= strtoul(optarg, NULL, 10); break;
+    case 'F': opt.frag_delay_us= strtoul(optarg, NULL, 10); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (opt.threads < 1 || opt.cols < 1 || (!opt.port && !opt.unix_socket))
+    usage(argv[0]);
+
+  /* Allow as many connections as the hard limit permits. */
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+  {
+    rl.rlim_cur= rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  if (opt.port)
+  {
+    listeners[listener_count].type= EV_LISTEN;
+    if ((listeners[listener_count++].fd= listen_tcp(opt.port)) < 0)
+    {
+      perror("TCP listen");
+      exit(1);
+    }
+  }
+  if (opt.unix_socket)
+  {
+    listeners[listener_count].type= EV_LISTEN;
+    if ((listeners[listener_count++].fd= listen_unix(opt.unix_socket)) < 0)
+    {
+      perror("Unix socket listen");
+      exit(1);
+    }
+  }
+
+  if (!(workers= calloc(opt.threads, sizeof(*workers))))
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (i= 0; i < opt.threads; i++)
+  {
+    if (worker_init(&workers[i]))
+    {
+      perror("worker init");
+      exit(1);
+    }
+  }
+  for (i= 1; i < opt.threads; i++)
+  {
+    if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+    {
+      fprintf(stderr, "Cannot start worker thread\n");
+      exit(1);
+    }
+  }
+  fprintf(stderr, "mock-server: port %d, socket %s, %d thread(s)\n",
+          opt.port, opt.unix_socket ? opt.unix_socket : "-", opt.threads);
+  worker_run(&workers[0]);
+  return 0;
+}
@@ -25,12 +25,27 @@
   libmysqlclient-async code.
 
   (This particular implementation uses Posix ucontext swapcontext().)
+
+  Define MY_CONTEXT_INLINE before including this to get the assembler
+  implementations as static inline functions, so that the context switches
+  are inlined into the caller (it is ignored for the other
+  implementations).
 */
 
+#ifndef MY_CONTEXT_H
+#define MY_CONTEXT_H
+
 #ifdef __WIN__
 #define MY_CONTEXT_USE_WIN32_FIBERS 1
+#elif defined(MY_CONTEXT_USE_UCONTEXT)
+/*
+  Explicitly requested from the command line, eg. to compare the portable
+  implementation against the assembler one.
+*/
 #elif defined(__GNUC__) && __GNUC__ >= 3 && defined(__x86_64__)
 #define MY_CONTEXT_USE_X86_64_GCC_ASM
+#elif defined(__GNUC__) && __GNUC__ >= 3 && defined(__aarch64__)
+#define MY_CONTEXT_USE_AARCH64_GCC_ASM
 #else
 #define MY_CONTEXT_USE_UCONTEXT
 #endif
@@ -39,6 +54,17 @@
 #error Windows Fiber-based my_context not yet implemented
 #endif
 
+#if defined(MY_CONTEXT_INLINE) && !defined(MY_CONTEXT_USE_X86_64_GCC_ASM) && \
+  !defined(MY_CONTEXT_USE_AARCH64_GCC_ASM)
+#undef MY_CONTEXT_INLINE
+#endif
+
+#ifdef MY_CONTEXT_INLINE
+#define MY_CONTEXT_API static inline __attribute__((always_inline))
+#else
+#define MY_CONTEXT_API extern
+#endif
+
 
 #ifdef MY_CONTEXT_USE_UCONTEXT
 #include <ucontext.h>
@@ -61,6 +87,15 @@ struct my_context {
 };
 #endif
 
+
+#ifdef MY_CONTEXT_USE_AARCH64_GCC_ASM
+#include <stdint.h>
+
+struct my_context {
+  uint64_t save[43];
+};
+#endif
+
 /*
   Spawn an asynchroneous context. The context will run the supplied user
   function, passing the supplied user data pointer.
@@ -74,8 +109,9 @@ struct my_context {
 
   In case of error, -1 is returned.
 */
-extern int my_context_spawn(struct my_context *c, void (*f)(void *), void *d,
-                            void *stack, size_t stack_size);
+MY_CONTEXT_API int my_context_spawn(struct my_context *c,
+                                    void (*f)(void *), void *d,
+                                    void *stack, size_t stack_size);
 
 /*
   Suspend an asynchroneous context started with my_context_spawn.
@@ -87,7 +123,7 @@ extern int my_context_spawn(struct my_context *c, void (*f)(void *), void *d,
 
   Returns 0 if ok, -1 in case of error.
 */
-extern int my_context_yield(struct my_context *c);
+MY_CONTEXT_API int my_context_yield(struct my_context *c);
 
 /*
   Resume an asynchroneous context. The context was spawned by
@@ -101,4 +137,10 @@ extern int my_context_yield(struct my_context *c);
 
   In case of error, -1 is returned.
 */
-extern int my_context_continue(struct my_context *c);
+MY_CONTEXT_API int my_context_continue(struct my_context *c);
+
+#ifdef MY_CONTEXT_INLINE
+#include "my_context_asm.h"
+#endif
+
+#endif  /* MY_CONTEXT_H */
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "my_context.h"
+#include "my_trace.h"
 
 /*
   Layout of saved registers etc.
@@ -43,6 +44,7 @@ my_context_spawn(struct my_context *c, void (*f)(void *), void *d,
   int ret;
   void *stack_2= stack + stack_size;
 
+  MY_TRACE3(my_context, spawn, c, f, stack);
   /*
     There are 6 callee-save registers we need to save and restore when
     suspending and continuing, plus stack pointer %rsp and instruction pointer
@@ -75,9 +77,11 @@ my_context_spawn(struct my_context *c, void (*f)(void *), void *d,
      /*
        Come here when operation is done.
        We do not need to restore callee-save registers, as the called function
-       will do this for us if needed.
+       will do this for us if needed. But we do need to switch back to the
+       original stack.
      */
      "1:\n\t"
+     "movq 64(%[save]), %%rsp\n\t"
      "xorl %[ret], %[ret]\n\t"
      "jmp 3f\n"
      /* Come here when operation was suspended. */
@@ -100,6 +104,8 @@ int
 my_context_continue(struct my_context *c)
 {
   int ret;
+
+  MY_TRACE1(my_context, continue, c);
   __asm__ __volatile__
     (
      "movq %%rsp, 64(%[save])\n\t"
@@ -114,14 +120,19 @@ my_context_continue(struct my_context *c)
      "movq %%rax, 120(%[save])\n\t"
      "movq %%rcx, 128(%[save])\n\t"
 
+     /*
+       %[save] is itself held in %rbx, so %rbx must be restored last, after
+       all other accesses to the save area.
+     */
+     "movq 56(%[save]), %%rcx\n\t"
      "movq (%[save]), %%rsp\n\t"
      "movq 8(%[save]), %%rbp\n\t"
-     "movq 16(%[save]), %%rbx\n\t"
      "movq 24(%[save]), %%r12\n\t"
      "movq 32(%[save]), %%r13\n\t"
      "movq 40(%[save]), %%r14\n\t"
      "movq 48(%[save]), %%r15\n\t"
-     "jmpq *56(%[save])\n"
+     "movq 16(%[save]), %%rbx\n\t"
+     "jmpq *%%rcx\n"
      /*
        Come here when operation is done.
        Be sure to use the same callee-save register for %[save] here and in
@@ -130,11 +141,11 @@ my_context_continue(struct my_context *c)
      "1:\n\t"
      "movq 64(%[save]), %%rsp\n\t"
      "movq 72(%[save]), %%rbp\n\t"
-     "movq 80(%[save]), %%rbx\n\t"
      "movq 88(%[save]), %%r12\n\t"
      "movq 96(%[save]), %%r13\n\t"
      "movq 104(%[save]), %%r14\n\t"
      "movq 112(%[save]), %%r15\n\t"
+     "movq 80(%[save]), %%rbx\n\t"
      "xorl %[ret], %[ret]\n\t"
      "jmp 3f\n"
      /* Come here when operation is suspended. */
@@ -153,6 +164,8 @@ int
 my_context_yield(struct my_context *c)
 {
   uint64_t *save= &c->save[0];
+
+  MY_TRACE1(my_context, yield, c);
   __asm__ __volatile__
     (
      "movq %%rsp, (%[save])\n\t"
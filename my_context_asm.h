@@ -0,0 +1,514 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The assembler implementations of my_context.
+
+  This is included from my_context.c, to define the functions normally, and
+  from my_context.h when MY_CONTEXT_INLINE is defined, to define them static
+  inline so that the context switch is inlined into the caller. Not to be
+  included directly otherwise.
+
+  The save areas only hold the registers that are callee-saved in the ABI.
+  That is enough for an out-of-line call, after which the compiler assumes
+  all other registers are clobbered anyway. When inlined, the caller may
+  keep values in floating point/vector registers across the switch, so
+  those that are not saved must be declared clobbered; MY_CONTEXT_FP_CLOBBERS
+  adds them (and is empty out-of-line, where they cost nothing but would
+  make the compiler save d8-d15 on aarch64 twice).
+*/
+
+#ifndef MY_CONTEXT_ASM_H
+#define MY_CONTEXT_ASM_H
+
+#include "my_trace.h"
+
+#if !defined(MY_CONTEXT_INLINE)
+#define MY_CONTEXT_FP_CLOBBERS
+#elif defined(MY_CONTEXT_USE_X86_64_GCC_ASM)
+#ifdef __AVX512F__
+#define MY_CONTEXT_AVX512_CLOBBERS ,                                    \
+  "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22", "xmm23", \
+  "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29", "xmm30", "xmm31", \
+  "k1", "k2", "k3", "k4", "k5", "k6", "k7"
+#else
+#define MY_CONTEXT_AVX512_CLOBBERS
+#endif
+#define MY_CONTEXT_FP_CLOBBERS ,                                        \
+  "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",       \
+  "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15", \
+  "st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)"   \
+  MY_CONTEXT_AVX512_CLOBBERS
+#elif defined(MY_CONTEXT_USE_AARCH64_GCC_ASM)
+/*
+  Only the low 64 bits of v8-v15 are callee-saved, so all of v0-v31 must be
+  declared clobbered. The compiler then saves d8-d15 itself if it needs
+  them, and the copies in the save area are redundant but harmless.
+*/
+#define MY_CONTEXT_FP_CLOBBERS ,                                        \
+  "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",                       \
+  "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15",                 \
+  "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",               \
+  "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31"
+#endif
+
+
+#ifdef MY_CONTEXT_USE_X86_64_GCC_ASM
+/*
+  GCC-amd64 implementation of my_context.
+
+  This is slightly optimized in the common case where we never yield
+  (eg. fetch next row and it is already fully received in buffer). In this
+  case we do not need to restore registers at return (though we still need to
+  save them as we cannot know if we will yield or not in advance).
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+  Layout of saved registers etc.
+  Since this is accessed through gcc inline assembler, it is simpler to just
+  use numbers than to try to define nice constants or structs.
+
+   0    0   %rsp for suspended context
+   1    8   %rbp for suspended context
+   2   16   %rbx for suspended context
+   3   24   %r12 for suspended context
+   4   32   %r13 for suspended context
+   5   40   %r14 for suspended context
+   6   48   %r15 for suspended context
+   7   56   %rip for continue
+   8   64   %rsp for application context
+   9   72   %rbp for application context
+  10   80   %rbx for application context
+  11   88   %r12 for application context
+  12   96   %r13 for application context
+  13  104   %r14 for application context
+  14  112   %r15 for application context
+  15  120   %rip for done
+  16  128   %rip for yield
+*/
+
+MY_CONTEXT_API int
+my_context_spawn(struct my_context *c, void (*f)(void *), void *d,
+                 void *stack, size_t stack_size)
+{
+  int ret;
+  void *stack_2= stack + stack_size;
+
+  MY_TRACE3(my_context, spawn, c, f, stack);
+  /*
+    There are 6 callee-save registers we need to save and restore when
+    suspending and continuing, plus stack pointer %rsp and instruction pointer
+    %rip.
+
+    However, if we never suspend, the user-supplied function will in any case
+    restore the 6 callee-save registers, so we can avoid restoring them in
+    this case.
+  */
+  __asm__ __volatile__
+    (
+     "movq %%rsp, 64(%[save])\n\t"
+     "movq %[stack_2], %%rsp\n\t"
+     "movq %%rbp, 72(%[save])\n\t"
+     "movq %%rbx, 80(%[save])\n\t"
+     "movq %%r12, 88(%[save])\n\t"
+     "movq %%r13, 96(%[save])\n\t"
+     "movq %%r14, 104(%[save])\n\t"
+     "movq %%r15, 112(%[save])\n\t"
+     "leaq 1f(%%rip), %%rax\n\t"
+     "leaq 2f(%%rip), %%rcx\n\t"
+     "movq %%rax, 120(%[save])\n\t"
+     "movq %%rcx, 128(%[save])\n\t"
+     /*
+       Constraint below puts the argument to the user function into %rdi, as
+       needed for the calling convention.
+     */
+     "callq *%[f]\n\t"
+     "jmpq *120(%[save])\n"
+     /*
+       Come here when operation is done.
+       We do not need to restore callee-save registers, as the called function
+       will do this for us if needed. But we do need to switch back to the
+       original stack.
+     */
+     "1:\n\t"
+     "movq 64(%[save]), %%rsp\n\t"
+     "xorl %[ret], %[ret]\n\t"
+     "jmp 3f\n"
+     /* Come here when operation was suspended. */
+     "2:\n\t"
+     "movl $1, %[ret]\n"
+     "3:\n"
+     : [ret] "=a" (ret),
+       [f] "+S" (f),
+       /* Need this in %rdi to follow calling convention. */
+       [d] "+D" (d)
+     : [stack_2] "a" (stack_2),
+       /* Need this in callee-save register to preserve in function call. */
+       [save] "b" (&c->save[0])
+     : "rcx", "rdx", "r8", "r9", "r10", "r11", "memory", "cc"
+       MY_CONTEXT_FP_CLOBBERS
+  );
+  return ret;
+}
+
+MY_CONTEXT_API int
+my_context_continue(struct my_context *c)
+{
+  int ret;
+
+  MY_TRACE1(my_context, continue, c);
+  __asm__ __volatile__
+    (
+     "movq %%rsp, 64(%[save])\n\t"
+     "movq %%rbp, 72(%[save])\n\t"
+     "movq %%rbx, 80(%[save])\n\t"
+     "movq %%r12, 88(%[save])\n\t"
+     "movq %%r13, 96(%[save])\n\t"
+     "movq %%r14, 104(%[save])\n\t"
+     "movq %%r15, 112(%[save])\n\t"
+     "leaq 1f(%%rip), %%rax\n\t"
+     "leaq 2f(%%rip), %%rcx\n\t"
+     "movq %%rax, 120(%[save])\n\t"
+     "movq %%rcx, 128(%[save])\n\t"
+
+     /*
+       %[save] is itself held in %rbx, so %rbx must be restored last, after
+       all other accesses to the save area.
+     */
+     "movq 56(%[save]), %%rcx\n\t"
+     "movq (%[save]), %%rsp\n\t"
+     "movq 8(%[save]), %%rbp\n\t"
+     "movq 24(%[save]), %%r12\n\t"
+     "movq 32(%[save]), %%r13\n\t"
+     "movq 40(%[save]), %%r14\n\t"
+     "movq 48(%[save]), %%r15\n\t"
+     "movq 16(%[save]), %%rbx\n\t"
+     "jmpq *%%rcx\n"
+     /*
+       Come here when operation is done.
+       Be sure to use the same callee-save register for %[save] here and in
+       my_context_spawn(), so we preserve the value correctly at this point.
+     */
+     "1:\n\t"
+     "movq 64(%[save]), %%rsp\n\t"
+     "movq 72(%[save]), %%rbp\n\t"
+     "movq 88(%[save]), %%r12\n\t"
+     "movq 96(%[save]), %%r13\n\t"
+     "movq 104(%[save]), %%r14\n\t"
+     "movq 112(%[save]), %%r15\n\t"
+     "movq 80(%[save]), %%rbx\n\t"
+     "xorl %[ret], %[ret]\n\t"
+     "jmp 3f\n"
+     /* Come here when operation is suspended. */
+     "2:\n\t"
+     "movl $1, %[ret]\n"
+     "3:\n"
+     : [ret] "=a" (ret)
+     : /* Need this in callee-save register to preserve in function call. */
+       [save] "b" (&c->save[0])
+     : "rcx", "rdx", "rsi", "rdi", "r8", "r9", "r10", "r11", "memory", "cc"
+       MY_CONTEXT_FP_CLOBBERS
+        );
+  return ret;
+}
+
+MY_CONTEXT_API int
+my_context_yield(struct my_context *c)
+{
+  uint64_t *save= &c->save[0];
+
+  MY_TRACE1(my_context, yield, c);
+  __asm__ __volatile__
+    (
+     "movq %%rsp, (%[save])\n\t"
+     "movq %%rbp, 8(%[save])\n\t"
+     "movq %%rbx, 16(%[save])\n\t"
+     "movq %%r12, 24(%[save])\n\t"
+     "movq %%r13, 32(%[save])\n\t"
+     "movq %%r14, 40(%[save])\n\t"
+     "movq %%r15, 48(%[save])\n\t"
+     "leaq 1f(%%rip), %%rax\n\t"
+     "movq %%rax, 56(%[save])\n\t"
+
+     "movq 64(%[save]), %%rsp\n\t"
+     "movq 72(%[save]), %%rbp\n\t"
+     "movq 80(%[save]), %%rbx\n\t"
+     "movq 88(%[save]), %%r12\n\t"
+     "movq 96(%[save]), %%r13\n\t"
+     "movq 104(%[save]), %%r14\n\t"
+     "movq 112(%[save]), %%r15\n\t"
+     "jmpq *128(%[save])\n"
+
+     "1:\n"
+     : [save] "+D" (save)
+     :
+     : "rax", "rcx", "rdx", "rsi", "r8", "r9", "r10", "r11", "memory", "cc"
+       MY_CONTEXT_FP_CLOBBERS
+     );
+  return 0;
+}
+
+#endif  /* MY_CONTEXT_USE_X86_64_GCC_ASM */
+
+
+#ifdef MY_CONTEXT_USE_AARCH64_GCC_ASM
+/*
+  GCC-aarch64 implementation of my_context.
+
+  This works the same way as the amd64 implementation, including the
+  optimization for the common case where we never yield.
+
+  The callee-save registers are %x19-%x29 and the low 64 bits of %d8-%d15.
+  The link register %x30 is clobbered and left to the compiler to save.
+
+  All labels that are jumped to indirectly start with "hint #36", which is
+  BTI J when branch target identification is enabled and a no-op otherwise.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+  Layout of saved registers etc.
+
+   0    0   sp for suspended context
+   1    8   x19 for suspended context
+  ...
+  11   88   x29 for suspended context
+  12   96   d8 for suspended context
+  ...
+  19  152   d15 for suspended context
+  20  160   pc for continue
+  21  168   sp for application context
+  22  176   x19 for application context
+  ...
+  32  256   x29 for application context
+  33  264   d8 for application context
+  ...
+  40  320   d15 for application context
+  41  328   pc for done
+  42  336   pc for yield
+*/
+
+MY_CONTEXT_API int
+my_context_spawn(struct my_context *c, void (*f)(void *), void *d,
+                 void *stack, size_t stack_size)
+{
+  int ret;
+  /*
+    There are no constraint letters for individual registers on aarch64, so
+    use register variables to put the save area pointer in a callee-save
+    register (preserved across the call of the user function), and the
+    argument in %x0 as needed for the calling convention.
+  */
+  register uint64_t *save asm("x19");
+  register void *arg asm("x0");
+  register void (*func)(void *) asm("x1");
+  register void *stack_2 asm("x2");
+
+  /* Before the register variables are set, as the probe may use them. */
+  MY_TRACE3(my_context, spawn, c, f, stack);
+  save= &c->save[0];
+  arg= d;
+  func= f;
+  stack_2= stack + stack_size;
+
+  __asm__ __volatile__
+    (
+     "mov x10, sp\n\t"
+     "mov sp, %[stack_2]\n\t"
+     "str x10, [%[save], #168]\n\t"
+     "stp x19, x20, [%[save], #176]\n\t"
+     "stp x21, x22, [%[save], #192]\n\t"
+     "stp x23, x24, [%[save], #208]\n\t"
+     "stp x25, x26, [%[save], #224]\n\t"
+     "stp x27, x28, [%[save], #240]\n\t"
+     "str x29, [%[save], #256]\n\t"
+     "stp d8, d9, [%[save], #264]\n\t"
+     "stp d10, d11, [%[save], #280]\n\t"
+     "stp d12, d13, [%[save], #296]\n\t"
+     "stp d14, d15, [%[save], #312]\n\t"
+     "adr x10, 1f\n\t"
+     "adr x11, 2f\n\t"
+     "stp x10, x11, [%[save], #328]\n\t"
+     "blr %[f]\n\t"
+     "ldr x10, [%[save], #328]\n\t"
+     "br x10\n"
+     /*
+       Come here when operation is done.
+       As on amd64, the called function restored the callee-save registers,
+       we only need to switch back to the original stack.
+     */
+     "1:\n\t"
+     "hint #36\n\t"
+     "ldr x10, [%[save], #168]\n\t"
+     "mov sp, x10\n\t"
+     "mov %w[ret], #0\n\t"
+     "b 3f\n"
+     /* Come here when operation was suspended. */
+     "2:\n\t"
+     "hint #36\n\t"
+     "mov %w[ret], #1\n"
+     "3:\n"
+     : [ret] "=r" (ret),
+       [f] "+r" (func),
+       [d] "+r" (arg),
+       [stack_2] "+r" (stack_2)
+     : [save] "r" (save)
+     : "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12",
+       "x13", "x14", "x15", "x16", "x17", "x18", "x30", "memory", "cc"
+       MY_CONTEXT_FP_CLOBBERS
+  );
+  return ret;
+}
+
+MY_CONTEXT_API int
+my_context_continue(struct my_context *c)
+{
+  int ret;
+  register uint64_t *save asm("x19");
+
+  MY_TRACE1(my_context, continue, c);
+  save= &c->save[0];
+
+  __asm__ __volatile__
+    (
+     "mov x10, sp\n\t"
+     "str x10, [%[save], #168]\n\t"
+     "stp x19, x20, [%[save], #176]\n\t"
+     "stp x21, x22, [%[save], #192]\n\t"
+     "stp x23, x24, [%[save], #208]\n\t"
+     "stp x25, x26, [%[save], #224]\n\t"
+     "stp x27, x28, [%[save], #240]\n\t"
+     "str x29, [%[save], #256]\n\t"
+     "stp d8, d9, [%[save], #264]\n\t"
+     "stp d10, d11, [%[save], #280]\n\t"
+     "stp d12, d13, [%[save], #296]\n\t"
+     "stp d14, d15, [%[save], #312]\n\t"
+     "adr x10, 1f\n\t"
+     "adr x11, 2f\n\t"
+     "stp x10, x11, [%[save], #328]\n\t"
+
+     /* %[save] is %x19, so restore that last. */
+     "ldr x10, [%[save], #0]\n\t"
+     "mov sp, x10\n\t"
+     "ldp x20, x21, [%[save], #16]\n\t"
+     "ldp x22, x23, [%[save], #32]\n\t"
+     "ldp x24, x25, [%[save], #48]\n\t"
+     "ldp x26, x27, [%[save], #64]\n\t"
+     "ldp x28, x29, [%[save], #80]\n\t"
+     "ldp d8, d9, [%[save], #96]\n\t"
+     "ldp d10, d11, [%[save], #112]\n\t"
+     "ldp d12, d13, [%[save], #128]\n\t"
+     "ldp d14, d15, [%[save], #144]\n\t"
+     "ldr x10, [%[save], #160]\n\t"
+     "ldr x19, [%[save], #8]\n\t"
+     "br x10\n"
+     /*
+       Come here when operation is done.
+       Be sure to use the same callee-save register for %[save] here and in
+       my_context_spawn(), so we preserve the value correctly at this point.
+     */
+     "1:\n\t"
+     "hint #36\n\t"
+     "ldr x10, [%[save], #168]\n\t"
+     "mov sp, x10\n\t"
+     "ldp x20, x21, [%[save], #184]\n\t"
+     "ldp x22, x23, [%[save], #200]\n\t"
+     "ldp x24, x25, [%[save], #216]\n\t"
+     "ldp x26, x27, [%[save], #232]\n\t"
+     "ldp x28, x29, [%[save], #248]\n\t"
+     "ldp d8, d9, [%[save], #264]\n\t"
+     "ldp d10, d11, [%[save], #280]\n\t"
+     "ldp d12, d13, [%[save], #296]\n\t"
+     "ldp d14, d15, [%[save], #312]\n\t"
+     "ldr x19, [%[save], #176]\n\t"
+     "mov %w[ret], #0\n\t"
+     "b 3f\n"
+     /* Come here when operation is suspended. */
+     "2:\n\t"
+     "hint #36\n\t"
+     "mov %w[ret], #1\n"
+     "3:\n"
+     : [ret] "=r" (ret)
+     : [save] "r" (save)
+     : "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10",
+       "x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x30",
+       "memory", "cc"
+       MY_CONTEXT_FP_CLOBBERS
+        );
+  return ret;
+}
+
+MY_CONTEXT_API int
+my_context_yield(struct my_context *c)
+{
+  register uint64_t *save asm("x0");
+
+  MY_TRACE1(my_context, yield, c);
+  save= &c->save[0];
+  __asm__ __volatile__
+    (
+     "mov x10, sp\n\t"
+     "str x10, [%[save], #0]\n\t"
+     "stp x19, x20, [%[save], #8]\n\t"
+     "stp x21, x22, [%[save], #24]\n\t"
+     "stp x23, x24, [%[save], #40]\n\t"
+     "stp x25, x26, [%[save], #56]\n\t"
+     "stp x27, x28, [%[save], #72]\n\t"
+     "str x29, [%[save], #88]\n\t"
+     "stp d8, d9, [%[save], #96]\n\t"
+     "stp d10, d11, [%[save], #112]\n\t"
+     "stp d12, d13, [%[save], #128]\n\t"
+     "stp d14, d15, [%[save], #144]\n\t"
+     "adr x10, 1f\n\t"
+     "str x10, [%[save], #160]\n\t"
+
+     "ldr x10, [%[save], #168]\n\t"
+     "mov sp, x10\n\t"
+     "ldp x19, x20, [%[save], #176]\n\t"
+     "ldp x21, x22, [%[save], #192]\n\t"
+     "ldp x23, x24, [%[save], #208]\n\t"
+     "ldp x25, x26, [%[save], #224]\n\t"
+     "ldp x27, x28, [%[save], #240]\n\t"
+     "ldr x29, [%[save], #256]\n\t"
+     "ldp d8, d9, [%[save], #264]\n\t"
+     "ldp d10, d11, [%[save], #280]\n\t"
+     "ldp d12, d13, [%[save], #296]\n\t"
+     "ldp d14, d15, [%[save], #312]\n\t"
+     "ldr x10, [%[save], #336]\n\t"
+     "br x10\n"
+
+     "1:\n\t"
+     "hint #36\n"
+     : [save] "+r" (save)
+     :
+     : "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11",
+       "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x30", "memory", "cc"
+       MY_CONTEXT_FP_CLOBBERS
+     );
+  return 0;
+}
+
+#endif  /* MY_CONTEXT_USE_AARCH64_GCC_ASM */
+
+#endif  /* MY_CONTEXT_ASM_H */
@@ -0,0 +1,273 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the streaming decompression, see my_decompress.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "my_decompress.h"
+
+struct my_decompress {
+  enum my_decompress_codec codec;
+  /* Header of the current compressed packet, header_len bytes so far. */
+  unsigned char header[MY_DECOMPRESS_HEADER_SIZE];
+  size_t header_len;
+  /* Compressed bytes of the packet not yet fed to the codec. */
+  size_t in_left;
+  /* Bytes of the packet not yet output. */
+  size_t out_left;
+  /* The packet was sent uncompressed, and is just copied. */
+  int stored;
+  /* The codec has seen the end of the packet's compressed data. */
+  int finished;
+  z_stream zs;
+#ifdef HAVE_ZSTD
+  ZSTD_DCtx *zd;
+#endif
+};
+
+static size_t
+uint3(const unsigned char *p)
+{
+  return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16);
+}
+
+struct my_decompress *
+my_decompress_new(enum my_decompress_codec codec)
+{
+  struct my_decompress *d;
+
+#ifndef HAVE_ZSTD
+  if (codec == MY_DECOMPRESS_ZSTD)
+  {
+    errno= ENOSYS;
+    return NULL;
+  }
+#endif
+  if (codec != MY_DECOMPRESS_ZLIB && codec != MY_DECOMPRESS_ZSTD)
+  {
+    errno= EINVAL;
+    return NULL;
+  }
+  if (!(d= calloc(1, sizeof(*d))))
+    return NULL;
+  d->codec= codec;
+  if (codec == MY_DECOMPRESS_ZLIB)
+  {
+    if (inflateInit(&d->zs) != Z_OK)
+    {
+      free(d);
+      errno= ENOMEM;
+      return NULL;
+    }
+  }
+#ifdef HAVE_ZSTD
+  else if (!(d->zd= ZSTD_createDCtx()))
+  {
+    free(d);
+    errno= ENOMEM;
+    return NULL;
+  }
+#endif
+  return d;
+}
+
+void
+my_decompress_free(struct my_decompress *d)
+{
+  if (d->codec == MY_DECOMPRESS_ZLIB)
+    inflateEnd(&d->zs);
+#ifdef HAVE_ZSTD
+  else
+    ZSTD_freeDCtx(d->zd);
+#endif
+  free(d);
+}
+
+/* Start on a packet, its header is complete. */
+static int
+my_decompress_begin(struct my_decompress *d)
+{
+  d->in_left= uint3(d->header);
+  d->out_left= uint3(d->header + 4);
+  d->stored= d->finished= d->out_left == 0;
+  if (d->stored)
+    d->out_left= d->in_left;
+  else if (d->codec == MY_DECOMPRESS_ZLIB)
+    return inflateReset(&d->zs) == Z_OK ? 0 : -1;
+#ifdef HAVE_ZSTD
+  else
+    return ZSTD_isError(ZSTD_DCtx_reset(d->zd, ZSTD_reset_session_only)) ?
+      -1 : 0;
+#endif
+  return 0;
+}
+
+/*
+  Run the codec on *in_len bytes of in, with room for *out_len bytes in
+  out. Sets *in_len and *out_len to the bytes used and produced.
+*/
+static int
+my_decompress_step(struct my_decompress *d, const unsigned char *in,
+                   size_t *in_len, unsigned char *out, size_t *out_len)
+{
+  if (d->stored)
+  {
+    *in_len= *out_len= *in_len < *out_len ? *in_len : *out_len;
+    memcpy(out, in, *out_len);
+    return 0;
+  }
+  if (d->codec == MY_DECOMPRESS_ZLIB)
+  {
+    int err;
+
+    d->zs.next_in= (Bytef *)in;
+    d->zs.avail_in= (uInt)*in_len;
+    d->zs.next_out= out;
+    d->zs.avail_out= (uInt)*out_len;
+    err= inflate(&d->zs, Z_NO_FLUSH);
+    *in_len-= d->zs.avail_in;
+    *out_len-= d->zs.avail_out;
+    if (err == Z_STREAM_END)
+      d->finished= 1;
+    else if (err != Z_OK && err != Z_BUF_ERROR)
+      return -1;
+    return 0;
+  }
+#ifdef HAVE_ZSTD
+  {
+    ZSTD_inBuffer ib= { in, *in_len, 0 };
+    ZSTD_outBuffer ob= { out, *out_len, 0 };
+    size_t res= ZSTD_decompressStream(d->zd, &ob, &ib);
+
+    if (ZSTD_isError(res))
+      return -1;
+    *in_len= ib.pos;
+    *out_len= ob.pos;
+    if (res == 0)
+      d->finished= 1;
+  }
+#endif
+  return 0;
+}
+
+ssize_t
+my_decompress_run(struct my_decompress *d, const unsigned char *in,
+                  size_t in_len, size_t *consumed,
+                  unsigned char *out, size_t out_size)
+{
+  size_t in_pos= 0, out_pos= 0;
+  /* Room for output past the end of the packet, which is an error. */
+  unsigned char extra;
+
+  for (;;)
+  {
+    size_t n_in, n_out;
+    int was_finished= d->finished;
+
+    if (d->header_len < MY_DECOMPRESS_HEADER_SIZE)
+    {
+      if (in_pos == in_len)
+        break;
+      n_in= MY_DECOMPRESS_HEADER_SIZE - d->header_len;
+      if (n_in > in_len - in_pos)
+        n_in= in_len - in_pos;
+      memcpy(d->header + d->header_len, in + in_pos, n_in);
+      d->header_len+= n_in;
+      in_pos+= n_in;
+      if (d->header_len == MY_DECOMPRESS_HEADER_SIZE &&
+          my_decompress_begin(d))
+        goto err;
+      continue;
+    }
+    if (!d->out_left && d->finished)
+    {
+      if (d->in_left)
+        goto err;
+      /* Next packet. */
+      d->header_len= 0;
+      continue;
+    }
+    if (d->out_left && out_pos == out_size)
+      break;
+
+    n_in= in_len - in_pos;
+    if (n_in > d->in_left)
+      n_in= d->in_left;
+    if (d->out_left)
+    {
+      n_out= out_size - out_pos;
+      if (n_out > d->out_left)
+        n_out= d->out_left;
+      if (my_decompress_step(d, in + in_pos, &n_in, out + out_pos, &n_out))
+        goto err;
+    }
+    else
+    {
+      /* All output is there, the codec may have a trailer left to read. */
+      n_out= 1;
+      if (my_decompress_step(d, in + in_pos, &n_in, &extra, &n_out) ||
+          n_out)
+        goto err;
+    }
+    in_pos+= n_in;
+    d->in_left-= n_in;
+    out_pos+= n_out;
+    d->out_left-= n_out;
+    if (d->finished && d->out_left && !d->stored)
+      goto err;                         /* Shorter than the header said. */
+    if (!n_in && !n_out && d->finished == was_finished)
+    {
+      /*
+        No progress: more input is needed, unless the packet has no more or
+        the codec would not take what there is.
+      */
+      if (!d->in_left || in_pos < in_len)
+        goto err;
+      break;
+    }
+  }
+  *consumed= in_pos;
+  return out_pos;
+
+err:
+  *consumed= in_pos;
+  errno= EBADMSG;
+  return -1;
+}
+
+int
+my_decompress_idle(const struct my_decompress *d)
+{
+  return d->header_len == 0;
+}
+
+unsigned int
+my_decompress_pkt_nr(const struct my_decompress *d)
+{
+  return d->header[3];
+}
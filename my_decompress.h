@@ -0,0 +1,78 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Streaming decompression of the MySQL compressed protocol.
+
+  On a compressed connection, the stream of normal protocol packets is
+  cut into compressed packets, each with a 7-byte header (3 bytes length
+  of the compressed data, 1 byte sequence number, 3 bytes length
+  uncompressed, 0 if the data was sent uncompressed) followed by the data,
+  compressed on its own with zlib (or zstd).
+
+  The usual way is to read a whole compressed packet and then uncompress
+  it, which needs a buffer for all of it, and delays the first row in it
+  until the last byte has arrived. Here, the bytes are decompressed as
+  they are fed in, in pieces of any size, and the plain stream is output
+  as soon as it is decoded.
+*/
+
+#ifndef MY_DECOMPRESS_H
+#define MY_DECOMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum my_decompress_codec {
+  MY_DECOMPRESS_NONE, MY_DECOMPRESS_ZLIB, MY_DECOMPRESS_ZSTD
+};
+
+#define MY_DECOMPRESS_HEADER_SIZE 7
+
+struct my_decompress;
+
+/*
+  Create a decompressor. Returns NULL with errno ENOSYS if the codec was
+  not built in (zstd needs HAVE_ZSTD), or ENOMEM.
+*/
+extern struct my_decompress *
+my_decompress_new(enum my_decompress_codec codec);
+extern void my_decompress_free(struct my_decompress *d);
+
+/*
+  Decompress from in[0, in_len) into out[0, out_size), as far as either
+  goes. *consumed is set to the number of input bytes used; the rest must
+  be passed again in the next call.
+
+  Returns the number of bytes written to out. 0 means all input was used
+  and more is needed before there is more output. -1 means the input is
+  not a valid compressed stream, with errno EBADMSG.
+*/
+extern ssize_t my_decompress_run(struct my_decompress *d,
+                                 const unsigned char *in, size_t in_len,
+                                 size_t *consumed,
+                                 unsigned char *out, size_t out_size);
+
+/* True between compressed packets, ie. all input fed was output. */
+extern int my_decompress_idle(const struct my_decompress *d);
+
+/* Sequence number of the current (or last) compressed packet. */
+extern unsigned int my_decompress_pkt_nr(const struct my_decompress *d);
+
+#endif  /* MY_DECOMPRESS_H */
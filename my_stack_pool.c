@@ -0,0 +1,264 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the pool of mmap()ed stacks for my_context.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "my_stack_pool.h"
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/*
+  Written at the bottom of the part of a free stack that stack_release()
+  keeps resident. If it is still there when the stack is freed again, the
+  call did not go deeper, so there is nothing to give back.
+*/
+#define MY_STACK_KEEP_MARK 0x6b656570d00dfeedULL
+
+/* Used as size_class for stacks that are too big for any class. */
+#define MY_STACK_NO_CLASS ((unsigned int)-1)
+
+/*
+  The struct my_stack is stored at the very top of the mapping, just above
+  the usable stack area. We keep it 64-byte aligned, which also ensures that
+  the initial stack pointer is suitably aligned for any ABI.
+*/
+#define MY_STACK_HEADER_SIZE \
+  ((sizeof(struct my_stack) + 63) & ~(size_t)63)
+
+static size_t stack_classes[MY_STACK_MAX_CLASSES]=
+  { 8192, 16384, 65536, 262144 };
+static unsigned int stack_class_count= 4;
+/*
+  Set once the first stack has been allocated, after which the size classes
+  can no longer be changed (cached stacks refer to them by index).
+*/
+static int stack_pool_used= 0;
+static size_t page_size= 0;
+static size_t release_keep= MY_STACK_KEEP_RESIDENT;
+static int release_lazy= 1;
+
+static __thread struct my_stack *free_list[MY_STACK_MAX_CLASSES];
+static __thread unsigned int free_count[MY_STACK_MAX_CLASSES];
+
+
+int
+my_stack_pool_set_classes(const size_t *sizes, unsigned int count)
+{
+  unsigned int i;
+
+  if (stack_pool_used || count == 0 || count > MY_STACK_MAX_CLASSES)
+    return -1;
+  for (i= 1; i < count; i++)
+    if (sizes[i] <= sizes[i-1])
+      return -1;
+  for (i= 0; i < count; i++)
+    stack_classes[i]= sizes[i];
+  stack_class_count= count;
+  return 0;
+}
+
+
+void
+my_stack_pool_set_release(size_t keep_resident, int lazy)
+{
+  release_keep= keep_resident;
+  release_lazy= lazy;
+}
+
+
+static struct my_stack *
+stack_map(size_t usable_size, unsigned int size_class)
+{
+  size_t map_size;
+  char *base;
+  struct my_stack *s;
+
+  if (!page_size)
+    page_size= (size_t)sysconf(_SC_PAGESIZE);
+
+  /* One guard page, then usable stack and header rounded up to full pages. */
+  map_size= page_size +
+    ((usable_size + MY_STACK_HEADER_SIZE + page_size - 1) & ~(page_size - 1));
+  base= mmap(NULL, map_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+  if (mprotect(base + page_size, map_size - page_size,
+               PROT_READ | PROT_WRITE))
+  {
+    munmap(base, map_size);
+    return NULL;
+  }
+
+  s= (struct my_stack *)(base + map_size - MY_STACK_HEADER_SIZE);
+  s->stack= base + page_size;
+  s->stack_size= (char *)s - (base + page_size);
+  s->next= NULL;
+  s->map_base= base;
+  s->map_size= map_size;
+  s->size_class= size_class;
+  return s;
+}
+
+
+static void
+stack_unmap(struct my_stack *s)
+{
+  munmap(s->map_base, s->map_size);
+}
+
+
+/*
+  The lowest word of the top release_keep bytes of a stack, rounded down
+  to a page boundary (the stack starts on one), or NULL if that is all of
+  the stack.
+*/
+static uint64_t *
+stack_keep_mark(struct my_stack *s)
+{
+  size_t len;
+
+  if (release_keep >= s->stack_size)
+    return NULL;
+  if (!(len= (s->stack_size - release_keep) & ~(page_size - 1)))
+    return NULL;
+  return (uint64_t *)((char *)s->stack + len);
+}
+
+
+/*
+  Give the pages of a free stack below the top release_keep bytes back to
+  the kernel, if the call used them. The header at the top of the mapping
+  is never touched.
+*/
+static void
+stack_release(struct my_stack *s)
+{
+  uint64_t *mark= stack_keep_mark(s);
+  size_t len;
+
+  /*
+    The mark is normally overwritten by a call that went below it. A new
+    stack does not have it yet, so is released once on its first free.
+  */
+  if (!mark || *mark == MY_STACK_KEEP_MARK)
+    return;
+  len= (char *)mark - (char *)s->stack;
+#ifdef MADV_FREE
+  /* Not supported before Linux 4.5; then fall back to MADV_DONTNEED. */
+  if (!release_lazy || madvise(s->stack, len, MADV_FREE))
+#endif
+    madvise(s->stack, len, MADV_DONTNEED);
+  *mark= MY_STACK_KEEP_MARK;
+}
+
+
+struct my_stack *
+my_stack_alloc(size_t min_size)
+{
+  unsigned int i;
+  struct my_stack *s;
+
+  stack_pool_used= 1;
+  for (i= 0; i < stack_class_count; i++)
+  {
+    if (stack_classes[i] >= min_size)
+    {
+      if ((s= free_list[i]))
+      {
+        free_list[i]= s->next;
+        free_count[i]--;
+        s->next= NULL;
+        return s;
+      }
+      return stack_map(stack_classes[i], i);
+    }
+  }
+  return stack_map(min_size, MY_STACK_NO_CLASS);
+}
+
+
+void
+my_stack_free(struct my_stack *s)
+{
+  unsigned int i= s->size_class;
+
+  if (i == MY_STACK_NO_CLASS || free_count[i] >= MY_STACK_MAX_CACHED)
+  {
+    stack_unmap(s);
+    return;
+  }
+  stack_release(s);
+  s->next= free_list[i];
+  free_list[i]= s;
+  free_count[i]++;
+}
+
+
+void
+my_stack_paint(struct my_stack *s)
+{
+  memset(s->stack, MY_STACK_PAINT_BYTE, s->stack_size);
+}
+
+
+size_t
+my_stack_used(const struct my_stack *s)
+{
+  /* The stack is page aligned and its size a multiple of 64 bytes. */
+  const uint64_t *p= (const uint64_t *)s->stack;
+  const uint64_t *end= (const uint64_t *)((char *)s->stack + s->stack_size);
+  const uint64_t paint= 0x0101010101010101ULL * MY_STACK_PAINT_BYTE;
+
+  /* The stack grows down, so the first word changed is the deepest. */
+  while (p < end && *p == paint)
+    p++;
+  return (char *)end - (const char *)p;
+}
+
+
+void
+my_stack_pool_thread_end(void)
+{
+  unsigned int i;
+  struct my_stack *s, *next;
+
+  for (i= 0; i < MY_STACK_MAX_CLASSES; i++)
+  {
+    for (s= free_list[i]; s; s= next)
+    {
+      next= s->next;
+      stack_unmap(s);
+    }
+    free_list[i]= NULL;
+    free_count[i]= 0;
+  }
+}
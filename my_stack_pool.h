@@ -0,0 +1,136 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Pool of stacks for use with my_context_spawn().
+
+  Each async call needs a stack to run on while it may be suspended. Getting
+  a fresh one from malloc() for every call is expensive when there are many
+  short-lived calls, so stacks are instead taken from and returned to a
+  per-thread free list, one list per size class. In steady state, allocating
+  and freeing a stack thus costs neither a system call nor a malloc().
+
+  Stacks are mmap()ed, with a PROT_NONE guard page below the usable area, so
+  that a stack overflow crashes cleanly instead of silently overwriting
+  other memory.
+
+  Stacks are mapped with MAP_NORESERVE, so only the pages a call actually
+  touches use memory. When a stack is freed, the pages below the top
+  keep_resident bytes (which nearly every call uses) are given back to the
+  kernel with madvise(), so that a deep call does not leave a cached stack
+  holding memory. Thus memory use follows the depth of the calls in
+  progress rather than the number of stacks. This costs a system call per
+  free of a stack whose call went deeper than keep_resident (found with a
+  marker word at that depth), see my_stack_pool_set_release().
+
+  To find out how much stack a function really needs, paint the stack with
+  my_stack_paint() before running it, and afterwards my_stack_used() tells
+  the deepest point it reached.
+*/
+
+#ifndef MY_STACK_POOL_H
+#define MY_STACK_POOL_H
+
+#include <stddef.h>
+
+/* Maximum number of size classes that can be configured. */
+#define MY_STACK_MAX_CLASSES 8
+/* Maximum number of free stacks of each size class cached per thread. */
+#define MY_STACK_MAX_CACHED 64
+/* Default for the keep_resident of my_stack_pool_set_release(). */
+#define MY_STACK_KEEP_RESIDENT 16384
+/* Byte value my_stack_paint() fills the stack with. */
+#define MY_STACK_PAINT_BYTE 0xa5
+
+struct my_stack {
+  /*
+    The usable stack memory, to be passed to my_context_spawn(). The stack
+    grows down from stack + stack_size, with the guard page right below
+    stack.
+  */
+  void *stack;
+  size_t stack_size;
+
+  /* Private to the pool. */
+  struct my_stack *next;
+  void *map_base;
+  size_t map_size;
+  unsigned int size_class;
+};
+
+/*
+  Configure the size classes, in increasing order. A request for a stack is
+  served from the smallest class that is big enough; requests larger than
+  the biggest class are mmap()ed individually and never cached.
+
+  This must be called before the first my_stack_alloc(), otherwise the
+  built-in default classes are used.
+
+  Returns 0 if ok, -1 if the argument is invalid or stacks were already
+  allocated.
+*/
+extern int my_stack_pool_set_classes(const size_t *sizes, unsigned int count);
+
+/*
+  Set how much of the top of a freed stack stays resident; the rest is
+  released. (size_t)-1 disables the release. With lazy set, MADV_FREE is
+  used (where supported), which is cheaper but leaves the pages counted
+  in the RSS until the kernel needs the memory; otherwise MADV_DONTNEED.
+
+  Like my_stack_pool_set_classes(), call this before the first
+  my_stack_alloc(). The default is MY_STACK_KEEP_RESIDENT, lazy.
+*/
+extern void my_stack_pool_set_release(size_t keep_resident, int lazy);
+
+/*
+  Get a stack with at least min_size bytes of usable space.
+
+  Returns NULL if out of memory.
+*/
+extern struct my_stack *my_stack_alloc(size_t min_size);
+
+/*
+  Return a stack obtained from my_stack_alloc() to the calling thread's free
+  list (or unmap it if the free list is full).
+
+  The stack need not be freed in the same thread that allocated it.
+*/
+extern void my_stack_free(struct my_stack *s);
+
+/*
+  Fill the usable area of a stack with MY_STACK_PAINT_BYTE. This touches
+  every page, so it costs time and memory; use it for measuring only.
+*/
+extern void my_stack_paint(struct my_stack *s);
+
+/*
+  The number of bytes at the top of a painted stack that were written since
+  my_stack_paint(), ie. the maximum stack depth reached (give or take a
+  word that happened to be written with the paint value).
+*/
+extern size_t my_stack_used(const struct my_stack *s);
+
+/*
+  Unmap all stacks cached in the calling thread's free lists. Should be
+  called before a thread that used the pool exits, similar to
+  my_thread_end().
+*/
+extern void my_stack_pool_thread_end(void);
+
+#endif  /* MY_STACK_POOL_H */
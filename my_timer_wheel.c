@@ -0,0 +1,226 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the hierarchical timing wheel.
+
+  A timer in level L > 0 is in slot (expires >> (L*BITS)) % SLOTS, and is
+  always at least one full level-L slot in the future when added. So the
+  current slot of each level > 0 is empty right after time enters it (it is
+  cascaded at that point), and the start of the first non-empty slot after
+  the current one is a lower bound for the expiry of all timers in that
+  level.
+*/
+
+#include <string.h>
+
+#include "my_timer_wheel.h"
+
+#define SLOT_MASK (MY_TIMER_SLOTS - 1)
+#define LEVEL_SHIFT(l) ((l) * MY_TIMER_SLOT_BITS)
+/* Number of ticks spanned by the whole wheel. */
+#define WHEEL_SPAN (1ULL << LEVEL_SHIFT(MY_TIMER_LEVELS))
+
+
+void
+my_timer_wheel_init(struct my_timer_wheel *w, unsigned long long now)
+{
+  memset(w, 0, sizeof(*w));
+  w->now= now;
+}
+
+
+static void
+timer_link(struct my_timer_wheel *w, struct my_timer *t)
+{
+  unsigned long long expires= t->expires;
+  unsigned long long delta;
+  unsigned int level;
+  unsigned int slot;
+
+  if (expires < w->now)
+    expires= w->now;
+  delta= expires - w->now;
+  for (level= 0; level < MY_TIMER_LEVELS - 1; level++)
+    if (delta < (1ULL << LEVEL_SHIFT(level + 1)))
+      break;
+  if (delta >= WHEEL_SPAN)
+    expires= w->now + WHEEL_SPAN - 1;     /* Will be re-cascaded later */
+  slot= (unsigned int)(expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+  t->level= (unsigned char)level;
+  t->slot= (unsigned char)slot;
+  t->next= w->slots[level][slot];
+  if (t->next)
+    t->next->pprev= &t->next;
+  t->pprev= &w->slots[level][slot];
+  w->slots[level][slot]= t;
+  w->occupied[level]|= 1ULL << slot;
+}
+
+
+static void
+timer_unlink(struct my_timer_wheel *w, struct my_timer *t)
+{
+  *t->pprev= t->next;
+  if (t->next)
+    t->next->pprev= t->pprev;
+  if (!w->slots[t->level][t->slot])
+    w->occupied[t->level]&= ~(1ULL << t->slot);
+  t->pprev= NULL;
+}
+
+
+void
+my_timer_add(struct my_timer_wheel *w, struct my_timer *t,
+             unsigned long long expires)
+{
+  t->expires= expires;
+  timer_link(w, t);
+  w->count++;
+}
+
+
+void
+my_timer_cancel(struct my_timer_wheel *w, struct my_timer *t)
+{
+  if (!t->pprev)
+    return;
+  timer_unlink(w, t);
+  w->count--;
+}
+
+
+/*
+  Distance (0..SLOTS-1) from slot `from` to the first non-empty slot at or
+  after it, wrapping around. Returns -1 if all slots are empty.
+*/
+static int
+next_slot(uint64_t occupied, unsigned int from)
+{
+  uint64_t rotated;
+
+  if (!occupied)
+    return -1;
+  rotated= from ? (occupied >> from) | (occupied << (MY_TIMER_SLOTS - from))
+                : occupied;
+  return __builtin_ctzll(rotated);
+}
+
+
+unsigned long long
+my_timer_wheel_next(const struct my_timer_wheel *w)
+{
+  unsigned long long best= MY_TIMER_NEVER;
+  unsigned int level;
+  int d;
+
+  if (!w->count)
+    return MY_TIMER_NEVER;
+
+  /* Level 0 timers expire exactly at the start of their slot. */
+  if ((d= next_slot(w->occupied[0], (unsigned int)w->now & SLOT_MASK)) >= 0)
+    best= w->now + d;
+
+  for (level= 1; level < MY_TIMER_LEVELS; level++)
+  {
+    unsigned long long cur= w->now >> LEVEL_SHIFT(level);
+    unsigned long long start;
+
+    d= next_slot(w->occupied[level], (unsigned int)(cur + 1) & SLOT_MASK);
+    if (d < 0)
+      continue;
+    start= (cur + 1 + d) << LEVEL_SHIFT(level);
+    if (start < best)
+      best= start;
+  }
+  return best;
+}
+
+
+/*
+  Called whenever time enters a new tick. For each level where the tick is
+  the start of a slot, move that slot's timers down to lower levels.
+*/
+static void
+cascade(struct my_timer_wheel *w)
+{
+  unsigned int level;
+
+  for (level= 1; level < MY_TIMER_LEVELS; level++)
+  {
+    unsigned int slot;
+    struct my_timer *t, *next;
+
+    if (w->now & ((1ULL << LEVEL_SHIFT(level)) - 1))
+      break;
+    slot= (unsigned int)(w->now >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    t= w->slots[level][slot];
+    w->slots[level][slot]= NULL;
+    w->occupied[level]&= ~(1ULL << slot);
+    for (; t; t= next)
+    {
+      next= t->next;
+      timer_link(w, t);
+    }
+  }
+}
+
+
+unsigned int
+my_timer_wheel_expire(struct my_timer_wheel *w, unsigned long long now,
+                      my_timer_func func, void *arg)
+{
+  unsigned int expired= 0;
+
+  while (w->now <= now)
+  {
+    unsigned long long next;
+    struct my_timer *t;
+
+    if (!w->count)
+    {
+      w->now= now + 1;
+      break;
+    }
+
+    /*
+      Skip directly to the next tick that has something to do. Any slot
+      start skipped over is empty, so no cascading is missed.
+    */
+    next= my_timer_wheel_next(w);
+    if (next > w->now)
+    {
+      w->now= next > now ? now + 1 : next;
+      cascade(w);
+      continue;
+    }
+
+    while ((t= w->slots[0][w->now & SLOT_MASK]))
+    {
+      timer_unlink(w, t);
+      w->count--;
+      expired++;
+      func(t, arg);
+    }
+    w->now++;
+    cascade(w);
+  }
+  return expired;
+}
@@ -0,0 +1,111 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Hierarchical timing wheel, for tracking the timeouts of a large number of
+  suspended async calls.
+
+  Adding and cancelling a timer are O(1). Time is measured in abstract
+  ticks (the event loop uses milliseconds). There are MY_TIMER_LEVELS levels
+  of MY_TIMER_SLOTS slots each; level 0 has one slot per tick, and each
+  higher level has slots MY_TIMER_SLOTS times as wide. When time reaches a
+  slot in a higher level, its timers are cascaded down into lower levels.
+  Timers further in the future than the wheel spans are kept in the top
+  level and re-cascaded until they are in range.
+
+  The caller embeds struct my_timer in its own structures; the wheel does
+  no memory allocation.
+*/
+
+#ifndef MY_TIMER_WHEEL_H
+#define MY_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define MY_TIMER_LEVELS 4
+#define MY_TIMER_SLOT_BITS 6
+#define MY_TIMER_SLOTS (1 << MY_TIMER_SLOT_BITS)
+#define MY_TIMER_NEVER (~(unsigned long long)0)
+
+struct my_timer {
+  unsigned long long expires;
+
+  /* Private to the wheel. */
+  struct my_timer *next;
+  /* Points to the pointer that points to us; NULL when not pending. */
+  struct my_timer **pprev;
+  unsigned char level, slot;
+};
+
+struct my_timer_wheel {
+  /* All timers expiring before this tick have been expired. */
+  unsigned long long now;
+  unsigned int count;
+  /* Bitmap of non-empty slots in each level. */
+  uint64_t occupied[MY_TIMER_LEVELS];
+  struct my_timer *slots[MY_TIMER_LEVELS][MY_TIMER_SLOTS];
+};
+
+typedef void (*my_timer_func)(struct my_timer *timer, void *arg);
+
+extern void my_timer_wheel_init(struct my_timer_wheel *w,
+                                unsigned long long now);
+
+static inline void
+my_timer_init(struct my_timer *t)
+{
+  t->pprev= 0;
+}
+
+static inline int
+my_timer_pending(const struct my_timer *t)
+{
+  return t->pprev != 0;
+}
+
+/*
+  Add a timer (which must not be pending) to expire at tick `expires`.
+  A time that has already been passed is treated as the current tick.
+*/
+extern void my_timer_add(struct my_timer_wheel *w, struct my_timer *t,
+                         unsigned long long expires);
+
+/* Cancel a timer. Does nothing if the timer is not pending. */
+extern void my_timer_cancel(struct my_timer_wheel *w, struct my_timer *t);
+
+/*
+  Return a tick no later than the next expiry of any timer, or
+  MY_TIMER_NEVER if there are no timers. For timers in higher levels this
+  is the start of their slot, so the caller may wake up a bit early, but
+  never late.
+*/
+extern unsigned long long my_timer_wheel_next(const struct my_timer_wheel *w);
+
+/*
+  Advance time to `now`, calling func(timer, arg) for every timer with
+  expires <= now. Each timer is no longer pending when func is called, so
+  func may re-add it or add and cancel other timers.
+
+  Returns the number of timers expired.
+*/
+extern unsigned int my_timer_wheel_expire(struct my_timer_wheel *w,
+                                          unsigned long long now,
+                                          my_timer_func func, void *arg);
+
+#endif  /* MY_TIMER_WHEEL_H */
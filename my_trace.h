@@ -0,0 +1,89 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Static tracepoints (USDT), for perf, bpftrace and SystemTap.
+
+  With <sys/sdt.h> (systemtap-sdt-dev) available, each MY_TRACEn() is a
+  single nop instruction plus a note in the ELF file telling the tracer
+  where the arguments are, so an unused probe costs next to nothing.
+  Without it, or when compiled with -DMY_NO_TRACE, the probes are empty.
+  Arguments must be integers or pointers, and cheap to compute.
+
+  Probes, by provider:
+
+    my_context:spawn(c, f, stack)      A context is started.
+    my_context:yield(c)                A context suspends.
+    my_context:continue(c)             A context is resumed.
+
+    mysql_async:call_start(mysql, b, call_id)
+                                       An async call runs in context b
+                                       (call_id is a MYSQL_ASYNC_ID_xxx).
+    mysql_async:call_done(b, res)      It completed (res < 0: error).
+    mysql_async:wait(b, fd, status, timeout)
+                                       A call waits for the socket.
+    mysql_async:wait_done(b, fd, ready_status)
+                                       And is resumed.
+    mysql_async:connect(b, fd, res)    A connect completed.
+    mysql_async:recv(b, fd, size, res) A read returned res bytes.
+    mysql_async:send(b, fd, size, res) A write returned res bytes.
+
+  The context b of the mysql_async probes identifies the connection; the
+  my_context c of the same connection is &b->async_context. Eg. the time
+  from wait to wait_done is time spent waiting for the server or in the
+  application's event loop, and from yield to continue of the same
+  context is all time spent outside the call:
+
+    bpftrace -e 'usdt:./prog:mysql_async:wait { @t[arg0]= nsecs; }
+      usdt:./prog:mysql_async:wait_done /@t[arg0]/ {
+        @wait_us= hist((nsecs - @t[arg0]) / 1000); delete(@t[arg0]); }'
+*/
+
+#ifndef MY_TRACE_H
+#define MY_TRACE_H
+
+#ifndef MY_NO_TRACE
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MY_TRACE_USE_SDT
+#endif
+#endif
+#endif
+
+#ifdef MY_TRACE_USE_SDT
+#include <sys/sdt.h>
+
+#define MY_TRACE1(provider, name, a1) DTRACE_PROBE1(provider, name, a1)
+#define MY_TRACE2(provider, name, a1, a2) DTRACE_PROBE2(provider, name, a1, a2)
+#define MY_TRACE3(provider, name, a1, a2, a3)                           \
+  DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define MY_TRACE4(provider, name, a1, a2, a3, a4)                       \
+  DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#else
+/* Use the arguments, so that they do not become unused. */
+#define MY_TRACE1(provider, name, a1) do { (void)(a1); } while (0)
+#define MY_TRACE2(provider, name, a1, a2)                               \
+  do { (void)(a1); (void)(a2); } while (0)
+#define MY_TRACE3(provider, name, a1, a2, a3)                           \
+  do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define MY_TRACE4(provider, name, a1, a2, a3, a4)                       \
+  do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#endif
+
+#endif  /* MY_TRACE_H */
@@ -0,0 +1,570 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the minimal io_uring, see my_uring.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#include "my_uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define MY_URING_AVAILABLE
+#endif
+#endif
+
+#ifdef MY_URING_AVAILABLE
+#include <linux/io_uring.h>
+
+/* The operations used; without any of them, my_uring_new() fails. */
+static const unsigned char needed_ops[]= {
+  IORING_OP_RECV, IORING_OP_RECVMSG, IORING_OP_SEND, IORING_OP_SENDMSG,
+  IORING_OP_CONNECT, IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL
+};
+
+struct my_uring {
+  int fd;
+  /* Submission ring, shared with the kernel. */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned int sq_entries;
+  struct io_uring_sqe *sqes;
+  /* Entries added to the ring and not yet passed to io_uring_enter(). */
+  unsigned int queued;
+  /* Completion ring, shared with the kernel. */
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* The mappings, SQ and CQ ring in one (IORING_FEAT_SINGLE_MMAP). */
+  void *ring_mem;
+  size_t ring_size;
+  size_t sqes_size;
+  /* Operations submitted or queued, whose completion is not reaped. */
+  struct my_uring_op *pending;
+};
+
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                   unsigned int flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+                      unsigned int nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/* Check that the kernel supports all the operations we use. */
+static int
+my_uring_probe(int fd)
+{
+  struct io_uring_probe *probe;
+  size_t size= sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  unsigned int i;
+  int res= 0;
+
+  if (!(probe= calloc(1, size)))
+    return -1;
+  if (sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256))
+    res= -1;
+  for (i= 0; !res && i < sizeof(needed_ops); i++)
+  {
+    if (needed_ops[i] > probe->last_op ||
+        !(probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED))
+      res= -1;
+  }
+  free(probe);
+  if (res)
+    errno= EOPNOTSUPP;
+  return res;
+}
+
+
+struct my_uring *
+my_uring_new(unsigned int entries)
+{
+  struct my_uring *ring;
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  char *mem;
+  int saved_errno;
+
+  if (!(ring= calloc(1, sizeof(*ring))))
+    return NULL;
+  ring->fd= -1;
+  ring->ring_mem= ring->sqes= MAP_FAILED;
+
+  /*
+    Each operation has up to two completions (with its linked timeout),
+    so make the completion ring larger. Overflow is not fatal anyway, the
+    kernel keeps the excess (IORING_FEAT_NODROP).
+  */
+  memset(&p, 0, sizeof(p));
+  p.flags= IORING_SETUP_CQSIZE;
+  p.cq_entries= entries * 4;
+  if ((ring->fd= sys_io_uring_setup(entries, &p)) < 0)
+    goto err;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP))
+  {
+    errno= EOPNOTSUPP;
+    goto err;
+  }
+  if (my_uring_probe(ring->fd))
+    goto err;
+
+  sq_size= p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  cq_size= p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size= sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_mem= mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->ring_mem == MAP_FAILED)
+    goto err;
+  ring->sqes_size= p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes= mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto err;
+
+  mem= (char *)ring->ring_mem;
+  ring->sq_head= (unsigned int *)(mem + p.sq_off.head);
+  ring->sq_tail= (unsigned int *)(mem + p.sq_off.tail);
+  ring->sq_mask= (unsigned int *)(mem + p.sq_off.ring_mask);
+  ring->sq_flags= (unsigned int *)(mem + p.sq_off.flags);
+  ring->sq_array= (unsigned int *)(mem + p.sq_off.array);
+  ring->sq_entries= p.sq_entries;
+  ring->cq_head= (unsigned int *)(mem + p.cq_off.head);
+  ring->cq_tail= (unsigned int *)(mem + p.cq_off.tail);
+  ring->cq_mask= (unsigned int *)(mem + p.cq_off.ring_mask);
+  ring->cqes= (struct io_uring_cqe *)(mem + p.cq_off.cqes);
+  return ring;
+
+err:
+  saved_errno= errno;
+  my_uring_free(ring);
+  errno= saved_errno;
+  return NULL;
+}
+
+
+void
+my_uring_free(struct my_uring *ring)
+{
+  struct my_uring_op *op;
+
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring_mem != MAP_FAILED)
+    munmap(ring->ring_mem, ring->ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  /* Their completions will not be reaped now. */
+  while ((op= ring->pending))
+  {
+    ring->pending= op->pending_next;
+    if (op->orphaned)
+      free(op);
+    else
+    {
+      op->res= -ECANCELED;
+      op->state= MY_URING_OP_DONE;
+    }
+  }
+  free(ring);
+}
+
+
+int
+my_uring_fd(const struct my_uring *ring)
+{
+  return ring->fd;
+}
+
+
+unsigned int
+my_uring_queued(const struct my_uring *ring)
+{
+  return ring->queued;
+}
+
+
+int
+my_uring_submit(struct my_uring *ring)
+{
+  int res;
+
+  while (ring->queued)
+  {
+    res= sys_io_uring_enter(ring->fd, ring->queued, 0, 0);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    ring->queued-= res;
+    if (!res)
+      break;
+  }
+  return 0;
+}
+
+
+/*
+  Make sure there is room for count more entries in the submission ring,
+  submitting what is queued if it is full.
+*/
+static int
+my_uring_reserve(struct my_uring *ring, unsigned int count)
+{
+  unsigned int used= *ring->sq_tail -
+    __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (used + count <= ring->sq_entries)
+    return 0;
+  if (my_uring_submit(ring))
+    return -1;
+  used= *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (used + count <= ring->sq_entries)
+    return 0;
+  errno= EAGAIN;
+  return -1;
+}
+
+/*
+  The index'th entry after the tail. It is not visible to the kernel
+  until my_uring_push().
+*/
+static struct io_uring_sqe *
+my_uring_sqe(struct my_uring *ring, unsigned int index)
+{
+  unsigned int slot= (*ring->sq_tail + index) & *ring->sq_mask;
+  struct io_uring_sqe *sqe= &ring->sqes[slot];
+
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[slot]= slot;
+  return sqe;
+}
+
+/* Make count entries visible to the kernel. */
+static void
+my_uring_push(struct my_uring *ring, unsigned int count)
+{
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+  ring->queued+= count;
+}
+
+
+static int
+my_uring_queue(struct my_uring *ring, struct my_uring_op *op,
+               unsigned char opcode, int fd, const void *addr,
+               unsigned int len, unsigned long long off, int flags,
+               unsigned int timeout)
+{
+  struct io_uring_sqe *sqe, *tsqe;
+
+  if (my_uring_reserve(ring, timeout ? 2 : 1))
+    return -1;
+  sqe= my_uring_sqe(ring, 0);
+  sqe->opcode= opcode;
+  sqe->fd= fd;
+  sqe->addr= (unsigned long long)(size_t)addr;
+  sqe->len= len;
+  sqe->off= off;
+  sqe->msg_flags= flags;
+  sqe->user_data= (unsigned long long)(size_t)op;
+  if (timeout)
+  {
+    /*
+      The timeout must be the entry right after the operation. Its own
+      completion has user_data 0 and is ignored.
+    */
+    sqe->flags|= IOSQE_IO_LINK;
+    op->timeout.tv_sec= timeout;
+    op->timeout.tv_nsec= 0;
+    tsqe= my_uring_sqe(ring, 1);
+    tsqe->opcode= IORING_OP_LINK_TIMEOUT;
+    tsqe->fd= -1;
+    tsqe->addr= (unsigned long long)(size_t)&op->timeout;
+    tsqe->len= 1;
+  }
+  op->state= MY_URING_OP_PENDING;
+  op->pending_prev= NULL;
+  if ((op->pending_next= ring->pending))
+    ring->pending->pending_prev= op;
+  ring->pending= op;
+  my_uring_push(ring, timeout ? 2 : 1);
+  return 0;
+}
+
+
+int
+my_uring_recv(struct my_uring *ring, struct my_uring_op *op, int fd,
+              void *buf, size_t len, int flags, unsigned int timeout)
+{
+  return my_uring_queue(ring, op, IORING_OP_RECV, fd, buf, len, 0, flags,
+                        timeout);
+}
+
+int
+my_uring_recvmsg(struct my_uring *ring, struct my_uring_op *op, int fd,
+                 struct msghdr *msg, int flags, unsigned int timeout)
+{
+  return my_uring_queue(ring, op, IORING_OP_RECVMSG, fd, msg, 1, 0, flags,
+                        timeout);
+}
+
+int
+my_uring_send(struct my_uring *ring, struct my_uring_op *op, int fd,
+              const void *buf, size_t len, int flags, unsigned int timeout)
+{
+  return my_uring_queue(ring, op, IORING_OP_SEND, fd, buf, len, 0, flags,
+                        timeout);
+}
+
+int
+my_uring_sendmsg(struct my_uring *ring, struct my_uring_op *op, int fd,
+                 const struct msghdr *msg, int flags, unsigned int timeout)
+{
+  return my_uring_queue(ring, op, IORING_OP_SENDMSG, fd, msg, 1, 0, flags,
+                        timeout);
+}
+
+int
+my_uring_connect(struct my_uring *ring, struct my_uring_op *op, int fd,
+                 const struct sockaddr *addr, socklen_t addrlen,
+                 unsigned int timeout)
+{
+  /* The address length goes in the offset field. */
+  return my_uring_queue(ring, op, IORING_OP_CONNECT, fd, addr, 0, addrlen, 0,
+                        timeout);
+}
+
+
+int
+my_uring_cancel(struct my_uring *ring, struct my_uring_op *op)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int head, tail, i;
+
+  if (op->state != MY_URING_OP_PENDING)
+    return 0;
+  if (my_uring_reserve(ring, 1))
+    return -1;
+  /* Its own completion has user_data 0 and is ignored. */
+  sqe= my_uring_sqe(ring, 0);
+  sqe->opcode= IORING_OP_ASYNC_CANCEL;
+  sqe->fd= -1;
+  sqe->addr= (unsigned long long)(size_t)op;
+  my_uring_push(ring, 1);
+  if (my_uring_submit(ring))
+    return -1;
+
+  /*
+    Wait for the completion of op to show up in the ring. Usually the
+    cancel completes it at once, but it may be running in the kernel.
+  */
+  for (;;)
+  {
+    head= *ring->cq_head;
+    tail= __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (i= head; i != tail; i++)
+    {
+      if (ring->cqes[i & *ring->cq_mask].user_data ==
+          (unsigned long long)(size_t)op)
+        return 0;
+    }
+    if (tail - head > *ring->cq_mask)
+    {
+      /* Full: it may be in the overflow list, we cannot wait for more. */
+      errno= EBUSY;
+      return -1;
+    }
+    /* One more completion than there is now (also flushes overflow). */
+    if (sys_io_uring_enter(ring->fd, 0, tail - head + 1,
+                           IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+      return -1;
+  }
+}
+
+
+unsigned int
+my_uring_reap(struct my_uring *ring, my_uring_func func, void *arg)
+{
+  unsigned int head, tail, count= 0;
+  struct io_uring_cqe *cqe;
+  struct my_uring_op *op;
+
+  for (;;)
+  {
+    head= *ring->cq_head;
+    tail= __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+    {
+      /* Completions that did not fit are flushed into the ring on enter. */
+      if (!(__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW) ||
+          sys_io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS) < 0 ||
+          *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return count;
+      continue;
+    }
+    cqe= &ring->cqes[head & *ring->cq_mask];
+    op= (struct my_uring_op *)(size_t)cqe->user_data;
+    if (op)
+    {
+      op->res= cqe->res;
+      op->state= MY_URING_OP_DONE;
+      if (op->pending_prev)
+        op->pending_prev->pending_next= op->pending_next;
+      else
+        ring->pending= op->pending_next;
+      if (op->pending_next)
+        op->pending_next->pending_prev= op->pending_prev;
+    }
+    /* Release the entry before func, which may queue more. */
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (!op)
+      continue;
+    if (op->orphaned)
+      free(op);
+    else
+    {
+      count++;
+      func(op, arg);
+    }
+  }
+}
+
+#else  /* !MY_URING_AVAILABLE */
+
+/*
+  Built without the io_uring header: no ring can be created, so callers
+  always use the readiness path and the rest is never called.
+*/
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+struct my_uring {
+  int fd;
+};
+
+struct my_uring *
+my_uring_new(unsigned int entries)
+{
+  errno= ENOSYS;
+  return NULL;
+}
+
+void my_uring_free(struct my_uring *ring) { free(ring); }
+int my_uring_fd(const struct my_uring *ring) { return ring->fd; }
+unsigned int my_uring_queued(const struct my_uring *ring) { return 0; }
+int my_uring_submit(struct my_uring *ring) { return 0; }
+
+int
+my_uring_recv(struct my_uring *ring, struct my_uring_op *op, int fd,
+              void *buf, size_t len, int flags, unsigned int timeout)
+{
+  errno= ENOSYS;
+  return -1;
+}
+
+int
+my_uring_recvmsg(struct my_uring *ring, struct my_uring_op *op, int fd,
+                 struct msghdr *msg, int flags, unsigned int timeout)
+{
+  errno= ENOSYS;
+  return -1;
+}
+
+int
+my_uring_send(struct my_uring *ring, struct my_uring_op *op, int fd,
+              const void *buf, size_t len, int flags, unsigned int timeout)
+{
+  errno= ENOSYS;
+  return -1;
+}
+
+int
+my_uring_sendmsg(struct my_uring *ring, struct my_uring_op *op, int fd,
+                 const struct msghdr *msg, int flags, unsigned int timeout)
+{
+  errno= ENOSYS;
+  return -1;
+}
+
+int
+my_uring_connect(struct my_uring *ring, struct my_uring_op *op, int fd,
+                 const struct sockaddr *addr, socklen_t addrlen,
+                 unsigned int timeout)
+{
+  errno= ENOSYS;
+  return -1;
+}
+
+int
+my_uring_cancel(struct my_uring *ring, struct my_uring_op *op)
+{
+  return 0;
+}
+
+unsigned int
+my_uring_reap(struct my_uring *ring, my_uring_func func, void *arg)
+{
+  return 0;
+}
+
+#endif  /* MY_URING_AVAILABLE */
+
+
+struct my_uring_op *
+my_uring_op_new(void *owner)
+{
+  struct my_uring_op *op;
+
+  if ((op= calloc(1, sizeof(*op))))
+    op->owner= owner;
+  return op;
+}
+
+void
+my_uring_op_free(struct my_uring_op *op)
+{
+  if (op->state == MY_URING_OP_PENDING)
+    op->orphaned= 1;
+  else
+    free(op);
+}
@@ -0,0 +1,140 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Minimal io_uring for socket I/O, on the raw system calls (no liburing).
+
+  Operations are queued into the submission ring by the my_uring_recv()
+  etc. calls, and submitted in batches by my_uring_submit(), typically
+  once per event loop iteration. Completions are then picked up with
+  my_uring_reap(), which calls a function for each finished operation.
+  The ring's file descriptor polls readable while completions are waiting,
+  so it can be put into an epoll set along with other sockets.
+
+  Each operation is described by a struct my_uring_op, which must stay
+  allocated until the operation completes, as must the buffers and
+  struct msghdr / struct sockaddr passed in. An operation can have a
+  timeout in seconds (a linked timeout); when it expires, the operation
+  completes with res == -ECANCELED.
+*/
+
+#ifndef MY_URING_H
+#define MY_URING_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+enum my_uring_op_state {
+  MY_URING_OP_IDLE, MY_URING_OP_PENDING, MY_URING_OP_DONE
+};
+
+struct my_uring_op {
+  /* For the user, eg. to find the connection on completion. */
+  void *owner;
+  /* Result of the completed operation, -errno on error. */
+  int res;
+  enum my_uring_op_state state;
+  /* Private. */
+  /* Freed with my_uring_op_free() while pending, free on completion. */
+  int orphaned;
+  /* In the ring's list of pending operations. */
+  struct my_uring_op *pending_prev, *pending_next;
+  /* struct __kernel_timespec of the linked timeout. */
+  struct {
+    long long tv_sec;
+    long long tv_nsec;
+  } timeout;
+};
+
+struct my_uring;
+
+/*
+  Create a ring with room for `entries` queued operations. Returns NULL,
+  with errno set, if the kernel does not have io_uring (ENOSYS), does not
+  allow it (EPERM), or lacks some of the operations used (EOPNOTSUPP); the
+  caller should then use non-blocking syscalls and readiness instead.
+*/
+extern struct my_uring *my_uring_new(unsigned int entries);
+/*
+  Operations still pending are cancelled by the kernel, and are left in
+  state MY_URING_OP_DONE with res -ECANCELED (or freed, if already freed
+  with my_uring_op_free()).
+*/
+extern void my_uring_free(struct my_uring *ring);
+extern int my_uring_fd(const struct my_uring *ring);
+
+extern struct my_uring_op *my_uring_op_new(void *owner);
+/*
+  Free an operation. If it is still pending, it is freed by
+  my_uring_reap() when it completes, without calling the function. The
+  buffers it uses must stay until then, see my_uring_cancel().
+*/
+extern void my_uring_op_free(struct my_uring_op *op);
+
+/*
+  Cancel a pending operation (IORING_OP_ASYNC_CANCEL), and wait until the
+  kernel is done with it and its buffers. Its completion is left in the
+  ring, for my_uring_reap() as usual. Returns 0 if ok, -1 with errno set
+  if that cannot be known, eg. EBUSY when the completion ring is full;
+  the buffers must then be kept.
+*/
+extern int my_uring_cancel(struct my_uring *ring, struct my_uring_op *op);
+
+/*
+  Queue an operation. timeout is in seconds, 0 for none. Queueing submits
+  what is already queued if the submission ring is full.
+
+  Returns 0 if queued, -1 if there is no room (with errno set).
+*/
+extern int my_uring_recv(struct my_uring *ring, struct my_uring_op *op,
+                         int fd, void *buf, size_t len, int flags,
+                         unsigned int timeout);
+extern int my_uring_recvmsg(struct my_uring *ring, struct my_uring_op *op,
+                            int fd, struct msghdr *msg, int flags,
+                            unsigned int timeout);
+extern int my_uring_send(struct my_uring *ring, struct my_uring_op *op,
+                         int fd, const void *buf, size_t len, int flags,
+                         unsigned int timeout);
+extern int my_uring_sendmsg(struct my_uring *ring, struct my_uring_op *op,
+                            int fd, const struct msghdr *msg, int flags,
+                            unsigned int timeout);
+extern int my_uring_connect(struct my_uring *ring, struct my_uring_op *op,
+                            int fd, const struct sockaddr *addr,
+                            socklen_t addrlen, unsigned int timeout);
+
+/* Number of operations queued but not yet submitted. */
+extern unsigned int my_uring_queued(const struct my_uring *ring);
+
+/*
+  Submit all queued operations to the kernel, with one system call.
+  Returns 0 if ok, -1 on error.
+*/
+extern int my_uring_submit(struct my_uring *ring);
+
+typedef void (*my_uring_func)(struct my_uring_op *op, void *arg);
+
+/*
+  Call func(op, arg) for every completed operation, without blocking.
+  The operation is in state MY_URING_OP_DONE when func is called, so func
+  may queue it again. Returns the number of times func was called.
+*/
+extern unsigned int my_uring_reap(struct my_uring *ring, my_uring_func func,
+                                  void *arg);
+
+#endif  /* MY_URING_H */
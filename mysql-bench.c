@@ -0,0 +1,668 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Load generator comparing the two ways of running many connections:
+
+    sync    One thread per connection, doing blocking mysql_real_query()
+            and mysql_store_result(), like sync-example1.c.
+    async   A few threads (-t), each driving its share of the connections
+            with the non-blocking _start()/_cont() calls from a
+            mysql_async_loop, like async-example1.c.
+    uring   As async, but with the socket I/O done through the loop's
+            io_uring (mysql_async_loop_use_uring()).
+
+  For each number of connections in the -n list, and each mode, it opens
+  all connections, runs the query mix for a warmup period and then for the
+  measured period, and prints one CSV line with the throughput, the
+  latency percentiles (from start of the query to the result being
+  stored), the CPU time of the whole process per query, and the resident
+  memory with all connections open.
+
+  Each connection runs one query at a time, back to back; a query is picked
+  at random from the mix given with -q weight:query (eg. -q '9:SELECT 1'
+  -q '1:SELECT rows=1000', the second being understood by mock-server),
+  in proportion to the weights.
+
+  Many connections need a high limit on open files, which is raised to the
+  hard limit at startup; the sync mode at 10k+ connections may also need
+  a small thread stack (-k) and a raised vm.max_map_count and
+  kernel.threads-max.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <mysql/mysql.h>
+
+#include "mysql_async.h"
+#include "mysql_async_loop.h"
+
+#define MAX_QUERIES 32
+
+enum bench_mode { MODE_SYNC= 1, MODE_ASYNC= 2, MODE_URING= 4 };
+
+struct query {
+  unsigned int weight;
+  const char *text;
+  unsigned long len;
+};
+
+static struct query queries[MAX_QUERIES];
+static unsigned int query_count= 0;
+static unsigned int total_weight= 0;
+
+static const char *opt_host= "127.0.0.1";
+static unsigned int opt_port= 0;
+static const char *opt_socket= NULL;
+static const char *opt_user= "test";
+static const char *opt_password= "testpass";
+static const char *opt_db= "test";
+static unsigned int opt_threads= 1;
+static unsigned int opt_warmup= 1;
+static unsigned int opt_duration= 5;
+static size_t opt_stack_kb= 0;
+
+/*
+  State of the current run, shared by all threads: counts of connections
+  that are connected or failed to, and flags for the measured period and
+  for stopping.
+*/
+static unsigned int run_connected;
+static unsigned int run_failed;
+static int run_measuring;
+static int run_stop;
+
+/* Counted during the measured period, per thread. */
+struct load_stats {
+  struct mysql_async_histogram latency;
+  unsigned long long queries;
+  unsigned long long errors;
+};
+
+struct sync_thread {
+  pthread_t thread;
+  unsigned int seed;
+  struct load_stats stats;
+};
+
+enum async_state { ST_CONNECT, ST_QUERY, ST_STORE };
+
+struct async_thread;
+
+struct async_conn {
+  MYSQL mysql;
+  struct mysql_async_loop_conn lc;
+  struct async_thread *t;
+  enum async_state state;
+  unsigned int seed;
+  const struct query *query;
+  unsigned long long start_ns;
+  MYSQL *connect_ret;
+  int query_ret;
+  MYSQL_RES *res;
+};
+
+struct async_thread {
+  pthread_t thread;
+  enum bench_mode mode;
+  struct mysql_async_loop *loop;
+  struct async_conn *conns;
+  unsigned int count;
+  struct load_stats stats;
+};
+
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_ms(unsigned long ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec= ms / 1000;
+  ts.tv_nsec= (ms % 1000) * 1000000;
+  while (nanosleep(&ts, &ts))
+    ;
+}
+
+static unsigned long long
+cpu_ns(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* Resident set size of the process in kB, or 0 if unknown. */
+static unsigned long
+rss_kb(void)
+{
+  FILE *f;
+  char line[256];
+  unsigned long kb= 0;
+
+  if (!(f= fopen("/proc/self/status", "r")))
+    return 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    if (sscanf(line, "VmRSS: %lu", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb;
+}
+
+static const struct query *
+pick_query(unsigned int *seed)
+{
+  unsigned int r, i;
+
+  /* xorshift32 */
+  r= *seed;
+  r^= r << 13;
+  r^= r >> 17;
+  r^= r << 5;
+  *seed= r;
+  r%= total_weight;
+  for (i= 0; r >= queries[i].weight; i++)
+    r-= queries[i].weight;
+  return &queries[i];
+}
+
+static void
+query_done(struct load_stats *stats, unsigned long long start_ns, int error)
+{
+  if (!__atomic_load_n(&run_measuring, __ATOMIC_RELAXED))
+    return;
+  if (error)
+    stats->errors++;
+  else
+  {
+    stats->queries++;
+    mysql_async_histogram_add(&stats->latency, now_ns() - start_ns);
+  }
+}
+
+static int
+stopping(void)
+{
+  return __atomic_load_n(&run_stop, __ATOMIC_RELAXED);
+}
+
+
+static void *
+sync_thread_run(void *arg)
+{
+  struct sync_thread *t= (struct sync_thread *)arg;
+  const struct query *q;
+  unsigned long long start;
+  MYSQL mysql;
+  MYSQL_RES *res;
+  int error;
+
+  mysql_thread_init();
+  mysql_init(&mysql);
+  if (!mysql_real_connect(&mysql, opt_host, opt_user, opt_password, opt_db,
+                          opt_port, opt_socket, 0))
+  {
+    fprintf(stderr, "Failed to mysql_real_connect(): %s\n",
+            mysql_error(&mysql));
+    __atomic_fetch_add(&run_failed, 1, __ATOMIC_RELAXED);
+    mysql_close(&mysql);
+    mysql_thread_end();
+    return NULL;
+  }
+  __atomic_fetch_add(&run_connected, 1, __ATOMIC_RELAXED);
+
+  while (!stopping())
+  {
+    q= pick_query(&t->seed);
+    start= now_ns();
+    error= mysql_real_query(&mysql, q->text, q->len);
+    if (!error && mysql_field_count(&mysql))
+    {
+      if ((res= mysql_store_result(&mysql)))
+        mysql_free_result(res);
+      else
+        error= 1;
+    }
+    query_done(&t->stats, start, error);
+    if (error)
+    {
+      fprintf(stderr, "Query failed: %s\n", mysql_error(&mysql));
+      break;
+    }
+  }
+  mysql_close(&mysql);
+  mysql_thread_end();
+  return NULL;
+}
+
+
+/*
+  The continuation of an async connection: runs connect, then queries
+  back to back until told to stop. Called with ready_status 0 to start.
+*/
+static MYSQL_ASYNC_STATUS
+async_cont(MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status, void *data)
+{
+  struct async_conn *c= (struct async_conn *)data;
+  MYSQL_ASYNC_STATUS status;
+  int error;
+
+  for (;;)
+  {
+    switch (c->state)
+    {
+    case ST_CONNECT:
+      if (ready_status)
+        status= mysql_real_connect_cont(&c->connect_ret, mysql, ready_status);
+      else
+        status= mysql_real_connect_start(&c->connect_ret, mysql, opt_host,
+                                         opt_user, opt_password, opt_db,
+                                         opt_port, opt_socket, 0);
+      if (status)
+        return status;
+      if (!c->connect_ret)
+      {
+        fprintf(stderr, "Failed to mysql_real_connect(): %s\n",
+                mysql_error(mysql));
+        __atomic_fetch_add(&run_failed, 1, __ATOMIC_RELAXED);
+        mysql_async_loop_remove(c->t->loop, &c->lc);
+        return 0;
+      }
+      __atomic_fetch_add(&run_connected, 1, __ATOMIC_RELAXED);
+      c->state= ST_QUERY;
+      break;
+
+    case ST_QUERY:
+      if (ready_status)
+        status= mysql_real_query_cont(&c->query_ret, mysql, ready_status);
+      else
+      {
+        if (stopping())
+          return 0;
+        c->query= pick_query(&c->seed);
+        c->start_ns= now_ns();
+        status= mysql_real_query_start(&c->query_ret, mysql, c->query->text,
+                                       c->query->len);
+      }
+      if (status)
+        return status;
+      if (!c->query_ret && mysql_field_count(mysql))
+      {
+        c->state= ST_STORE;
+        break;
+      }
+      error= c->query_ret;
+      goto done;
+
+    case ST_STORE:
+      if (ready_status)
+        status= mysql_store_result_cont(&c->res, mysql, ready_status);
+      else
+        status= mysql_store_result_start(&c->res, mysql);
+      if (status)
+        return status;
+      error= !c->res;
+      if (c->res)
+        mysql_free_result(c->res);
+      c->state= ST_QUERY;
+      goto done;
+    }
+    ready_status= 0;
+    continue;
+
+  done:
+    query_done(&c->t->stats, c->start_ns, error);
+    if (error)
+    {
+      fprintf(stderr, "Query failed: %s\n", mysql_error(mysql));
+      mysql_async_loop_remove(c->t->loop, &c->lc);
+      return 0;
+    }
+    ready_status= 0;
+  }
+}
+
+static void *
+async_thread_run(void *arg)
+{
+  struct async_thread *t= (struct async_thread *)arg;
+  struct async_conn *c;
+  MYSQL_ASYNC_STATUS status;
+  unsigned int i;
+
+  mysql_thread_init();
+  if (!(t->loop= mysql_async_loop_new()))
+  {
+    perror("mysql_async_loop_new");
+    __atomic_fetch_add(&run_failed, t->count, __ATOMIC_RELAXED);
+    mysql_thread_end();
+    return NULL;
+  }
+  for (i= 0; i < t->count; i++)
+  {
+    c= &t->conns[i];
+    mysql_init(&c->mysql);
+    mysql_async_loop_conn_init(&c->lc, &c->mysql, async_cont, c);
+    if (t->mode == MODE_URING && mysql_async_loop_use_uring(t->loop, &c->lc))
+    {
+      perror("mysql_async_loop_use_uring");
+      exit(1);
+    }
+    status= async_cont(&c->mysql, 0, c);
+    if (status && mysql_async_loop_wait(t->loop, &c->lc, status))
+    {
+      perror("mysql_async_loop_wait");
+      __atomic_fetch_add(&run_failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  if (mysql_async_loop_run(t->loop))
+    perror("mysql_async_loop_run");
+  for (i= 0; i < t->count; i++)
+  {
+    mysql_async_loop_remove(t->loop, &t->conns[i].lc);
+    mysql_close(&t->conns[i].mysql);
+  }
+  mysql_async_loop_free(t->loop);
+  mysql_thread_end();
+  return NULL;
+}
+
+
+/*
+  Run one benchmark with conns connections and print its result line.
+*/
+static void
+run(enum bench_mode mode, unsigned int conns)
+{
+  struct sync_thread *sync_threads= NULL;
+  struct async_thread *async_threads= NULL;
+  struct async_conn *async_conns= NULL;
+  struct load_stats total;
+  pthread_attr_t attr;
+  unsigned int nthreads, started, i;
+  unsigned long long t0, t1, cpu0, cpu1;
+  unsigned long rss;
+  double secs;
+
+  run_connected= run_failed= 0;
+  run_measuring= run_stop= 0;
+  memset(&total, 0, sizeof(total));
+  pthread_attr_init(&attr);
+
+  if (mode == MODE_SYNC)
+  {
+    nthreads= conns;
+    if (opt_stack_kb)
+      pthread_attr_setstacksize(&attr, opt_stack_kb * 1024);
+    sync_threads= calloc(nthreads, sizeof(*sync_threads));
+  }
+  else
+  {
+    nthreads= opt_threads < conns ? opt_threads : conns;
+    async_threads= calloc(nthreads, sizeof(*async_threads));
+    async_conns= calloc(conns, sizeof(*async_conns));
+  }
+  if (!sync_threads && (!async_threads || !async_conns))
+  {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  for (started= 0; started < nthreads; started++)
+  {
+    int err;
+
+    if (mode == MODE_SYNC)
+    {
+      sync_threads[started].seed= started + 1;
+      err= pthread_create(&sync_threads[started].thread, &attr,
+                          sync_thread_run, &sync_threads[started]);
+    }
+    else
+    {
+      struct async_thread *t= &async_threads[started];
+      unsigned int first= (unsigned long long)conns * started / nthreads;
+
+      t->mode= mode;
+      t->conns= &async_conns[first];
+      t->count= (unsigned long long)conns * (started + 1) / nthreads - first;
+      for (i= 0; i < t->count; i++)
+      {
+        t->conns[i].t= t;
+        t->conns[i].seed= first + i + 1;
+      }
+      err= pthread_create(&t->thread, &attr, async_thread_run, t);
+    }
+    if (err)
+    {
+      fprintf(stderr, "Could only start %u of %u threads: %s\n",
+              started, nthreads, strerror(err));
+      break;
+    }
+  }
+  pthread_attr_destroy(&attr);
+  /* Connections of threads that did not start count as failed. */
+  if (started < nthreads)
+  {
+    if (mode == MODE_SYNC)
+      run_failed+= nthreads - started;
+    else
+      for (i= started; i < nthreads; i++)
+        run_failed+= async_threads[i].count;
+  }
+
+  while (__atomic_load_n(&run_connected, __ATOMIC_RELAXED) +
+         __atomic_load_n(&run_failed, __ATOMIC_RELAXED) < conns)
+    sleep_ms(10);
+
+  sleep_ms(opt_warmup * 1000);
+  cpu0= cpu_ns();
+  t0= now_ns();
+  __atomic_store_n(&run_measuring, 1, __ATOMIC_RELAXED);
+  sleep_ms(opt_duration * 1000);
+  __atomic_store_n(&run_measuring, 0, __ATOMIC_RELAXED);
+  t1= now_ns();
+  cpu1= cpu_ns();
+  rss= rss_kb();
+  __atomic_store_n(&run_stop, 1, __ATOMIC_RELAXED);
+
+  for (i= 0; i < started; i++)
+  {
+    struct load_stats *s;
+
+    if (mode == MODE_SYNC)
+    {
+      pthread_join(sync_threads[i].thread, NULL);
+      s= &sync_threads[i].stats;
+    }
+    else
+    {
+      pthread_join(async_threads[i].thread, NULL);
+      s= &async_threads[i].stats;
+    }
+    mysql_async_histogram_merge(&total.latency, &s->latency);
+    total.queries+= s->queries;
+    total.errors+= s->errors;
+  }
+  free(sync_threads);
+  free(async_threads);
+  free(async_conns);
+
+  secs= (t1 - t0) / 1e9;
+  printf("%s,%u,%u,%u,%llu,%llu,%.0f,%.1f,%.1f,%.1f,%.1f,%.2f,%.1f\n",
+         mode == MODE_SYNC ? "sync" : mode == MODE_ASYNC ? "async" : "uring",
+         started, conns,
+         run_connected, total.queries, total.errors, total.queries / secs,
+         mysql_async_histogram_percentile(&total.latency, 50) / 1e3,
+         mysql_async_histogram_percentile(&total.latency, 99) / 1e3,
+         mysql_async_histogram_percentile(&total.latency, 99.9) / 1e3,
+         total.latency.max_ns / 1e3,
+         total.queries ? (cpu1 - cpu0) / 1e3 / total.queries : 0.0,
+         rss / 1024.0);
+  fflush(stdout);
+}
+
+
+static void
+add_query(const char *arg)
+{
+  const char *colon= strchr(arg, ':');
+  char *end;
+  long weight= 1;
+
+  if (colon)
+  {
+    weight= strtol(arg, &end, 10);
+    if (end == colon)
+      arg= colon + 1;
+    else
+      weight= 1;                                /* A ':' inside the query */
+  }
+  if (query_count == MAX_QUERIES || weight < 1)
+  {
+    fprintf(stderr, "Bad query or too many queries: %s\n", arg);
+    exit(1);
+  }
+  queries[query_count].weight= weight;
+  queries[query_count].text= arg;
+  queries[query_count].len= strlen(arg);
+  query_count++;
+  total_weight+= weight;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -m mode         sync, async, uring, both (sync and async,\n"
+          "                  the default) or all\n"
+          "  -n list         Comma-separated numbers of connections\n"
+          "                  (default 10,100,1000,10000,50000)\n"
+          "  -t threads      Threads for the async mode (default 1)\n"
+          "  -q weight:query Add a query to the mix (default 1:SELECT 1)\n"
+          "  -w secs         Warmup time (default 1)\n"
+          "  -d secs         Measured time (default 5)\n"
+          "  -k kb           Thread stack size for the sync mode\n"
+          "  -h host, -P port, -S socket, -u user, -p password, -D db\n"
+          "  -H              Omit the CSV header\n", prog);
+  exit(1);
+}
+
+static char *my_groups[]= { "client", NULL };
+
+int
+main(int argc, char *argv[])
+{
+  const char *conn_list= "10,100,1000,10000,50000";
+  int modes= MODE_SYNC | MODE_ASYNC;
+  int header= 1, opt, err;
+  struct rlimit rl;
+  const char *p;
+  char *end;
+  unsigned long conns;
+
+  while ((opt= getopt(argc, argv, "m:n:t:q:w:d:k:h:P:S:u:p:D:H")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      if (!strcmp(optarg, "sync"))
+        modes= MODE_SYNC;
+      else if (!strcmp(optarg, "async"))
+        modes= MODE_ASYNC;
+      else if (!strcmp(optarg, "uring"))
+        modes= MODE_URING;
+      else if (!strcmp(optarg, "both"))
+        modes= MODE_SYNC | MODE_ASYNC;
+      else if (!strcmp(optarg, "all"))
+        modes= MODE_SYNC | MODE_ASYNC | MODE_URING;
+      else
+        usage(argv[0]);
+      break;
+    case 'n': conn_list= optarg; break;
+    case 't': opt_threads= atoi(optarg); break;
+    case 'q': add_query(optarg); break;
+    case 'w': opt_warmup= atoi(optarg); break;
+    case 'd': opt_duration= atoi(optarg); break;
+    case 'k': opt_stack_kb= atoi(optarg); break;
+    case 'h': opt_host= optarg; break;
+    case 'P': opt_port= atoi(optarg); break;
+    case 'S': opt_socket= optarg; break;
+    case 'u': opt_user= optarg; break;
+    case 'p': opt_password= optarg; break;
+    case 'D': opt_db= optarg; break;
+    case 'H': header= 0; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (opt_threads < 1 || opt_duration < 1)
+    usage(argv[0]);
+  if (!query_count)
+    add_query("SELECT 1");
+
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max)
+  {
+    rl.rlim_cur= rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  err= mysql_library_init(argc, argv, my_groups);
+  if (err)
+  {
+    fprintf(stderr, "Fatal: mysql_library_init() returns error: %d\n", err);
+    exit(1);
+  }
+
+  if (header)
+    printf("mode,threads,conns,connected,queries,errors,qps,p50_us,p99_us,"
+           "p999_us,max_us,cpu_us_per_query,rss_mb\n");
+  for (p= conn_list; *p; p= *end ? end + 1 : end)
+  {
+    conns= strtoul(p, &end, 10);
+    if (end == p || (*end && *end != ',') || !conns)
+      usage(argv[0]);
+    if (modes & MODE_SYNC)
+      run(MODE_SYNC, conns);
+    if (modes & MODE_ASYNC)
+      run(MODE_ASYNC, conns);
+    if (modes & MODE_URING)
+      run(MODE_URING, conns);
+  }
+
+  mysql_library_end();
+  return 0;
+}
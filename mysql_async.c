@@ -2,14 +2,29 @@
   MySQL non-blocking client library functions.
 */
 
-extern int mysql_get_socket_fd(const MYSQL *mysql);
+#include <time.h>
+#include <pthread.h>
 
+#include "mysql_async.h"
+/* Inline the context switches into the foo_start()/foo_cont() wrappers. */
+#define MY_CONTEXT_INLINE
+#include "my_context.h"
+#include "my_stack_pool.h"
+#include "my_trace.h"
+#include "my_uring.h"
+#include "my_decompress.h"
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
 
-typedef enum {
-  MYSQL_WAIT_READ= 1,
-  MYSQL_WAIT_WRITE= 2,
-  MYSQL_WAIT_TIMEOUT= 4
-} MYSQL_ASYNC_STATUS;
+/*
+  Size of stack for async calls, taken from the stack pool. In adaptive
+  stack mode, this is the size calls get until they have been measured.
+*/
+#define STACK_SIZE 65536
+
+/* Compressed bytes read at a time, with decompression enabled. */
+#define DECOMPRESS_IN_SIZE 16384
 
 struct mysql_async_context {
   /*
@@ -26,12 +41,15 @@ struct mysql_async_context {
     types.
   */
   union {
-    MYSQL *r_mysql;
-    int *r_int;
+    void *r_ptr;
+    int r_int;
+    unsigned int r_uint;
+    my_bool r_my_bool;
   } ret_result;
   /*
-    The timeout value, for suspended calls that need to wake up on a timeout
-    (eg. mysql_real_connect_start().
+    The timeout value in seconds, for suspended calls that need to wake up on
+    a timeout (eg. mysql_real_connect_start(), or reads and writes when
+    read_timeout/write_timeout is set).
   */
   uint timeout_value;
   /*
@@ -60,211 +78,1881 @@ struct mysql_async_context {
     suspended context later when the application re-invokes us with
     foo_cont().
   */
-  my_context async_context;
+  struct my_context async_context;
+  /*
+    The stack on which the async context runs. It is taken from the stack
+    pool when an operation is started with foo_start(), and returned to the
+    pool when the operation completes, so it is NULL while no operation is
+    in progress.
+  */
+  struct my_stack *stack;
+  /*
+    Memory for the rows returned from mysql_fetch_rows_start(), which must
+    stay valid after the network buffer is overwritten by the next row.
+    Reused for each batch.
+  */
+  MEM_ROOT batch_root;
+  /*
+    Optional read-ahead buffer, see mysql_async_set_read_ahead(). Bytes
+    [ra_pos, ra_end) have been received but not yet returned from
+    my_recv_async(). ra_size is 0 when disabled.
+  */
+  unsigned char *ra_buf;
+  size_t ra_size, ra_pos, ra_end;
+  struct mysql_async_recv_stats recv_stats;
+  /*
+    Optional send queue, see mysql_async_set_send_queue(). Bytes
+    [sq_sent, sq_len) of sq_buf are queued for sending on sq_fd, with
+    write timeout sq_timeout. sq_size is 0 when disabled. sq_error is the
+    errno of a failed flush, reported by the next send or receive.
+  */
+  unsigned char *sq_buf;
+  size_t sq_size, sq_len, sq_sent;
+  int sq_fd;
+  uint sq_timeout;
+  int sq_error;
+  /*
+    Set by a call that wants its writes to stay in the send queue when it
+    completes (pipelined sends), cleared when the next call starts.
+  */
+  my_bool sq_corked;
+  struct mysql_async_send_stats send_stats;
+  /*
+    The part of recv_stats and send_stats already added to the global
+    stats. The counters themselves are never reset, as they are returned
+    by mysql_async_get_recv_stats() and mysql_async_get_send_stats().
+  */
+  struct mysql_async_recv_stats recv_flushed;
+  struct mysql_async_send_stats send_flushed;
+  /*
+    Number of statements sent with mysql_pipeline_send_start() whose
+    results have not been read yet.
+  */
+  uint pipeline_pending;
+  /*
+    Optional io_uring for the socket I/O, see mysql_async_set_uring(), and
+    the operation used for it (at most one is in flight at a time).
+  */
+  struct my_uring *uring;
+  struct my_uring_op *uring_op;
+  /*
+    Optional streaming decompression, see mysql_async_set_decompress().
+    Bytes [dc_in_pos, dc_in_end) of dc_in are compressed data received but
+    not yet decompressed.
+  */
+  struct my_decompress *dc;
+  unsigned char *dc_in;
+  size_t dc_in_pos, dc_in_end;
+  /*
+    Instrumentation, see mysql_async_enable_stats(). NULL when disabled,
+    so that the only cost then is testing this pointer.
+  */
+  struct mysql_async_stats *stats;
+  /* For the stats: the call in progress, and when it and its run began. */
+  uint call_id;
+  /* MYSQL_ASYNC_ID_xxx of the call in progress (or last run). */
+  uint active_call;
+  unsigned long long call_start_ns, run_start_ns;
+  /* The stack was painted, to measure the stack use of the call. */
+  my_bool stack_painted;
+  uint stack_call_id;
 };
 
+static int my_flush_async(struct mysql_async_context *b);
+
+/*
+  Stack measurements per kind of call, shared by all threads, so updated
+  with atomic operations.
+*/
+static enum mysql_async_stack_mode stack_mode= MYSQL_ASYNC_STACK_FIXED;
+static unsigned long long stack_samples[MYSQL_ASYNC_CALL_COUNT];
+static unsigned long long stack_calls[MYSQL_ASYNC_CALL_COUNT];
+static size_t stack_max_used[MYSQL_ASYNC_CALL_COUNT];
+
+/*
+  True when enough calls of a kind have finished with a measurement to
+  size its stacks. Calls started but not finished do not count: with many
+  connects in flight at once, none of them may have been measured yet.
+*/
+static int
+my_async_stack_learned(uint call_id)
+{
+  return __atomic_load_n(&stack_samples[call_id], __ATOMIC_RELAXED) >=
+    MYSQL_ASYNC_STACK_LEARN &&
+    __atomic_load_n(&stack_max_used[call_id], __ATOMIC_RELAXED) > 0;
+}
+
+/* Size of stack for an adaptively sized call that is not measured. */
+static size_t
+my_async_stack_adapted(uint call_id)
+{
+  size_t size= 2 * __atomic_load_n(&stack_max_used[call_id], __ATOMIC_RELAXED);
+
+  size= (size + 4095) & ~(size_t)4095;
+  return MY_MIN(MY_MAX(size, MYSQL_ASYNC_STACK_MIN), STACK_SIZE);
+}
+
+/*
+  Get the stack for an async call, and decide whether to paint it for
+  measuring.
+*/
+static struct my_stack *
+my_async_stack_alloc(struct mysql_async_context *b, uint call_id)
+{
+  struct my_stack *stack;
+  unsigned long long n;
+  size_t size= STACK_SIZE;
 
-struct my_real_connect_params {
-  MYSQL *mysql;
-  const char *host;
-  const char *user;
-  const char *passwd;
-  const char *db;
-  unsigned int port;
-  const char *unix_socket;
-  unsigned long client_flags;
+  b->stack_painted= 0;
+  if (stack_mode == MYSQL_ASYNC_STACK_FIXED)
+    return my_stack_alloc(size);
+  if (stack_mode == MYSQL_ASYNC_STACK_MEASURE)
+    b->stack_painted= 1;
+  else
+  {
+    n= __atomic_fetch_add(&stack_calls[call_id], 1, __ATOMIC_RELAXED);
+    if (!my_async_stack_learned(call_id) ||
+        n % MYSQL_ASYNC_STACK_RESAMPLE == 0)
+      b->stack_painted= 1;
+    else
+      size= my_async_stack_adapted(call_id);
+  }
+  if (!(stack= my_stack_alloc(size)))
+    return NULL;
+  if (b->stack_painted)
+  {
+    b->stack_call_id= call_id;
+    my_stack_paint(stack);
+  }
+  return stack;
 }
 
+/* Record the stack use of a finished call, if its stack was painted. */
 static void
-mysql_real_connect_start_internal(void *d)
+my_async_stack_measure(struct mysql_async_context *b)
 {
-  struct my_real_connect_params *parms;
-  MYSQL *ret;
-  struct mysql_async_context *b;
+  size_t used, old;
+  uint id= b->stack_call_id;
+
+  if (!b->stack_painted)
+    return;
+  used= my_stack_used(b->stack);
+  __atomic_fetch_add(&stack_samples[id], 1, __ATOMIC_RELAXED);
+  old= __atomic_load_n(&stack_max_used[id], __ATOMIC_RELAXED);
+  while (used > old &&
+         !__atomic_compare_exchange_n(&stack_max_used[id], &old, used, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
 
-  parms= (struct my_real_connect_params *)d;
-  b= parms->mysql->async_context;
+/* Aggregate of the stats of connections that have been merged. */
+static struct mysql_async_stats global_stats;
+static pthread_mutex_t global_stats_lock= PTHREAD_MUTEX_INITIALIZER;
 
-  ret= mysql_real_connect(parms->mysql, parms->host, parms->user, parms->passwd,
-                          parms->db, parms->port, parms->unix_socket,
-                          parms->client_flags);
-  b->ret_result.r_mysql= ret;
-  b->ret_status= 0;
+static unsigned long long
+my_async_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-MYSQL_ASYNC_STATUS
-mysql_real_connect_start(MYSQL **ret, MYSQL *mysql, const char *host,
-                         const char *user, const char *passwd, const char *db,
-                         unsigned int port, const char *unix_socket,
-                         unsigned long client_flags)
+/*
+  Histogram bucket for a value: values below 4 have a bucket each, above
+  that there are 4 buckets per power of two, so the relative error is
+  at most 25%. Like HdrHistogram, with 2 bits of precision.
+*/
+static uint
+my_async_hist_bucket(unsigned long long v)
 {
-  int res;
-  struct mysql_async_context *b;
-  struct my_real_connect_params parms;
+  uint msb;
+
+  if (v < 4)
+    return (uint)v;
+  msb= 63 - __builtin_clzll(v);
+  if (msb > MYSQL_ASYNC_HIST_MAX_BITS)
+    return MYSQL_ASYNC_HIST_BUCKETS - 1;
+  return (msb - 1) * 4 + (uint)((v >> (msb - 2)) & 3);
+}
+
+void
+mysql_async_histogram_add(struct mysql_async_histogram *h,
+                          unsigned long long v)
+{
+  h->count++;
+  h->sum_ns+= v;
+  if (v > h->max_ns)
+    h->max_ns= v;
+  h->buckets[my_async_hist_bucket(v)]++;
+}
+
+void
+mysql_async_histogram_merge(struct mysql_async_histogram *to,
+                            const struct mysql_async_histogram *from)
+{
+  uint i;
+
+  to->count+= from->count;
+  to->sum_ns+= from->sum_ns;
+  if (from->max_ns > to->max_ns)
+    to->max_ns= from->max_ns;
+  for (i= 0; i < MYSQL_ASYNC_HIST_BUCKETS; i++)
+    to->buckets[i]+= from->buckets[i];
+}
+
+static void
+my_async_stats_merge(struct mysql_async_stats *to,
+                     const struct mysql_async_stats *from)
+{
+  uint i;
+
+  to->spawns+= from->spawns;
+  to->direct+= from->direct;
+  to->yields_read+= from->yields_read;
+  to->yields_write+= from->yields_write;
+  to->yields_timeout+= from->yields_timeout;
+  to->suspended_ns+= from->suspended_ns;
+  to->running_ns+= from->running_ns;
+  to->recv.reads+= from->recv.reads;
+  to->recv.buffered_reads+= from->recv.buffered_reads;
+  to->recv.syscalls+= from->recv.syscalls;
+  to->recv.eagain+= from->recv.eagain;
+  to->recv.bytes+= from->recv.bytes;
+  to->send.sends+= from->send.sends;
+  to->send.queued+= from->send.queued;
+  to->send.flushes+= from->send.flushes;
+  to->send.syscalls+= from->send.syscalls;
+  to->send.eagain+= from->send.eagain;
+  to->send.bytes+= from->send.bytes;
+  for (i= 0; i < MYSQL_ASYNC_CALL_COUNT; i++)
+    mysql_async_histogram_merge(&to->latency[i], &from->latency[i]);
+}
+
+/*
+  Fill in the I/O counters, which are kept always, into the stats: the
+  part not yet added to the global stats.
+*/
+static void
+my_async_stats_fill_io(struct mysql_async_context *b)
+{
+  struct mysql_async_recv_stats *r= &b->stats->recv;
+  struct mysql_async_send_stats *s= &b->stats->send;
+
+  r->reads= b->recv_stats.reads - b->recv_flushed.reads;
+  r->buffered_reads= b->recv_stats.buffered_reads -
+    b->recv_flushed.buffered_reads;
+  r->syscalls= b->recv_stats.syscalls - b->recv_flushed.syscalls;
+  r->eagain= b->recv_stats.eagain - b->recv_flushed.eagain;
+  r->bytes= b->recv_stats.bytes - b->recv_flushed.bytes;
+  s->sends= b->send_stats.sends - b->send_flushed.sends;
+  s->queued= b->send_stats.queued - b->send_flushed.queued;
+  s->flushes= b->send_stats.flushes - b->send_flushed.flushes;
+  s->syscalls= b->send_stats.syscalls - b->send_flushed.syscalls;
+  s->eagain= b->send_stats.eagain - b->send_flushed.eagain;
+  s->bytes= b->send_stats.bytes - b->send_flushed.bytes;
+}
+
+/*
+  Add the stats of a connection to the global aggregate and reset them.
+  The I/O counters are left alone; only the point they were flushed up to
+  moves.
+*/
+static void
+my_async_stats_flush(struct mysql_async_context *b)
+{
+  my_async_stats_fill_io(b);
+  pthread_mutex_lock(&global_stats_lock);
+  my_async_stats_merge(&global_stats, b->stats);
+  pthread_mutex_unlock(&global_stats_lock);
+  memset(b->stats, 0, sizeof(*b->stats));
+  b->recv_flushed= b->recv_stats;
+  b->send_flushed= b->send_stats;
+}
+
+
+/*
+  Get the async context of a connection, allocating it on first use.
+  The context is freed with mysql_async_free_context(), from mysql_close().
+*/
+static struct mysql_async_context *
+mysql_get_async_context(MYSQL *mysql)
+{
+  struct mysql_async_context *b= mysql->async_context;
 
-  b= mysql->async_context;
   if (!b)
   {
     if (!(b= mysql->async_context= (struct mysql_async_context *)
           my_malloc(sizeof(*b), MYF(MY_ZEROFILL))))
-    {
       set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
-      *ret= NULL;
-      return 0;
-    }
+    else
+      init_alloc_root(&b->batch_root, 8192, 0);
   }
-  parms.mysql= mysql;
-  parms.host= host;
-  parms.user= user;
-  parms.passwd= passwd;
-  parms.db= db;
-  parms.port= port;
-  parms.unix_socket= unix_socket;
-  parms.client_flags= client_flags;
+  return b;
+}
 
-  b->async_call_active= 1;
-  /* ToDo: Need to properly handle allocation of stack. */
-  res= my_context_spawn(&b->async_context, mysql_real_connect_start_internal,
-                        parms, malloc(STACK_SIZE), STACK_SIZE);
-  b->async_call_active= 0;
-  if (res < 0)
+void
+mysql_async_free_context(struct mysql_async_context *b)
+{
+  /*
+    An operation still pending on the io_uring (the connection is closed
+    while suspended) points into the buffers and the stack, so the kernel
+    must be done with it before they are freed. If we cannot make sure of
+    that, the memory is leaked rather than risk it being written to.
+  */
+  if (b->uring_op && b->uring_op->state == MY_URING_OP_PENDING &&
+      my_uring_cancel(b->uring, b->uring_op))
+    return;
+  if (b->stats)
   {
-    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
-    b->suspended= 0;
-    return NULL;
+    my_async_stats_flush(b);
+    my_free(b->stats, MYF(0));
   }
-  else if (res > 0)
+  if (b->stack)
+    my_stack_free(b->stack);
+  free_root(&b->batch_root, MYF(0));
+  my_free(b->ra_buf, MYF(MY_ALLOW_ZERO_PTR));
+  my_free(b->sq_buf, MYF(MY_ALLOW_ZERO_PTR));
+  if (b->uring_op)
+    my_uring_op_free(b->uring_op);
+  if (b->dc)
+    my_decompress_free(b->dc);
+  my_free(b->dc_in, MYF(MY_ALLOW_ZERO_PTR));
+  my_free(b, MYF(0));
+}
+
+/*
+  Common bookkeeping after spawning or continuing an async call.
+  Returns the my_context_spawn()/my_context_continue() result, >0 when
+  suspended, 0 when finished, -1 on error.
+*/
+static int
+mysql_async_done(MYSQL *mysql, struct mysql_async_context *b, int res)
+{
+  b->async_call_active= 0;
+  if (res > 0)
   {
     /* Suspended. */
     b->suspended= 1;
-    return b->ret_status;
+    return res;
   }
+
+  /* Finished (or failed). */
+  MY_TRACE2(mysql_async, call_done, b, res);
+  if (res < 0)
+    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
   else
   {
-    /* Finished. */
-    b->suspended= 0;
-    *ret= b->ret_result.r_mysql;
-    return 0;
+    if (b->stats && b->call_id < MYSQL_ASYNC_CALL_COUNT)
+    {
+      unsigned long long now= my_async_now_ns();
+
+      b->stats->running_ns+= now - b->run_start_ns;
+      mysql_async_histogram_add(&b->stats->latency[b->call_id],
+                        now - b->call_start_ns);
+    }
+    my_async_stack_measure(b);
+  }
+  b->suspended= 0;
+  my_stack_free(b->stack);
+  b->stack= NULL;
+  return res;
+}
+
+/*
+  Run func(parms) as a new async call on a pooled stack. call_id is the
+  MYSQL_ASYNC_ID_xxx of the call, for the stats.
+*/
+static int
+mysql_async_spawn(MYSQL *mysql, struct mysql_async_context *b, uint call_id,
+                  void (*func)(void *), void *parms)
+{
+  if (!(b->stack= my_async_stack_alloc(b, call_id)))
+  {
+    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+    return -1;
   }
+  MY_TRACE3(mysql_async, call_start, mysql, b, call_id);
+  b->active_call= call_id;
+  if (b->stats)
+  {
+    b->stats->spawns++;
+    b->call_id= call_id;
+    b->call_start_ns= b->run_start_ns= my_async_now_ns();
+  }
+  b->async_call_active= 1;
+  b->sq_corked= 0;
+  return mysql_async_done(mysql, b,
+                          my_context_spawn(&b->async_context, func, parms,
+                                           b->stack->stack,
+                                           b->stack->stack_size));
 }
 
-MYSQL_ASYNC_STATUS
-mysql_real_connect_cont(MYSQL **ret, MYSQL *mysql,
-                        MYSQL_ASYNC_STATUS ready_status)
+/*
+  Resume a suspended async call. Returns -1 with an error set if there is
+  no suspended call.
+*/
+static int
+mysql_async_resume(MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status)
 {
-  int res;
-  struct mysql_async_context *b;
+  struct mysql_async_context *b= mysql->async_context;
 
-  b= mysql->async_context;
   if (!b || !b->suspended)
   {
-    set_mysql_error(mysql, "No suspended call is active", unknown_sqlstate);
-    *ret= NULL;
-    return 0;
+    set_mysql_error(mysql, CR_COMMANDS_OUT_OF_SYNC, unknown_sqlstate);
+    return -1;
   }
-
   b->async_call_active= 1;
   b->ret_status= ready_status;
-  res= my_context_continue(&b->async_context);
-  b->async_call_active= 0;
-  if (res < 0)
-  {
-    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
-    b->suspended= 0;
-    return NULL;
-  }
-  else if (res > 0)
+  if (b->stats)
   {
-    /* Suspended. */
-    return b->ret_status;
+    /* The suspended time is accounted in my_async_yield(). */
+    b->run_start_ns= my_async_now_ns();
   }
-  else
+  return mysql_async_done(mysql, b, my_context_continue(&b->async_context));
+}
+
+
+/*
+  Only one call can be in progress on a connection. Returns non-zero, with
+  CR_COMMANDS_OUT_OF_SYNC set, if one is suspended; starting another would
+  run it on top of the suspended one's state.
+*/
+static inline int
+mysql_async_busy(MYSQL *mysql)
+{
+  if (!mysql || !mysql->async_context || !mysql->async_context->suspended)
+    return 0;
+  set_mysql_error(mysql, CR_COMMANDS_OUT_OF_SYNC, unknown_sqlstate);
+  return 1;
+}
+
+/*
+  While pipelined results are unread, the next reply from the server is
+  the result of a pipelined query, so only the calls that read or consume
+  those results (and further pipeline sends) are allowed; any other
+  command would take that result as its own reply. Returns non-zero, with
+  CR_COMMANDS_OUT_OF_SYNC set, if call_id is not allowed now.
+*/
+static int
+mysql_async_pipeline_check(MYSQL *mysql, uint call_id)
+{
+  struct mysql_async_context *b= mysql->async_context;
+
+  if (!b || !b->pipeline_pending)
+    return 0;
+  switch (call_id)
   {
-    /* Finished. */
-    b->suspended= 0;
-    *ret= b->ret_result.r_mysql;
+  case MYSQL_ASYNC_ID_mysql_pipeline_send:
+  case MYSQL_ASYNC_ID_mysql_pipeline_read_result:
+  case MYSQL_ASYNC_ID_mysql_store_result:
+  case MYSQL_ASYNC_ID_mysql_fetch_row:
+  case MYSQL_ASYNC_ID_mysql_fetch_rows:
+  case MYSQL_ASYNC_ID_mysql_next_result:
+  case MYSQL_ASYNC_ID_mysql_free_result:
+  case MYSQL_ASYNC_ID_mysql_close_slow_part:
     return 0;
+  case MYSQL_ASYNC_ID_mysql_real_connect:
+    /* A new connection, the old results are gone. */
+    b->pipeline_pending= 0;
+    return 0;
+  default:
+    set_mysql_error(mysql, CR_COMMANDS_OUT_OF_SYNC, unknown_sqlstate);
+    return 1;
   }
 }
 
-int
-my_connect_async(mysql_async_context *b, my_socket fd, const struct sockaddr *name, uint namelen, uint timeout)
+
+/* Count a call completed directly in foo_start(), without a context. */
+static inline void
+mysql_async_count_direct(MYSQL *mysql)
 {
-  int res;
-  int flags;
-  socklen_t *s_err_size;
-  /* Set fd non-blocking. */
-  /*
-    Note: This can be done similarly on Windows, except we need ioctlsocket()
-    to set non-blocking and a second conenct() call to get result of connect attempt.
-  */
-  flags = fcntl(fd, F_GETFL, 0);
-  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  if (mysql && mysql->async_context && mysql->async_context->stats)
+    mysql->async_context->stats->direct++;
+}
 
-  /*
-    Start to connect asynchronously.
-    If this will block, we suspend the call and return control to the
-    application context. The application will then resume us when the socket
-    polls ready for write, indicating that the connection attempt completed.
-  */
-  res= connect(fd, addr, len);
-  if (res < 0)
-  {
-    if (errno != EINPROGRESS && errno != EALREADY)
-      return res;
-    b->timeout_value= timeout;
-    b->ret_status= MYSQL_WAIT_WRITE | MYSQL_WAIT_TIMEOUT;
-    my_context_yield(&b->async_context);
-    if (b->ret_status & MYSQL_WAIT_TIMEOUT)
-      return -1;
 
-    s_err_size= sizeof(int);
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*) &res, &s_err_size) != 0)
-      return -1;
-    if (res)
-    {
-      errno= res;
-      return -1;
-    }
-  }
-  return res;
+#ifdef HAVE_OPENSSL
+/*
+  As mysql_async_packet_ready(), for a TLS connection: the rest of the
+  packet must be in records already decrypted by the TLS library.
+*/
+static my_bool
+mysql_async_ssl_packet_ready(Vio *vio, size_t vio_avail)
+{
+  SSL *ssl= (SSL *)vio->ssl_arg;
+  size_t avail= vio_avail + SSL_pending(ssl);
+  uchar header[NET_HEADER_SIZE];
+  size_t i;
+  int peek;
+  ulong len;
+
+  if (avail < NET_HEADER_SIZE)
+    return 0;
+  for (i= 0; i < vio_avail && i < NET_HEADER_SIZE; i++)
+    header[i]= (uchar)vio->read_pos[i];
+  /* Only looks at the buffered record, as SSL_pending() covers it. */
+  peek= (int)(NET_HEADER_SIZE - i);
+  if (peek > 0 && SSL_peek(ssl, header + i, peek) != peek)
+    return 0;
+  len= uint3korr(header);
+  return len < MAX_PACKET_LENGTH && avail >= NET_HEADER_SIZE + len;
 }
+#endif
 
-ssize_t
-my_recv_async(mysql_async_context *b, int fd, unsigned char *buf, size_t size)
+/*
+  Check if a complete packet is already buffered, in the Vio buffer and/or
+  our read-ahead buffer (or the TLS library), so that reading it will not
+  block.
+
+  Compressed protocol and packets split over several network packets
+  (length 0xffffff) are not checked for and always count as not buffered.
+*/
+static my_bool
+mysql_async_packet_ready(MYSQL *mysql)
 {
-  ssize_t res;
+  Vio *vio= mysql->net.vio;
+  struct mysql_async_context *b= mysql->async_context;
+  size_t vio_avail, avail;
+  uchar header[NET_HEADER_SIZE];
+  uint i;
+  ulong len;
 
-  for (;;)
-  {
-    res= recv(fd, buf, size, MSG_DONTWAIT);
-    if (res >= 0 || errno != EAGAIN)
-      return res;
-    b->ret_status= MYSQL_WAIT_READ;
-    my_context_yield(&b->async_context);
-  }
+  if (!vio || mysql->net.compress)
+    return 0;
+  vio_avail= vio->read_pos ? vio->read_end - vio->read_pos : 0;
+#ifdef HAVE_OPENSSL
+  if (vio->ssl_arg)
+    return mysql_async_ssl_packet_ready(vio, vio_avail);
+#endif
+  avail= vio_avail + (b ? b->ra_end - b->ra_pos : 0);
+  if (avail < NET_HEADER_SIZE)
+    return 0;
+  for (i= 0; i < NET_HEADER_SIZE; i++)
+    header[i]= i < vio_avail ? (uchar)vio->read_pos[i] :
+                               b->ra_buf[b->ra_pos + i - vio_avail];
+  len= uint3korr(header);
+  return len < MAX_PACKET_LENGTH && avail >= NET_HEADER_SIZE + len;
 }
 
-ssize_t
-my_send_async(mysql_async_context *b, int fd, unsigned char *buf, size_t size)
+/*
+  True if mysql_fetch_row() on an unbuffered (mysql_use_result()) result
+  will return without reading from the network. This is the common case
+  when streaming many rows: one recv() typically brings in many rows, and
+  only the one that is split across the end of the buffer needs to wait.
+*/
+static my_bool
+mysql_async_row_ready(MYSQL_RES *result)
 {
-  ssize_t res;
+  return result->eof || result->handle->status != MYSQL_STATUS_USE_RESULT ||
+    mysql_async_packet_ready(result->handle);
+}
 
-  for (;;)
-  {
-    res= send(fd, buf, size, MSG_DONTWAIT);
-    if (res >= 0 || errno != EAGAIN)
-      return res;
-    b->ret_status= MYSQL_WAIT_WRITE;
-    my_context_yield(&b->async_context);
-  }
+/*
+  True if mysql_stmt_fetch() will return the next row without reading
+  from the network, ie. the result was buffered with
+  mysql_stmt_store_result() (or a block of rows was fetched from a cursor)
+  and rows remain.
+*/
+static my_bool
+mysql_async_stmt_row_ready(MYSQL_STMT *stmt)
+{
+  return stmt->data_cursor != NULL;
 }
 
-uint
-mysql_get_timeout_value(const MYSQL *mysql)
+/* True if mysql_free_result() does not need to read any remaining rows. */
+static my_bool
+mysql_async_result_done(MYSQL_RES *result)
 {
-  if (mysql->async_context && mysql->async_context->active)
-    return mysql->async_context->timeout_value;
-  else
+  return result->eof || result->handle->status != MYSQL_STATUS_USE_RESULT;
+}
+
+
+/*
+  Flush the send queue at the end of a call, unless the call corked it.
+  Returns non-zero, with the error set in mysql, if this failed; the call
+  must then return failure. Only calls that send without reading a reply
+  (which return an int or my_bool status) can end with data queued, as
+  a receive flushes the queue first.
+*/
+static int
+mysql_async_end_flush(MYSQL *mysql, struct mysql_async_context *b)
+{
+  if (b->sq_corked || b->sq_sent == b->sq_len || !my_flush_async(b))
     return 0;
+  set_mysql_error(mysql, CR_SERVER_LOST, unknown_sqlstate);
+  return 1;
+}
+
+/*
+  Generator for the foo_start() / foo_cont() wrappers.
+
+  Every call that can block is listed in MYSQL_ASYNC_CALLS (calls with a
+  return value) or MYSQL_ASYNC_VOID_CALLS (calls without), and for each one
+  the macros below emit:
+
+   - struct foo_params, holding the arguments;
+   - foo_start_internal(), which runs in the spawned context and calls the
+     real foo() with the arguments;
+   - foo_start() and foo_cont().
+
+  The columns of the tables are:
+
+    call         Name of the blocking function.
+    ret_type     Its return type ...
+    ret_member   ... and the member of ret_result used to pass it back.
+    err_val      Value returned in case of out-of-memory and similar errors.
+    obj_type,    The first argument of the call, which identifies the
+    obj          connection.
+    mysql_val    Expression giving the MYSQL * from obj. If it is NULL (eg.
+                 a result from mysql_store_result(), which has no handle), the
+                 call cannot block and is run directly.
+    direct       Expression that is true when the call can be completed
+                 without blocking, from data already received. The call is
+                 then run directly, without the cost of spawning a context.
+    PARAMS       Macro listing the remaining arguments as M(type, name).
+
+  All arguments are copied into the call before the first possible yield,
+  so the params struct can live on the stack of foo_start().
+
+  Before the call completes, anything left in the send queue is flushed,
+  so that eg. mysql_send_query_start() does not return with the query
+  still sitting in the queue; if that fails, so does the call. Pipelined
+  sends are the exception, they stay queued until the first result is
+  read.
+*/
+
+#define ASYNC_NO_PARAMS(M)
+#define ASYNC_FIELD(type, name) type name;
+#define ASYNC_DECL(type, name) , type name
+#define ASYNC_ASSIGN(type, name) parms.name= name;
+#define ASYNC_ARG(type, name) , parms->name
+#define ASYNC_DIRECT(type, name) , name
+
+#define ASYNC_PARAMS_real_connect(M)                                    \
+  M(const char *, host) M(const char *, user) M(const char *, passwd)   \
+  M(const char *, db) M(unsigned int, port) M(const char *, unix_socket) \
+  M(unsigned long, client_flags)
+#define ASYNC_PARAMS_query(M)                                           \
+  M(const char *, stmt_str)
+#define ASYNC_PARAMS_real_query(M)                                      \
+  M(const char *, stmt_str) M(unsigned long, length)
+#define ASYNC_PARAMS_select_db(M)                                       \
+  M(const char *, db)
+#define ASYNC_PARAMS_change_user(M)                                     \
+  M(const char *, user) M(const char *, passwd) M(const char *, db)
+#define ASYNC_PARAMS_autocommit(M)                                      \
+  M(my_bool, auto_mode)
+#define ASYNC_PARAMS_fetch_rows(M)                                      \
+  M(MYSQL_ROW *, rows) M(unsigned int, max_rows)
+#define ASYNC_PARAMS_stmt_prepare(M)                                    \
+  M(const char *, stmt_str) M(unsigned long, length)
+#define ASYNC_PARAMS_stmt_send_long_data(M)                             \
+  M(unsigned int, param_number) M(const char *, data)                   \
+  M(unsigned long, length)
+
+#define MYSQL_ASYNC_CALLS(X)                                            \
+  X(mysql_real_connect, MYSQL *, r_ptr, NULL,                           \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_real_connect)                \
+  X(mysql_query, int, r_int, 1,                                         \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_query)                       \
+  X(mysql_real_query, int, r_int, 1,                                    \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_real_query)                  \
+  X(mysql_send_query, int, r_int, 1,                                    \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_real_query)                  \
+  X(mysql_read_query_result, my_bool, r_my_bool, 1,                     \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_store_result, MYSQL_RES *, r_ptr, NULL,                       \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_fetch_row, MYSQL_ROW, r_ptr, NULL,                            \
+    MYSQL_RES *, result, result->handle,                                \
+    mysql_async_row_ready(result), ASYNC_NO_PARAMS)                     \
+  X(mysql_fetch_rows, unsigned int, r_uint, 0,                          \
+    MYSQL_RES *, result, result->handle,                                \
+    mysql_async_row_ready(result), ASYNC_PARAMS_fetch_rows)             \
+  X(mysql_next_result, int, r_int, 1,                                   \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_ping, int, r_int, 1,                                          \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_select_db, int, r_int, 1,                                     \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_select_db)                   \
+  X(mysql_change_user, my_bool, r_my_bool, 1,                           \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_change_user)                 \
+  X(mysql_commit, my_bool, r_my_bool, 1,                                \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_rollback, my_bool, r_my_bool, 1,                              \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_autocommit, my_bool, r_my_bool, 1,                            \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_autocommit)                  \
+  X(mysql_pipeline_send, int, r_int, 1,                                 \
+    MYSQL *, mysql, mysql, 0, ASYNC_PARAMS_real_query)                  \
+  X(mysql_pipeline_read_result, my_bool, r_my_bool, 1,                  \
+    MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)                          \
+  X(mysql_stmt_prepare, int, r_int, 1,                                  \
+    MYSQL_STMT *, stmt, stmt->mysql, 0, ASYNC_PARAMS_stmt_prepare)      \
+  X(mysql_stmt_execute, int, r_int, 1,                                  \
+    MYSQL_STMT *, stmt, stmt->mysql, 0, ASYNC_NO_PARAMS)                \
+  X(mysql_stmt_store_result, int, r_int, 1,                             \
+    MYSQL_STMT *, stmt, stmt->mysql, !stmt->field_count,                \
+    ASYNC_NO_PARAMS)                                                    \
+  X(mysql_stmt_fetch, int, r_int, 1,                                    \
+    MYSQL_STMT *, stmt, stmt->mysql, mysql_async_stmt_row_ready(stmt),  \
+    ASYNC_NO_PARAMS)                                                    \
+  X(mysql_stmt_send_long_data, my_bool, r_my_bool, 1,                   \
+    MYSQL_STMT *, stmt, stmt->mysql, 0,                                 \
+    ASYNC_PARAMS_stmt_send_long_data)
+
+#define MYSQL_ASYNC_VOID_CALLS(X)                                       \
+  X(mysql_free_result, MYSQL_RES *, result, result->handle,             \
+    mysql_async_result_done(result), ASYNC_NO_PARAMS)                   \
+  X(mysql_close_slow_part, MYSQL *, mysql, mysql, 0, ASYNC_NO_PARAMS)
+
+
+#define MK_ASYNC_PARAMS(call, obj_type, obj, PARAMS)                    \
+struct call##_params {                                                  \
+  obj_type obj;                                                         \
+  PARAMS(ASYNC_FIELD)                                                   \
+};
+
+#define MK_ASYNC_CALL(call, ret_type, ret_member, err_val,              \
+                      obj_type, obj, mysql_val, direct, PARAMS)         \
+MK_ASYNC_PARAMS(call, obj_type, obj, PARAMS)                            \
+                                                                        \
+static void                                                             \
+call##_start_internal(void *d)                                          \
+{                                                                       \
+  struct call##_params *parms= (struct call##_params *)d;               \
+  obj_type obj= parms->obj;                                             \
+  /* Not after the call, which may free obj or clear its handle. */      \
+  MYSQL *async_mysql= (mysql_val);                                      \
+  struct mysql_async_context *b= async_mysql->async_context;            \
+  ret_type ret;                                                         \
+                                                                        \
+  ret= call(obj PARAMS(ASYNC_ARG));                                     \
+  if (mysql_async_end_flush(async_mysql, b))                            \
+    ret= err_val;                                                       \
+  b->ret_result.ret_member= ret;                                        \
+  b->ret_status= 0;                                                     \
+}                                                                       \
+                                                                        \
+MYSQL_ASYNC_STATUS                                                      \
+call##_start(ret_type *ret, obj_type obj PARAMS(ASYNC_DECL))            \
+{                                                                       \
+  int async_res;                                                        \
+  MYSQL *async_mysql= (mysql_val);                                      \
+  struct mysql_async_context *b;                                        \
+  struct call##_params parms;                                           \
+                                                                        \
+  if (mysql_async_busy(async_mysql))                                    \
+  {                                                                     \
+    *ret= err_val;                                                      \
+    return 0;                                                           \
+  }                                                                     \
+  if (!async_mysql || (direct))                                         \
+  {                                                                     \
+    /* Cannot block, so no need for a context. */                       \
+    mysql_async_count_direct(async_mysql);                              \
+    *ret= call(obj PARAMS(ASYNC_DIRECT));                               \
+    return 0;                                                           \
+  }                                                                     \
+  if (mysql_async_pipeline_check(async_mysql, MYSQL_ASYNC_ID_##call) || \
+      !(b= mysql_get_async_context(async_mysql)))                       \
+  {                                                                     \
+    *ret= err_val;                                                      \
+    return 0;                                                           \
+  }                                                                     \
+  parms.obj= obj;                                                       \
+  PARAMS(ASYNC_ASSIGN)                                                  \
+  async_res= mysql_async_spawn(async_mysql, b, MYSQL_ASYNC_ID_##call,   \
+                               call##_start_internal, &parms);          \
+  if (async_res > 0)                                                    \
+    return b->ret_status;                                               \
+  *ret= async_res < 0 ? err_val : (ret_type)b->ret_result.ret_member;   \
+  return 0;                                                             \
+}                                                                       \
+                                                                        \
+MYSQL_ASYNC_STATUS                                                      \
+call##_cont(ret_type *ret, obj_type obj,                                \
+            MYSQL_ASYNC_STATUS ready_status)                            \
+{                                                                       \
+  int async_res;                                                        \
+  MYSQL *async_mysql= (mysql_val);                                      \
+                                                                        \
+  if (!async_mysql)                                                     \
+  {                                                                     \
+    /* Nothing can be suspended without a handle. */                    \
+    *ret= err_val;                                                      \
+    return 0;                                                           \
+  }                                                                     \
+  async_res= mysql_async_resume(async_mysql, ready_status);             \
+  if (async_res > 0)                                                    \
+    return async_mysql->async_context->ret_status;                      \
+  *ret= async_res < 0 ? err_val :                                       \
+    (ret_type)async_mysql->async_context->ret_result.ret_member;        \
+  return 0;                                                             \
+}
+
+#define MK_ASYNC_VOID_CALL(call, obj_type, obj, mysql_val, direct,      \
+                           PARAMS)                                      \
+MK_ASYNC_PARAMS(call, obj_type, obj, PARAMS)                            \
+                                                                        \
+static void                                                             \
+call##_start_internal(void *d)                                          \
+{                                                                       \
+  struct call##_params *parms= (struct call##_params *)d;               \
+  obj_type obj= parms->obj;                                             \
+  /* Not after the call, which may free obj or clear its handle. */      \
+  MYSQL *async_mysql= (mysql_val);                                      \
+  struct mysql_async_context *b= async_mysql->async_context;            \
+                                                                        \
+  call(obj PARAMS(ASYNC_ARG));                                          \
+  mysql_async_end_flush(async_mysql, b);                                \
+  b->ret_status= 0;                                                     \
+}                                                                       \
+                                                                        \
+MYSQL_ASYNC_STATUS                                                      \
+call##_start(obj_type obj PARAMS(ASYNC_DECL))                           \
+{                                                                       \
+  int async_res;                                                        \
+  MYSQL *async_mysql= (mysql_val);                                      \
+  struct mysql_async_context *b;                                        \
+  struct call##_params parms;                                           \
+                                                                        \
+  if (mysql_async_busy(async_mysql))                                    \
+    return 0;                                                           \
+  if (!async_mysql || (direct))                                         \
+  {                                                                     \
+    mysql_async_count_direct(async_mysql);                              \
+    call(obj PARAMS(ASYNC_DIRECT));                                     \
+    return 0;                                                           \
+  }                                                                     \
+  if (mysql_async_pipeline_check(async_mysql, MYSQL_ASYNC_ID_##call) || \
+      !(b= mysql_get_async_context(async_mysql)))                       \
+    return 0;                                                           \
+  parms.obj= obj;                                                       \
+  PARAMS(ASYNC_ASSIGN)                                                  \
+  async_res= mysql_async_spawn(async_mysql, b, MYSQL_ASYNC_ID_##call,   \
+                               call##_start_internal, &parms);          \
+  return async_res > 0 ? b->ret_status : 0;                             \
+}                                                                       \
+                                                                        \
+MYSQL_ASYNC_STATUS                                                      \
+call##_cont(obj_type obj, MYSQL_ASYNC_STATUS ready_status)              \
+{                                                                       \
+  MYSQL *async_mysql= (mysql_val);                                      \
+                                                                        \
+  if (!async_mysql)                                                     \
+    return 0;                                                           \
+  if (mysql_async_resume(async_mysql, ready_status) > 0)                \
+    return async_mysql->async_context->ret_status;                      \
+  return 0;                                                             \
+}
+
+
+/*
+  Copy a row of an unbuffered result into root, laid out like the rows of
+  mysql_store_result(): each value NUL-terminated, row[field_count]
+  pointing past the last one.
+*/
+static MYSQL_ROW
+mysql_async_copy_row(MEM_ROOT *root, MYSQL_ROW row, unsigned long *lengths,
+                     unsigned int field_count)
+{
+  MYSQL_ROW copy;
+  char *pos;
+  size_t size= 0;
+  unsigned int i;
+
+  for (i= 0; i < field_count; i++)
+    if (row[i])
+      size+= lengths[i] + 1;
+  if (!(copy= (MYSQL_ROW)alloc_root(root, (field_count + 1) * sizeof(char *) +
+                                    size)))
+    return NULL;
+  pos= (char *)(copy + field_count + 1);
+  for (i= 0; i < field_count; i++)
+  {
+    if (!row[i])
+    {
+      copy[i]= NULL;
+      continue;
+    }
+    memcpy(pos, row[i], lengths[i]);
+    pos[lengths[i]]= '\0';
+    copy[i]= pos;
+    pos+= lengths[i] + 1;
+  }
+  copy[field_count]= pos;
+  return copy;
+}
+
+/*
+  Fetch up to max_rows rows into rows[], but after the first one only as
+  many as are already received, so that at most the first row can block.
+  Returns the number of rows; 0 means no more rows (or error, see
+  mysql_errno()).
+
+  For an unbuffered result, all rows but the last are copied into the
+  batch_root of the connection, as the next mysql_fetch_row() overwrites
+  them. They stay valid until the next mysql_fetch_rows_start() call on
+  the connection.
+*/
+static unsigned int
+mysql_fetch_rows(MYSQL_RES *result, MYSQL_ROW *rows, unsigned int max_rows)
+{
+  MYSQL *mysql= result->handle;
+  struct mysql_async_context *b;
+  unsigned int n= 0;
+
+  if (!mysql)
+  {
+    /* Stored result, the rows stay valid until mysql_free_result(). */
+    while (n < max_rows && (rows[n]= mysql_fetch_row(result)))
+      n++;
+    return n;
+  }
+
+  if (!(b= mysql_get_async_context(mysql)))
+    return 0;
+  free_root(&b->batch_root, MYF(MY_MARK_BLOCKS_FREE));
+  while (n < max_rows)
+  {
+    if (n > 0)
+    {
+      if (!mysql_async_row_ready(result))
+        break;
+      /* The previous row is about to be overwritten. */
+      if (!(rows[n - 1]= mysql_async_copy_row(&b->batch_root, rows[n - 1],
+                                              mysql_fetch_lengths(result),
+                                              result->field_count)))
+      {
+        set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+        return n - 1;
+      }
+    }
+    if (!(rows[n]= mysql_fetch_row(result)))
+      break;
+    n++;
+  }
+  return n;
+}
+
+/*
+  Send a query without waiting for, or reading, the results of queries
+  sent before it. The server executes the queries in order and sends the
+  results back in order, so they can be read with
+  mysql_pipeline_read_result() later.
+
+  This bypasses the usual command start in cli_advanced_command(): the
+  MYSQL_STATUS_READY check (earlier results may be unread) and net_clear()
+  (which would throw away received results). The packet sequence number
+  of a reply being read is preserved.
+*/
+static int
+mysql_pipeline_send(MYSQL *mysql, const char *stmt_str, unsigned long length)
+{
+  NET *net= &mysql->net;
+  struct mysql_async_context *b= mysql->async_context;
+  uint pkt_nr= net->pkt_nr, compress_pkt_nr= net->compress_pkt_nr;
+  my_bool err;
+
+  if (!net->vio)
+  {
+    set_mysql_error(mysql, CR_SERVER_GONE_ERROR, unknown_sqlstate);
+    return 1;
+  }
+  /* Writing would overwrite the row data in net->buff. */
+  if (mysql->status == MYSQL_STATUS_USE_RESULT)
+  {
+    set_mysql_error(mysql, CR_COMMANDS_OUT_OF_SYNC, unknown_sqlstate);
+    return 1;
+  }
+  net->pkt_nr= net->compress_pkt_nr= 0;
+  err= net_write_command(net, (uchar)COM_QUERY, (uchar *)"", 0,
+                         (const uchar *)stmt_str, length);
+  net->pkt_nr= pkt_nr;
+  net->compress_pkt_nr= compress_pkt_nr;
+  if (err)
+  {
+    set_mysql_error(mysql, CR_SERVER_LOST, unknown_sqlstate);
+    return 1;
+  }
+  b->pipeline_pending++;
+  /* Coalesce with the following sends. */
+  b->sq_corked= 1;
+  return 0;
+}
+
+/*
+  Read the result of the oldest pipelined query, like
+  mysql_read_query_result(). The previous result must have been consumed
+  (mysql_store_result() or mysql_use_result() and mysql_free_result()).
+*/
+static my_bool
+mysql_pipeline_read_result(MYSQL *mysql)
+{
+  NET *net= &mysql->net;
+  struct mysql_async_context *b= mysql->async_context;
+
+  if (!b->pipeline_pending || mysql->status != MYSQL_STATUS_READY)
+  {
+    set_mysql_error(mysql, CR_COMMANDS_OUT_OF_SYNC, unknown_sqlstate);
+    return 1;
+  }
+  b->pipeline_pending--;
+  /* Each reply starts at sequence number 1, after the command packet. */
+  net->pkt_nr= net->compress_pkt_nr= 1;
+  return mysql_read_query_result(mysql);
+}
+
+/*
+  The part of mysql_close() that talks to the server and so may block. The
+  rest, freeing memory, is done by mysql_close() after this has run.
+*/
+static void
+mysql_close_slow_part(MYSQL *mysql)
+{
+  if (mysql->net.vio)
+  {
+    free_old_query(mysql);
+    mysql->status= MYSQL_STATUS_READY;
+    mysql->reconnect= 0;
+    simple_command(mysql, COM_QUIT, (uchar *) 0, 0, 1);
+    end_server(mysql);
+  }
+}
+
+MYSQL_ASYNC_CALLS(MK_ASYNC_CALL)
+MYSQL_ASYNC_VOID_CALLS(MK_ASYNC_VOID_CALL)
+
+MYSQL_ASYNC_STATUS
+mysql_close_start(MYSQL *sock)
+{
+  MYSQL_ASYNC_STATUS status;
+
+  if (!(status= mysql_close_slow_part_start(sock)))
+    mysql_close(sock);
+  return status;
+}
+
+MYSQL_ASYNC_STATUS
+mysql_close_cont(MYSQL *sock, MYSQL_ASYNC_STATUS ready_status)
+{
+  struct mysql_async_context *b= sock->async_context;
+  MYSQL_ASYNC_STATUS status;
+
+  /* Close only when it is a suspended close that completes here. */
+  if (!b || !b->suspended ||
+      b->active_call != MYSQL_ASYNC_ID_mysql_close_slow_part)
+  {
+    set_mysql_error(sock, CR_COMMANDS_OUT_OF_SYNC, unknown_sqlstate);
+    return 0;
+  }
+  if (!(status= mysql_close_slow_part_cont(sock, ready_status)))
+    mysql_close(sock);
+  return status;
+}
+
+/*
+  With the multi-threaded scheduler (mysql_async_sched.h), a suspended call
+  may be resumed in a different thread than the one it yielded in. errno
+  and my_errno are thread-local, so they are carried across the yield
+  here. Also, as __errno_location() is declared const, the compiler may
+  compute &errno once and reuse it after a yield, ie. write the errno of
+  the previous thread. So functions that yield access errno only through
+  async_errno, which calls a function the compiler cannot look into.
+*/
+static int * __attribute__((noipa))
+my_async_errno_location(void)
+{
+  return &errno;
+}
+
+#define async_errno (*my_async_errno_location())
+
+static void __attribute__((noipa))
+my_async_yield(struct mysql_async_context *b)
+{
+  int saved_errno= errno;
+  int saved_my_errno= my_errno;
+  unsigned long long suspend_ns= 0;
+
+  if (b->stats)
+  {
+    suspend_ns= my_async_now_ns();
+    b->stats->running_ns+= suspend_ns - b->run_start_ns;
+    if (b->ret_status & MYSQL_WAIT_READ)
+      b->stats->yields_read++;
+    if (b->ret_status & MYSQL_WAIT_WRITE)
+      b->stats->yields_write++;
+    if (b->ret_status & MYSQL_WAIT_TIMEOUT)
+      b->stats->yields_timeout++;
+  }
+  my_context_yield(&b->async_context);
+  /* Stats may have been enabled meanwhile; then suspend_ns is 0. */
+  if (b->stats && suspend_ns)
+    b->stats->suspended_ns+= b->run_start_ns - suspend_ns;
+  async_errno= saved_errno;
+  my_errno= saved_my_errno;
+}
+
+/*
+  Start the send queue afresh for a new socket: whatever was queued or
+  failed on the previous connection of the handle does not apply to it.
+*/
+static void
+my_send_queue_reset(mysql_async_context *b, int fd)
+{
+  b->sq_fd= fd;
+  b->sq_len= b->sq_sent= 0;
+  b->sq_error= 0;
+}
+
+/*
+  Suspend until the operation queued on the io_uring completes.
+
+  Returns its result, or -1 with errno set: ETIMEDOUT if the timeout
+  expired, EAGAIN if the kernel found the socket not ready (then the
+  caller falls back to the non-blocking syscall and readiness).
+*/
+static ssize_t
+my_wait_completion_async(mysql_async_context *b, int fd, uint timeout)
+{
+  int res;
+
+  MY_TRACE4(mysql_async, wait, b, fd, MYSQL_WAIT_COMPLETION, timeout);
+  do
+  {
+    b->ret_status= MYSQL_WAIT_COMPLETION;
+    my_async_yield(b);
+  } while (b->uring_op->state == MY_URING_OP_PENDING);
+  MY_TRACE3(mysql_async, wait_done, b, fd, b->ret_status);
+  b->uring_op->state= MY_URING_OP_IDLE;
+  if ((res= b->uring_op->res) >= 0)
+    return res;
+  /* A linked timeout cancels the operation. */
+  async_errno= res == -ECANCELED ? ETIMEDOUT : -res;
+  return -1;
+}
+
+int
+my_connect_async(mysql_async_context *b, my_socket fd, const struct sockaddr *name, uint namelen, uint timeout)
+{
+  int res;
+  int flags;
+  socklen_t s_err_size;
+  /* Set fd non-blocking. */
+  /*
+    Note: This can be done similarly on Windows, except we need ioctlsocket()
+    to set non-blocking and a second conenct() call to get result of connect attempt.
+  */
+  flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  my_send_queue_reset(b, fd);
+
+  if (b->uring &&
+      !my_uring_connect(b->uring, b->uring_op, fd, name, namelen, timeout))
+  {
+    res= my_wait_completion_async(b, fd, timeout);
+    /* Older kernels leave an in-progress connect to us. */
+    if (res == 0 || (async_errno != EAGAIN && async_errno != EINPROGRESS &&
+                     async_errno != EALREADY))
+    {
+      MY_TRACE3(mysql_async, connect, b, fd, res);
+      return res;
+    }
+  }
+
+  /*
+    Start to connect asynchronously.
+    If this will block, we suspend the call and return control to the
+    application context. The application will then resume us when the socket
+    polls ready for write, indicating that the connection attempt completed.
+  */
+  res= connect(fd, name, namelen);
+  if (res < 0)
+  {
+    if (async_errno != EINPROGRESS && async_errno != EALREADY)
+      return res;
+    b->timeout_value= timeout;
+    b->ret_status= MYSQL_WAIT_WRITE | MYSQL_WAIT_TIMEOUT;
+    MY_TRACE4(mysql_async, wait, b, fd, b->ret_status, timeout);
+    my_async_yield(b);
+    MY_TRACE3(mysql_async, wait_done, b, fd, b->ret_status);
+    if (b->ret_status & MYSQL_WAIT_TIMEOUT)
+    {
+      async_errno= ETIMEDOUT;
+      MY_TRACE3(mysql_async, connect, b, fd, -1);
+      return -1;
+    }
+
+    s_err_size= sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*) &res, &s_err_size) != 0)
+      return -1;
+    if (res)
+    {
+      async_errno= res;
+      MY_TRACE3(mysql_async, connect, b, fd, -1);
+      return -1;
+    }
+  }
+  MY_TRACE3(mysql_async, connect, b, fd, res);
+  return res;
+}
+
+/*
+  Suspend waiting for the socket fd to become ready for wait_for
+  (MYSQL_WAIT_READ or MYSQL_WAIT_WRITE), for at most timeout seconds (0
+  means no timeout).
+
+  Returns 0 when ready, -1 with errno set to ETIMEDOUT on timeout.
+*/
+static int
+my_wait_async(mysql_async_context *b, int fd, MYSQL_ASYNC_STATUS wait_for,
+              uint timeout)
+{
+  b->ret_status= wait_for;
+  if (timeout)
+  {
+    b->ret_status|= MYSQL_WAIT_TIMEOUT;
+    b->timeout_value= timeout;
+  }
+  MY_TRACE4(mysql_async, wait, b, fd, b->ret_status, timeout);
+  my_async_yield(b);
+  MY_TRACE3(mysql_async, wait_done, b, fd, b->ret_status);
+  if (!(b->ret_status & wait_for) && (b->ret_status & MYSQL_WAIT_TIMEOUT))
+  {
+    async_errno= ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+/* Set up msg to receive into buf and then the read-ahead buffer. */
+static void
+my_recv_ahead_msg(mysql_async_context *b, struct msghdr *msg,
+                  struct iovec *iov, unsigned char *buf, size_t size)
+{
+  iov[0].iov_base= buf;
+  iov[0].iov_len= size;
+  iov[1].iov_base= b->ra_buf;
+  iov[1].iov_len= b->ra_size;
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_iov= iov;
+  msg->msg_iovlen= 2;
+}
+
+/* Keep what was received beyond the size bytes of buf for later reads. */
+static ssize_t
+my_recv_ahead_done(mysql_async_context *b, ssize_t res, size_t size)
+{
+  if (res > (ssize_t)size)
+  {
+    b->ra_pos= 0;
+    b->ra_end= res - size;
+    res= size;
+  }
+  return res;
+}
+
+/*
+  Receive into buf and, if enabled, the read-ahead buffer with one
+  recvmsg(), so that a single syscall can pick up many small packets.
+*/
+static ssize_t
+my_recv_ahead(mysql_async_context *b, int fd, unsigned char *buf, size_t size)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+
+  my_recv_ahead_msg(b, &msg, iov, buf, size);
+  return my_recv_ahead_done(b, recvmsg(fd, &msg, MSG_DONTWAIT), size);
+}
+
+/*
+  Receive through the io_uring, suspending until data arrives. Returns -1
+  with errno EAGAIN if the ring is full.
+*/
+static ssize_t
+my_recv_uring(mysql_async_context *b, int fd, unsigned char *buf, size_t size,
+              uint timeout)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  int err;
+
+  if (b->ra_size)
+  {
+    my_recv_ahead_msg(b, &msg, iov, buf, size);
+    err= my_uring_recvmsg(b->uring, b->uring_op, fd, &msg, 0, timeout);
+  }
+  else
+    err= my_uring_recv(b->uring, b->uring_op, fd, buf, size, 0, timeout);
+  if (err)
+  {
+    async_errno= EAGAIN;
+    return -1;
+  }
+  /* msg and iov stay valid, as this frame stays while suspended. */
+  return my_recv_ahead_done(b, my_wait_completion_async(b, fd, timeout), size);
+}
+
+/*
+  Note that the Vio layer must call this, rather than a blocking recv(),
+  also outside of async calls whenever b->ra_pos < b->ra_end, since a call
+  run directly from foo_start() may find its packet in the read-ahead
+  buffer (see mysql_async_packet_ready()). Such a read never yields.
+*/
+ssize_t
+my_recv_async(mysql_async_context *b, int fd, unsigned char *buf, size_t size,
+              uint timeout)
+{
+  ssize_t res;
+
+  b->recv_stats.reads++;
+  /* The reply will not come before the request is sent. */
+  if (b->sq_len && my_flush_async(b))
+    return -1;
+  if (b->ra_pos < b->ra_end)
+  {
+    /* Serve from what an earlier call read ahead, no syscall needed. */
+    res= MY_MIN(size, b->ra_end - b->ra_pos);
+    memcpy(buf, b->ra_buf + b->ra_pos, res);
+    b->ra_pos+= res;
+    b->recv_stats.buffered_reads++;
+    MY_TRACE4(mysql_async, recv, b, fd, size, res);
+    return res;
+  }
+
+  for (;;)
+  {
+    if (b->uring)
+      res= my_recv_uring(b, fd, buf, size, timeout);
+    else
+    {
+      b->recv_stats.syscalls++;
+      if (b->ra_size)
+        res= my_recv_ahead(b, fd, buf, size);
+      else
+        res= recv(fd, buf, size, MSG_DONTWAIT);
+    }
+    if (res > 0)
+      b->recv_stats.bytes+= res + (b->ra_end - b->ra_pos);
+    if (res >= 0 || async_errno != EAGAIN)
+    {
+      MY_TRACE4(mysql_async, recv, b, fd, size, res);
+      return res;
+    }
+    b->recv_stats.eagain++;
+    if (my_wait_async(b, fd, MYSQL_WAIT_READ, timeout))
+      return -1;
+  }
+}
+
+/*
+  Send the send queue, followed by size bytes of buf (size may be 0), with
+  as few syscalls as possible. No MSG_MORE: the last of it may be the end
+  of a request, and nothing would uncork the socket before we wait for
+  the reply.
+
+  Returns the number of bytes of buf sent, which can be less than size
+  (but the queue is always completely sent first), or -1 on error.
+*/
+static ssize_t
+my_send_gather(mysql_async_context *b, const unsigned char *buf, size_t size)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t res;
+  size_t queued;
+
+  for (;;)
+  {
+    queued= b->sq_len - b->sq_sent;
+    iov[0].iov_base= b->sq_buf + b->sq_sent;
+    iov[0].iov_len= queued;
+    iov[1].iov_base= (void *)buf;
+    iov[1].iov_len= size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov= queued ? iov : iov + 1;
+    msg.msg_iovlen= queued ? 2 : 1;
+    if (b->uring &&
+        !my_uring_sendmsg(b->uring, b->uring_op, b->sq_fd, &msg,
+                          MSG_NOSIGNAL, b->sq_timeout))
+      res= my_wait_completion_async(b, b->sq_fd, b->sq_timeout);
+    else
+    {
+      b->send_stats.syscalls++;
+      res= sendmsg(b->sq_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    if (res < 0)
+    {
+      if (async_errno != EAGAIN)
+        return -1;
+      b->send_stats.eagain++;
+      /* Resume where we left off once the socket is writable again. */
+      if (my_wait_async(b, b->sq_fd, MYSQL_WAIT_WRITE, b->sq_timeout))
+        return -1;
+      continue;
+    }
+    b->send_stats.bytes+= res;
+    if ((size_t)res >= queued)
+    {
+      b->sq_len= b->sq_sent= 0;
+      return res - queued;
+    }
+    b->sq_sent+= res;
+  }
+}
+
+/*
+  Send everything in the send queue. Called before waiting for a reply and
+  at the end of each async call.
+
+  Returns 0 if ok, -1 on error (also remembered in sq_error).
+*/
+static int
+my_flush_async(struct mysql_async_context *b)
+{
+  if (b->sq_error)
+  {
+    async_errno= b->sq_error;
+    return -1;
+  }
+  if (b->sq_sent == b->sq_len)
+    return 0;
+  b->send_stats.flushes++;
+  if (my_send_gather(b, NULL, 0) < 0)
+  {
+    b->sq_error= async_errno;
+    b->sq_len= b->sq_sent= 0;
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t
+my_send_async(mysql_async_context *b, int fd, unsigned char *buf, size_t size,
+              uint timeout)
+{
+  ssize_t res;
+
+  b->send_stats.sends++;
+  if (b->sq_size)
+  {
+    /* Eg. reconnected without my_connect_async(). */
+    if (fd != b->sq_fd)
+      my_send_queue_reset(b, fd);
+    if (b->sq_error)
+    {
+      async_errno= b->sq_error;
+      return -1;
+    }
+    b->sq_timeout= timeout;
+    if (size <= b->sq_size - b->sq_len)
+    {
+      /* Cork: just queue it, it is sent before we wait for a reply. */
+      memcpy(b->sq_buf + b->sq_len, buf, size);
+      b->sq_len+= size;
+      b->send_stats.queued++;
+      MY_TRACE4(mysql_async, send, b, fd, size, size);
+      return size;
+    }
+    /*
+      Does not fit; send the queue and this buffer together, in one
+      sendmsg().
+    */
+    res= my_send_gather(b, buf, size);
+    MY_TRACE4(mysql_async, send, b, fd, size, res);
+    return res;
+  }
+
+  for (;;)
+  {
+    if (b->uring && !my_uring_send(b->uring, b->uring_op, fd, buf, size, 0,
+                                   timeout))
+      res= my_wait_completion_async(b, fd, timeout);
+    else
+    {
+      b->send_stats.syscalls++;
+      res= send(fd, buf, size, MSG_DONTWAIT);
+    }
+    if (res >= 0)
+      b->send_stats.bytes+= res;
+    if (res >= 0 || async_errno != EAGAIN)
+    {
+      MY_TRACE4(mysql_async, send, b, fd, size, res);
+      return res;
+    }
+    b->send_stats.eagain++;
+    if (my_wait_async(b, fd, MYSQL_WAIT_WRITE, timeout))
+      return -1;
+  }
+}
+
+/*
+  With decompression enabled (mysql_async_set_decompress()), the NET layer
+  reads the compressed protocol through this, rather than reading whole
+  compressed packets and uncompressing them. It returns the plain stream,
+  decompressing the compressed bytes as my_recv_async() delivers them. So
+  a call reading rows gets the first ones as soon as they are decoded,
+  without waiting for the rest of the compressed packet, and no buffer
+  for a whole packet is needed.
+*/
+ssize_t
+my_recv_decompress_async(mysql_async_context *b, int fd, unsigned char *buf,
+                         size_t size, uint timeout)
+{
+  ssize_t res;
+  size_t used;
+
+  for (;;)
+  {
+    res= my_decompress_run(b->dc, b->dc_in + b->dc_in_pos,
+                           b->dc_in_end - b->dc_in_pos, &used, buf, size);
+    b->dc_in_pos+= used;
+    if (res != 0)
+      return res;
+    res= my_recv_async(b, fd, b->dc_in, DECOMPRESS_IN_SIZE, timeout);
+    if (res <= 0)
+      return res;
+    b->dc_in_pos= 0;
+    b->dc_in_end= res;
+  }
+}
+
+#ifdef HAVE_OPENSSL
+/*
+  TLS on the async path. The TLS library does its own socket I/O, on the
+  socket made non-blocking by my_connect_async(), so these bypass the
+  read-ahead buffer, send queue and io_uring above. When an operation
+  needs the socket to become readable or writable (SSL_ERROR_WANT_READ /
+  SSL_ERROR_WANT_WRITE, which both can happen during a renegotiation), we
+  suspend with MYSQL_WAIT_READ / MYSQL_WAIT_WRITE and retry when resumed.
+
+  The functions return the result of the SSL call, as the Vio layer
+  expects; on timeout they return -1 with errno ETIMEDOUT.
+*/
+
+/*
+  Wait for the socket as the failed TLS operation asks. Returns 0 to retry
+  the operation, -1 if it failed for another reason or timed out.
+*/
+static int
+my_ssl_wait_async(mysql_async_context *b, SSL *ssl, int res, uint timeout)
+{
+  switch (SSL_get_error(ssl, res))
+  {
+  case SSL_ERROR_WANT_READ:
+    b->recv_stats.eagain++;
+    return my_wait_async(b, SSL_get_fd(ssl), MYSQL_WAIT_READ, timeout);
+  case SSL_ERROR_WANT_WRITE:
+    b->send_stats.eagain++;
+    return my_wait_async(b, SSL_get_fd(ssl), MYSQL_WAIT_WRITE, timeout);
+  default:
+    return -1;
+  }
+}
+
+int
+my_ssl_connect_async(mysql_async_context *b, SSL *ssl, uint timeout)
+{
+  int res;
+
+  while ((res= SSL_connect(ssl)) <= 0 &&
+         !my_ssl_wait_async(b, ssl, res, timeout))
+    ;
+  MY_TRACE3(mysql_async, connect, b, SSL_get_fd(ssl), res);
+  return res;
+}
+
+/*
+  Records already received and decrypted are returned by SSL_read() without
+  touching the socket, so such reads never yield (and can be done also
+  from a call run directly, see mysql_async_packet_ready()).
+*/
+int
+my_ssl_read_async(mysql_async_context *b, SSL *ssl, void *buf, int size,
+                  uint timeout)
+{
+  int res;
+
+  b->recv_stats.reads++;
+  if (SSL_pending(ssl) > 0)
+    b->recv_stats.buffered_reads++;
+  else
+    b->recv_stats.syscalls++;
+  while ((res= SSL_read(ssl, buf, size)) <= 0 &&
+         !my_ssl_wait_async(b, ssl, res, timeout))
+    b->recv_stats.syscalls++;
+  if (res > 0)
+    b->recv_stats.bytes+= res;
+  MY_TRACE4(mysql_async, recv, b, SSL_get_fd(ssl), size, res);
+  return res;
+}
+
+/*
+  SSL_write() must be retried with the same arguments after a WANT_READ /
+  WANT_WRITE, which the loop does. It only returns when all of buf has been
+  written (SSL_MODE_ENABLE_PARTIAL_WRITE is not set).
+*/
+int
+my_ssl_write_async(mysql_async_context *b, SSL *ssl, const void *buf,
+                   int size, uint timeout)
+{
+  int res;
+
+  b->send_stats.sends++;
+  do
+    b->send_stats.syscalls++;
+  while ((res= SSL_write(ssl, buf, size)) <= 0 &&
+         !my_ssl_wait_async(b, ssl, res, timeout));
+  if (res > 0)
+    b->send_stats.bytes+= res;
+  MY_TRACE4(mysql_async, send, b, SSL_get_fd(ssl), size, res);
+  return res;
+}
+#endif  /* HAVE_OPENSSL */
+
+uint
+mysql_get_timeout_value(const MYSQL *mysql)
+{
+  if (mysql->async_context && mysql->async_context->suspended)
+    return mysql->async_context->timeout_value;
+  else
+    return 0;
+}
+
+int
+mysql_async_set_read_ahead(MYSQL *mysql, size_t size)
+{
+  struct mysql_async_context *b;
+  unsigned char *buf= NULL;
+
+  if (!(b= mysql_get_async_context(mysql)))
+    return 1;
+  if (b->ra_pos < b->ra_end || b->suspended)
+    return 1;
+  if (size && !(buf= (unsigned char *)my_malloc(size, MYF(0))))
+  {
+    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+    return 1;
+  }
+  my_free(b->ra_buf, MYF(MY_ALLOW_ZERO_PTR));
+  b->ra_buf= buf;
+  b->ra_size= size;
+  b->ra_pos= b->ra_end= 0;
+  return 0;
+}
+
+int
+mysql_async_set_uring(MYSQL *mysql, struct my_uring *ring, void *owner)
+{
+  struct mysql_async_context *b;
+
+  if (!(b= mysql_get_async_context(mysql)) || b->suspended)
+    return 1;
+  if (ring && !b->uring_op && !(b->uring_op= my_uring_op_new(owner)))
+  {
+    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+    return 1;
+  }
+  if (b->uring_op)
+    b->uring_op->owner= owner;
+  b->uring= ring;
+  return 0;
+}
+
+int
+mysql_async_set_decompress(MYSQL *mysql, int codec)
+{
+  struct mysql_async_context *b;
+  struct my_decompress *dc= NULL;
+  unsigned char *buf= NULL;
+
+  if (!(b= mysql_get_async_context(mysql)) || b->suspended)
+    return 1;
+  if (b->dc && (b->dc_in_pos < b->dc_in_end || !my_decompress_idle(b->dc)))
+    return 1;
+  if (codec != MY_DECOMPRESS_NONE)
+  {
+    if (!(dc= my_decompress_new((enum my_decompress_codec)codec)))
+    {
+      if (errno == ENOMEM)
+        set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+      return 1;
+    }
+    if (!(buf= (unsigned char *)my_malloc(DECOMPRESS_IN_SIZE, MYF(0))))
+    {
+      my_decompress_free(dc);
+      set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+      return 1;
+    }
+  }
+  if (b->dc)
+    my_decompress_free(b->dc);
+  my_free(b->dc_in, MYF(MY_ALLOW_ZERO_PTR));
+  b->dc= dc;
+  b->dc_in= buf;
+  b->dc_in_pos= b->dc_in_end= 0;
+  return 0;
+}
+
+void
+mysql_async_get_recv_stats(const MYSQL *mysql,
+                           struct mysql_async_recv_stats *stats)
+{
+  if (mysql->async_context)
+    *stats= mysql->async_context->recv_stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
+int
+mysql_async_set_send_queue(MYSQL *mysql, size_t size)
+{
+  struct mysql_async_context *b;
+  unsigned char *buf= NULL;
+
+  if (!(b= mysql_get_async_context(mysql)))
+    return 1;
+  if (b->sq_len || b->suspended)
+    return 1;
+  if (size && !(buf= (unsigned char *)my_malloc(size, MYF(0))))
+  {
+    set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+    return 1;
+  }
+  my_free(b->sq_buf, MYF(MY_ALLOW_ZERO_PTR));
+  b->sq_buf= buf;
+  b->sq_size= size;
+  b->sq_len= b->sq_sent= 0;
+  b->sq_error= 0;
+  return 0;
+}
+
+void
+mysql_async_get_send_stats(const MYSQL *mysql,
+                           struct mysql_async_send_stats *stats)
+{
+  if (mysql->async_context)
+    *stats= mysql->async_context->send_stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+}
+
+uint
+mysql_pipeline_pending(const MYSQL *mysql)
+{
+  return mysql->async_context ? mysql->async_context->pipeline_pending : 0;
+}
+
+int
+mysql_async_enable_stats(MYSQL *mysql, my_bool enable)
+{
+  struct mysql_async_context *b;
+
+  if (!(b= mysql_get_async_context(mysql)))
+    return 1;
+  if (enable && !b->stats)
+  {
+    if (!(b->stats= (struct mysql_async_stats *)
+          my_malloc(sizeof(*b->stats), MYF(MY_ZEROFILL))))
+    {
+      set_mysql_error(mysql, CR_OUT_OF_MEMORY, unknown_sqlstate);
+      return 1;
+    }
+    /* A call suspended now has no start times; do not account it. */
+    b->call_id= MYSQL_ASYNC_CALL_COUNT;
+  }
+  else if (!enable && b->stats)
+  {
+    my_async_stats_flush(b);
+    my_free(b->stats, MYF(0));
+    b->stats= NULL;
+  }
+  return 0;
+}
+
+int
+mysql_async_get_stats(const MYSQL *mysql, struct mysql_async_stats *stats)
+{
+  if (!mysql)
+  {
+    pthread_mutex_lock(&global_stats_lock);
+    *stats= global_stats;
+    pthread_mutex_unlock(&global_stats_lock);
+    return 0;
+  }
+  if (!mysql->async_context || !mysql->async_context->stats)
+    return 1;
+  my_async_stats_fill_io(mysql->async_context);
+  *stats= *mysql->async_context->stats;
+  return 0;
+}
+
+const char *
+mysql_async_call_name(unsigned int call_id)
+{
+  static const char *names[]= {
+#define MYSQL_ASYNC_CALL_NAME(call) #call,
+    MYSQL_ASYNC_CALL_LIST(MYSQL_ASYNC_CALL_NAME)
+#undef MYSQL_ASYNC_CALL_NAME
+  };
+
+  return call_id < MYSQL_ASYNC_CALL_COUNT ? names[call_id] : "unknown";
+}
+
+unsigned long long
+mysql_async_histogram_percentile(const struct mysql_async_histogram *h,
+                                 double percentile)
+{
+  unsigned long long target, seen= 0;
+  double rank;
+  uint i, msb;
+
+  if (!h->count)
+    return 0;
+  /* The rank (1-based) of the sample to report: ceil(p * count), >= 1. */
+  rank= h->count * percentile / 100.0;
+  target= (unsigned long long)rank;
+  if (target < rank || !target)
+    target++;
+  if (target >= h->count)
+    return h->max_ns;
+  for (i= 0; i < MYSQL_ASYNC_HIST_BUCKETS; i++)
+  {
+    seen+= h->buckets[i];
+    if (seen >= target)
+      break;
+  }
+  /* Report the upper end of the bucket, but never more than the max. */
+  if (i < 4)
+    return i;
+  msb= i / 4 + 1;
+  return MY_MIN(((unsigned long long)(4 + i % 4 + 1) << (msb - 2)) - 1,
+                h->max_ns);
+}
+
+void
+mysql_async_set_stack_mode(enum mysql_async_stack_mode mode)
+{
+  stack_mode= mode;
+}
+
+void
+mysql_async_get_stack_info(unsigned int call_id,
+                           struct mysql_async_stack_info *info)
+{
+  if (call_id >= MYSQL_ASYNC_CALL_COUNT)
+  {
+    memset(info, 0, sizeof(*info));
+    return;
+  }
+  info->samples= __atomic_load_n(&stack_samples[call_id], __ATOMIC_RELAXED);
+  info->max_used= __atomic_load_n(&stack_max_used[call_id], __ATOMIC_RELAXED);
+  if (stack_mode == MYSQL_ASYNC_STACK_ADAPTIVE &&
+      my_async_stack_learned(call_id))
+    info->size= my_async_stack_adapted(call_id);
+  else
+    info->size= STACK_SIZE;
 }
@@ -0,0 +1,496 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  MySQL non-blocking client library API.
+
+  This is meant to become part of mysql.h; for now include it after
+  mysql.h.
+
+  For a call R=foo(...) that may block, foo_start(&R, ...) starts the call.
+  If it returns 0, the call completed and R is set to the result. Otherwise
+  the return value says what the call is waiting for (MYSQL_WAIT_READ etc.),
+  and once that condition is fulfilled, the application must call
+  foo_cont(&R, ..., ready_status) with the condition(s) that occured, until
+  it returns 0.
+*/
+
+#ifndef MYSQL_ASYNC_H
+#define MYSQL_ASYNC_H
+
+#include <stddef.h>
+
+typedef enum {
+  MYSQL_WAIT_READ= 1,
+  MYSQL_WAIT_WRITE= 2,
+  MYSQL_WAIT_TIMEOUT= 4,
+  /*
+    Waiting for an operation submitted to the io_uring set with
+    mysql_async_set_uring() to complete; see there.
+  */
+  MYSQL_WAIT_COMPLETION= 8
+} MYSQL_ASYNC_STATUS;
+
+/* The socket to poll for the MYSQL_WAIT_READ/MYSQL_WAIT_WRITE conditions. */
+extern int mysql_get_socket_fd(const MYSQL *mysql);
+/*
+  When waiting for MYSQL_WAIT_TIMEOUT, the number of seconds after which the
+  call should be resumed with MYSQL_WAIT_TIMEOUT.
+*/
+extern unsigned int mysql_get_timeout_value(const MYSQL *mysql);
+
+/*
+  Enable a per-connection read-ahead buffer of size bytes (0 disables it).
+  Every receive on the socket then asks for as much as fits in the buffer,
+  and later reads are served from memory, so a burst of small packets (eg.
+  rows) costs one recv syscall rather than one per packet.
+
+  Cannot be changed while a call is suspended or data is buffered.
+  Returns 0 if ok, non-zero on error.
+*/
+extern int mysql_async_set_read_ahead(MYSQL *mysql, size_t size);
+
+struct mysql_async_recv_stats {
+  /* Number of reads done by the library on the socket. */
+  unsigned long long reads;
+  /* Reads served from the read-ahead buffer without a syscall. */
+  unsigned long long buffered_reads;
+  /* recv syscalls done, including those that returned EAGAIN. */
+  unsigned long long syscalls;
+  /* Syscalls that returned EAGAIN and made the call wait. */
+  unsigned long long eagain;
+  /* Total bytes received from the socket. */
+  unsigned long long bytes;
+};
+
+/*
+  Get the receive counters of a connection, for the non-blocking calls.
+  The syscalls saved by read-ahead are buffered_reads.
+*/
+extern void mysql_async_get_recv_stats(const MYSQL *mysql,
+                                       struct mysql_async_recv_stats *stats);
+
+/*
+  Enable a per-connection send queue of size bytes (0 disables it).
+  Outgoing packets that fit are then only copied to the queue (corked),
+  and the queue is sent in one sendmsg() when the connection is about to
+  wait for a reply, or when the call completes. So pipelined statements
+  are coalesced into few TCP segments and syscalls. Packets that do not
+  fit are sent together with the queue, in one sendmsg().
+
+  Cannot be changed while a call is suspended or data is queued.
+  Returns 0 if ok, non-zero on error.
+*/
+extern int mysql_async_set_send_queue(MYSQL *mysql, size_t size);
+
+struct my_uring;
+
+/*
+  Do the socket I/O of async calls through an io_uring (see my_uring.h),
+  or with ring == NULL go back to non-blocking syscalls. Rather than
+  trying the syscall and waiting for readiness when it would block, each
+  recv, send or connect is then queued to the ring, and the call suspends
+  with MYSQL_WAIT_COMPLETION. The application submits the ring (batching
+  the operations of all connections into one syscall), and when
+  my_uring_reap() reports the completion of an operation, calls foo_cont()
+  with MYSQL_WAIT_COMPLETION for the connection given by the operation's
+  owner, which is set to `owner` here. Timeouts are handled in the ring,
+  so MYSQL_WAIT_COMPLETION is never combined with MYSQL_WAIT_TIMEOUT.
+
+  If the ring is full, an operation falls back to the readiness path, so
+  the application must still handle MYSQL_WAIT_READ/WRITE as well.
+  mysql_async_loop.h does all this, see mysql_async_loop_use_uring().
+
+  Cannot be changed while a call is suspended.
+  Returns 0 if ok, non-zero on error.
+*/
+extern int mysql_async_set_uring(MYSQL *mysql, struct my_uring *ring,
+                                 void *owner);
+
+/*
+  Decompress the compressed protocol incrementally, as the bytes arrive,
+  with codec MY_DECOMPRESS_ZLIB or MY_DECOMPRESS_ZSTD (see my_decompress.h;
+  MY_DECOMPRESS_NONE disables it). For connections that use compression.
+  Rows are then returned from a large compressed packet as soon as they
+  are decoded, rather than after all of the packet has been received and
+  uncompressed in one go, and no buffer for the whole packet is needed.
+
+  As the decompression keeps state between reads, the connection must then
+  only be used with the non-blocking calls.
+
+  Cannot be changed while a call is suspended or data is buffered.
+  Returns 0 if ok, non-zero on error (eg. zstd not built in).
+*/
+extern int mysql_async_set_decompress(MYSQL *mysql, int codec);
+
+struct mysql_async_send_stats {
+  /* Number of writes done by the library on the socket. */
+  unsigned long long sends;
+  /* Writes only copied to the send queue. */
+  unsigned long long queued;
+  /* Times the queue was flushed before a read or at the end of a call. */
+  unsigned long long flushes;
+  /* send syscalls done, including those that returned EAGAIN. */
+  unsigned long long syscalls;
+  /* Syscalls that returned EAGAIN and made the call wait. */
+  unsigned long long eagain;
+  /* Total bytes sent on the socket. */
+  unsigned long long bytes;
+};
+
+/* Get the send counters of a connection, for the non-blocking calls. */
+extern void mysql_async_get_send_stats(const MYSQL *mysql,
+                                       struct mysql_async_send_stats *stats);
+
+/* All the calls with a non-blocking version, for the per-call stats. */
+#define MYSQL_ASYNC_CALL_LIST(X)                                        \
+  X(mysql_real_connect)                                                 \
+  X(mysql_query)                                                        \
+  X(mysql_real_query)                                                   \
+  X(mysql_send_query)                                                   \
+  X(mysql_read_query_result)                                            \
+  X(mysql_store_result)                                                 \
+  X(mysql_fetch_row)                                                    \
+  X(mysql_fetch_rows)                                                   \
+  X(mysql_free_result)                                                  \
+  X(mysql_next_result)                                                  \
+  X(mysql_ping)                                                         \
+  X(mysql_select_db)                                                    \
+  X(mysql_change_user)                                                  \
+  X(mysql_commit)                                                       \
+  X(mysql_rollback)                                                     \
+  X(mysql_autocommit)                                                   \
+  X(mysql_pipeline_send)                                                \
+  X(mysql_pipeline_read_result)                                         \
+  X(mysql_stmt_prepare)                                                 \
+  X(mysql_stmt_execute)                                                 \
+  X(mysql_stmt_store_result)                                            \
+  X(mysql_stmt_fetch)                                                   \
+  X(mysql_stmt_send_long_data)                                          \
+  X(mysql_close_slow_part)
+
+enum mysql_async_call_id {
+#define MYSQL_ASYNC_CALL_ID(call) MYSQL_ASYNC_ID_##call,
+  MYSQL_ASYNC_CALL_LIST(MYSQL_ASYNC_CALL_ID)
+#undef MYSQL_ASYNC_CALL_ID
+  MYSQL_ASYNC_CALL_COUNT
+};
+
+/*
+  Latency histogram, in nanoseconds. Values below 4 have a bucket each,
+  above that each power of two is split in 4 buckets (so at most 25%
+  relative error), up to 2^MYSQL_ASYNC_HIST_MAX_BITS ns (~18 minutes);
+  the last bucket also takes everything longer.
+*/
+#define MYSQL_ASYNC_HIST_MAX_BITS 40
+#define MYSQL_ASYNC_HIST_BUCKETS (MYSQL_ASYNC_HIST_MAX_BITS * 4)
+
+struct mysql_async_histogram {
+  unsigned long long count;
+  unsigned long long sum_ns;
+  unsigned long long max_ns;
+  unsigned int buckets[MYSQL_ASYNC_HIST_BUCKETS];
+};
+
+struct mysql_async_stats {
+  /* Calls run in an async context, and calls completed directly. */
+  unsigned long long spawns;
+  unsigned long long direct;
+  /* Times a call suspended, by the condition waited for. */
+  unsigned long long yields_read;
+  unsigned long long yields_write;
+  unsigned long long yields_timeout;
+  /*
+    Time spent in async calls suspended (waiting for the application to
+    call foo_cont()), and running.
+  */
+  unsigned long long suspended_ns;
+  unsigned long long running_ns;
+  struct mysql_async_recv_stats recv;
+  struct mysql_async_send_stats send;
+  /*
+    Latency of the calls that ran in an async context, from foo_start()
+    to completion, indexed by MYSQL_ASYNC_ID_xxx.
+  */
+  struct mysql_async_histogram latency[MYSQL_ASYNC_CALL_COUNT];
+};
+
+/*
+  Enable or disable the stats of a connection. They are off by default,
+  and then cost one pointer test per call and yield. Disabling, or closing
+  the connection, adds its stats to the global aggregate. The counters of
+  mysql_async_get_recv_stats() and mysql_async_get_send_stats() are kept
+  either way; only the part not yet added is added again.
+
+  Returns 0 if ok, non-zero on error.
+*/
+extern int mysql_async_enable_stats(MYSQL *mysql, my_bool enable);
+
+/*
+  Get the stats of a connection, or with mysql == NULL the global
+  aggregate of all connections closed or disabled so far (this one is
+  thread safe). Returns non-zero if stats are not enabled for mysql.
+*/
+extern int mysql_async_get_stats(const MYSQL *mysql,
+                                 struct mysql_async_stats *stats);
+
+/* Name of a MYSQL_ASYNC_ID_xxx, eg. "mysql_real_query". */
+extern const char *mysql_async_call_name(unsigned int call_id);
+
+/*
+  Approximate percentile (0-100) of a histogram: an upper bound of the
+  bucket it falls in, capped to the maximum.
+*/
+extern unsigned long long
+mysql_async_histogram_percentile(const struct mysql_async_histogram *h,
+                                 double percentile);
+
+/*
+  Add a value to a histogram, and add one histogram to another; for
+  applications keeping their own histograms, eg. of end-to-end latency.
+*/
+extern void mysql_async_histogram_add(struct mysql_async_histogram *h,
+                                      unsigned long long ns);
+extern void
+mysql_async_histogram_merge(struct mysql_async_histogram *to,
+                            const struct mysql_async_histogram *from);
+
+enum mysql_async_stack_mode {
+  /* Every async call gets a stack of the default size (64 kB). */
+  MYSQL_ASYNC_STACK_FIXED,
+  /*
+    As fixed, but paint each stack before the call and record the deepest
+    stack use for each kind of call. This costs a memset() of the stack
+    per call.
+  */
+  MYSQL_ASYNC_STACK_MEASURE,
+  /*
+    Measure calls of each kind with a stack of the default size until
+    MYSQL_ASYNC_STACK_LEARN of them have finished, then give that kind of
+    call a stack of twice the deepest use seen (at least
+    MYSQL_ASYNC_STACK_MIN bytes).
+    One call in MYSQL_ASYNC_STACK_RESAMPLE is still measured with the
+    default size, so the size grows if deeper use shows up later.
+
+    A call that goes deeper than anything seen before twice over hits
+    the guard page below the stack and crashes, so use this only once the
+    workload has exercised the code paths it will use (eg. connects with
+    the authentication plugins and SSL settings in use).
+  */
+  MYSQL_ASYNC_STACK_ADAPTIVE
+};
+
+#define MYSQL_ASYNC_STACK_LEARN 100
+#define MYSQL_ASYNC_STACK_RESAMPLE 256
+#define MYSQL_ASYNC_STACK_MIN 8192
+
+/* Set the stack mode for all connections; call before starting any calls. */
+extern void mysql_async_set_stack_mode(enum mysql_async_stack_mode mode);
+
+struct mysql_async_stack_info {
+  /* Number of calls measured, and the deepest stack use seen. */
+  unsigned long long samples;
+  size_t max_used;
+  /* The stack size currently requested for this kind of call. */
+  size_t size;
+};
+
+/* Stack measurements for a call_id (MYSQL_ASYNC_ID_xxx), for all threads. */
+extern void mysql_async_get_stack_info(unsigned int call_id,
+                                       struct mysql_async_stack_info *info);
+
+/*
+  The non-blocking versions of all client calls that may block on the
+  network. The _start() functions take the same arguments as the blocking
+  call, the _cont() functions only the first one (the MYSQL, MYSQL_RES or
+  MYSQL_STMT). While a call is suspended, starting another on the same
+  connection fails with CR_COMMANDS_OUT_OF_SYNC.
+*/
+extern MYSQL_ASYNC_STATUS
+mysql_real_connect_start(MYSQL **ret, MYSQL *mysql, const char *host,
+                         const char *user, const char *passwd, const char *db,
+                         unsigned int port, const char *unix_socket,
+                         unsigned long client_flags);
+extern MYSQL_ASYNC_STATUS
+mysql_real_connect_cont(MYSQL **ret, MYSQL *mysql,
+                        MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_query_start(int *ret, MYSQL *mysql, const char *stmt_str);
+extern MYSQL_ASYNC_STATUS
+mysql_query_cont(int *ret, MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_real_query_start(int *ret, MYSQL *mysql, const char *stmt_str,
+                       unsigned long length);
+extern MYSQL_ASYNC_STATUS
+mysql_real_query_cont(int *ret, MYSQL *mysql,
+                      MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_send_query_start(int *ret, MYSQL *mysql, const char *stmt_str,
+                       unsigned long length);
+extern MYSQL_ASYNC_STATUS
+mysql_send_query_cont(int *ret, MYSQL *mysql,
+                      MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_read_query_result_start(my_bool *ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_read_query_result_cont(my_bool *ret, MYSQL *mysql,
+                             MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_store_result_start(MYSQL_RES **ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_store_result_cont(MYSQL_RES **ret, MYSQL *mysql,
+                        MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_fetch_row_start(MYSQL_ROW *ret, MYSQL_RES *result);
+extern MYSQL_ASYNC_STATUS
+mysql_fetch_row_cont(MYSQL_ROW *ret, MYSQL_RES *result,
+                     MYSQL_ASYNC_STATUS ready_status);
+/*
+  Fetch a batch of up to max_rows rows into rows[], setting *ret to the
+  number fetched. This only waits when no row at all has been received
+  yet, and then returns all rows that arrived with it, so an application
+  streaming a large result gets one round trip per network read rather
+  than per row. *ret == 0 means no more rows (or an error, check
+  mysql_errno()).
+
+  For mysql_use_result() results, the rows stay valid until the next
+  mysql_fetch_rows_start() or mysql_free_result_start() on the connection.
+  Mixing with mysql_fetch_row_start() on the same result is allowed.
+*/
+extern MYSQL_ASYNC_STATUS
+mysql_fetch_rows_start(unsigned int *ret, MYSQL_RES *result, MYSQL_ROW *rows,
+                       unsigned int max_rows);
+extern MYSQL_ASYNC_STATUS
+mysql_fetch_rows_cont(unsigned int *ret, MYSQL_RES *result,
+                      MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_free_result_start(MYSQL_RES *result);
+extern MYSQL_ASYNC_STATUS
+mysql_free_result_cont(MYSQL_RES *result, MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_next_result_start(int *ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_next_result_cont(int *ret, MYSQL *mysql,
+                       MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_ping_start(int *ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_ping_cont(int *ret, MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_select_db_start(int *ret, MYSQL *mysql, const char *db);
+extern MYSQL_ASYNC_STATUS
+mysql_select_db_cont(int *ret, MYSQL *mysql,
+                     MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_change_user_start(my_bool *ret, MYSQL *mysql, const char *user,
+                        const char *passwd, const char *db);
+extern MYSQL_ASYNC_STATUS
+mysql_change_user_cont(my_bool *ret, MYSQL *mysql,
+                       MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_commit_start(my_bool *ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_commit_cont(my_bool *ret, MYSQL *mysql,
+                  MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_rollback_start(my_bool *ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_rollback_cont(my_bool *ret, MYSQL *mysql,
+                    MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_autocommit_start(my_bool *ret, MYSQL *mysql, my_bool auto_mode);
+extern MYSQL_ASYNC_STATUS
+mysql_autocommit_cont(my_bool *ret, MYSQL *mysql,
+                      MYSQL_ASYNC_STATUS ready_status);
+/*
+  Pipelining: mysql_pipeline_send_start() sends a query without waiting
+  for its result, and may be called several times in a row to have many
+  queries in flight on one connection. The results are then read in
+  order, each with mysql_pipeline_read_result_start() (which works like
+  mysql_read_query_result()) followed by mysql_store_result_start() or
+  mysql_use_result() as usual when the query returns rows. The result of
+  one query must be consumed before reading the next. Until all results
+  are read, other calls that send a command (mysql_query_start() etc.)
+  fail with CR_COMMANDS_OUT_OF_SYNC.
+
+  With a send queue (mysql_async_set_send_queue()), the queries are sent
+  together when the first result is read.
+
+  An error in one query does not affect the following ones.
+*/
+extern MYSQL_ASYNC_STATUS
+mysql_pipeline_send_start(int *ret, MYSQL *mysql, const char *stmt_str,
+                          unsigned long length);
+extern MYSQL_ASYNC_STATUS
+mysql_pipeline_send_cont(int *ret, MYSQL *mysql,
+                         MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_pipeline_read_result_start(my_bool *ret, MYSQL *mysql);
+extern MYSQL_ASYNC_STATUS
+mysql_pipeline_read_result_cont(my_bool *ret, MYSQL *mysql,
+                                MYSQL_ASYNC_STATUS ready_status);
+/* Number of pipelined queries whose results are not read yet. */
+extern unsigned int mysql_pipeline_pending(const MYSQL *mysql);
+/*
+  Prepared statements. The MYSQL_STMT is created with mysql_stmt_init() and
+  its parameters and results bound with mysql_stmt_bind_param() and
+  mysql_stmt_bind_result() as usual, which do not block. The buffers bound
+  must stay valid until the call completes; mysql_stmt_fetch_start() runs
+  directly, without a context switch, while the rows buffered by
+  mysql_stmt_store_result_start() last.
+*/
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_prepare_start(int *ret, MYSQL_STMT *stmt, const char *stmt_str,
+                         unsigned long length);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_prepare_cont(int *ret, MYSQL_STMT *stmt,
+                        MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_execute_start(int *ret, MYSQL_STMT *stmt);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_execute_cont(int *ret, MYSQL_STMT *stmt,
+                        MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_store_result_start(int *ret, MYSQL_STMT *stmt);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_store_result_cont(int *ret, MYSQL_STMT *stmt,
+                             MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_fetch_start(int *ret, MYSQL_STMT *stmt);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_fetch_cont(int *ret, MYSQL_STMT *stmt,
+                      MYSQL_ASYNC_STATUS ready_status);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_send_long_data_start(my_bool *ret, MYSQL_STMT *stmt,
+                                unsigned int param_number, const char *data,
+                                unsigned long length);
+extern MYSQL_ASYNC_STATUS
+mysql_stmt_send_long_data_cont(my_bool *ret, MYSQL_STMT *stmt,
+                               MYSQL_ASYNC_STATUS ready_status);
+/*
+  Closes the connection like mysql_close(), sending COM_QUIT without
+  blocking. The handle is freed when the call completes. If another call
+  is suspended, it is abandoned and the handle freed at once.
+*/
+extern MYSQL_ASYNC_STATUS
+mysql_close_start(MYSQL *sock);
+extern MYSQL_ASYNC_STATUS
+mysql_close_cont(MYSQL *sock, MYSQL_ASYNC_STATUS ready_status);
+
+#endif  /* MYSQL_ASYNC_H */
@@ -0,0 +1,508 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  C++20 coroutine front end for the non-blocking API.
+
+  Each call of a mysql_async::connection returns an awaitable, which runs
+  foo_start(), and when that has to wait, suspends the C++ coroutine and
+  hands the wait over to a reactor. When the reactor sees the condition,
+  it calls foo_cont(), and resumes the coroutine once the call completes.
+  Meanwhile the libmysql call itself stays suspended in its my_context, as
+  with the C API. The result of co_await is the return value of the
+  blocking call:
+
+    mysql_async::detached
+    run(mysql_async::connection &conn)
+    {
+      if (!co_await conn.connect("localhost", "test", "testpass", "test",
+                                 0, NULL, 0))
+        co_return;                      // Error, see mysql_error()
+      if (co_await conn.query("SELECT * FROM t1"))
+        co_return;
+      MYSQL_RES *res= co_await conn.store_result();
+      while (MYSQL_ROW row= co_await conn.fetch_row(res))
+        ...
+      co_await conn.free_result(res);
+      co_await conn.close();
+    }
+
+    MYSQL mysql;
+    mysql_init(&mysql);
+    mysql_async::loop_reactor reactor(loop, &mysql);
+    mysql_async::connection conn(&mysql, reactor);
+    run(conn);
+    mysql_async_loop_run(loop);
+
+  The awaitable lives in the coroutine frame while suspended, and the
+  reactor only stores a pointer to it, so an await allocates nothing. The
+  coroutine frame itself is allocated once per coroutine, as usual.
+
+  A reactor waits for the conditions of one connection; loop_reactor does
+  it with a mysql_async_loop. Other event loops are plugged in by
+  implementing mysql_async::reactor. The reactor must call the waiter's
+  ready() from the thread the connection is used in, and ready() may
+  re-enter the reactor's wait() (to wait for the next condition, or from
+  the resumed coroutine starting its next call).
+
+  If the reactor fails to wait, co_await throws std::system_error; the
+  libmysql call is then still suspended, and the connection can only be
+  closed with mysql_close().
+*/
+
+#ifndef MYSQL_ASYNC_CORO_HPP
+#define MYSQL_ASYNC_CORO_HPP
+
+#include <cerrno>
+#include <coroutine>
+#include <exception>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "mysql_async.h"
+#include "mysql_async_loop.h"
+}
+
+namespace mysql_async {
+
+/* A call waiting for a condition on its connection. */
+class waiter
+{
+public:
+  explicit waiter(MYSQL *mysql) : mysql_(mysql) {}
+  MYSQL *mysql() const { return mysql_; }
+  /* Called by the reactor with the condition(s) that occured. */
+  virtual void ready(MYSQL_ASYNC_STATUS ready_status)= 0;
+
+protected:
+  ~waiter()= default;
+
+private:
+  MYSQL *mysql_;
+};
+
+class reactor
+{
+public:
+  /*
+    Call w->ready() once status (from foo_start()/foo_cont()) occurs on
+    the socket of w->mysql(), or the timeout from mysql_get_timeout_value()
+    expires. Returns 0 if ok, -1 on error with errno set.
+  */
+  virtual int wait(waiter *w, MYSQL_ASYNC_STATUS status)= 0;
+  /*
+    Called when mysql_close() completed, right after the socket was
+    closed, to drop any registration of it before the descriptor can be
+    reused.
+  */
+  virtual void remove(MYSQL *) {}
+
+protected:
+  ~reactor()= default;
+};
+
+/* A reactor for one connection, driven by a mysql_async_loop. */
+class loop_reactor final : public reactor
+{
+public:
+  loop_reactor(struct mysql_async_loop *loop, MYSQL *mysql) : loop_(loop)
+  {
+    mysql_async_loop_conn_init(&conn_, mysql, cont, nullptr);
+  }
+  /* Must not be waiting. */
+  ~loop_reactor() { mysql_async_loop_remove(loop_, &conn_); }
+  loop_reactor(const loop_reactor &)= delete;
+  loop_reactor &operator=(const loop_reactor &)= delete;
+
+  int wait(waiter *w, MYSQL_ASYNC_STATUS status) override
+  {
+    conn_.data= w;
+    return mysql_async_loop_wait(loop_, &conn_, status);
+  }
+
+  void remove(MYSQL *) override { mysql_async_loop_remove(loop_, &conn_); }
+
+private:
+  static MYSQL_ASYNC_STATUS
+  cont(MYSQL *, MYSQL_ASYNC_STATUS ready_status, void *data)
+  {
+    /* Any further wait was registered from inside ready(). */
+    static_cast<waiter *>(data)->ready(ready_status);
+    return (MYSQL_ASYNC_STATUS)0;
+  }
+
+  struct mysql_async_loop *loop_;
+  struct mysql_async_loop_conn conn_;
+};
+
+/*
+  The awaitable for one call. start(&result) runs foo_start(), and
+  cont(&result, ready_status) runs foo_cont(); both return the status.
+*/
+template <class Ret, class Start, class Cont>
+class call final : public waiter
+{
+  using result_type= std::conditional_t<std::is_void_v<Ret>, char, Ret>;
+
+public:
+  call(reactor &r, MYSQL *mysql, Start start, Cont cont)
+    : waiter(mysql), reactor_(r), start_(std::move(start)),
+      cont_(std::move(cont))
+  {
+  }
+
+  bool await_ready()
+  {
+    status_= start_(&result_);
+    return !status_;
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle)
+  {
+    handle_= handle;
+    if (reactor_.wait(this, status_))
+    {
+      /* Do not suspend; await_resume() reports the error. */
+      error_= errno;
+      return false;
+    }
+    return true;
+  }
+
+  Ret await_resume()
+  {
+    if (error_)
+      throw std::system_error(error_, std::generic_category(),
+                              "mysql_async reactor wait");
+    if constexpr (!std::is_void_v<Ret>)
+      return result_;
+  }
+
+  void ready(MYSQL_ASYNC_STATUS ready_status) override
+  {
+    status_= cont_(&result_, ready_status);
+    if (status_ && reactor_.wait(this, status_))
+      error_= errno;
+    else if (status_)
+      return;                           // Still waiting
+    handle_.resume();
+  }
+
+private:
+  reactor &reactor_;
+  Start start_;
+  Cont cont_;
+  MYSQL_ASYNC_STATUS status_= (MYSQL_ASYNC_STATUS)0;
+  int error_= 0;
+  result_type result_{};
+  std::coroutine_handle<> handle_;
+};
+
+/*
+  A non-blocking connection: a MYSQL handle (not owned) and the reactor
+  that waits for it. The arguments of each call are as for the blocking
+  call; pointer arguments must stay valid until the co_await completes.
+*/
+class connection
+{
+public:
+  connection(MYSQL *mysql, reactor &r) : mysql_(mysql), reactor_(r) {}
+  MYSQL *handle() const { return mysql_; }
+
+private:
+  /* Defined first, for the deduced return types below. */
+  template <class Ret, class Start, class Cont>
+  call<Ret, Start, Cont>
+  make(Start start, Cont cont)
+  {
+    return call<Ret, Start, Cont>(reactor_, mysql_, std::move(start),
+                                  std::move(cont));
+  }
+
+  /* For calls that take only the MYSQL. */
+  template <class Ret>
+  auto
+  simple(MYSQL_ASYNC_STATUS (*start)(Ret *, MYSQL *),
+         MYSQL_ASYNC_STATUS (*cont)(Ret *, MYSQL *, MYSQL_ASYNC_STATUS))
+  {
+    return make<Ret>(
+      [=, m= mysql_](Ret *ret) { return start(ret, m); },
+      [=, m= mysql_](Ret *ret, MYSQL_ASYNC_STATUS s)
+      { return cont(ret, m, s); });
+  }
+
+public:
+  auto
+  connect(const char *host, const char *user, const char *passwd,
+          const char *db, unsigned int port, const char *unix_socket,
+          unsigned long client_flags)
+  {
+    return make<MYSQL *>(
+      [=, m= mysql_](MYSQL **ret)
+      {
+        return mysql_real_connect_start(ret, m, host, user, passwd, db, port,
+                                        unix_socket, client_flags);
+      },
+      [m= mysql_](MYSQL **ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_real_connect_cont(ret, m, s); });
+  }
+
+  /* mysql_real_query(). */
+  auto
+  query(std::string_view stmt)
+  {
+    return make<int>(
+      [=, m= mysql_](int *ret)
+      { return mysql_real_query_start(ret, m, stmt.data(), stmt.size()); },
+      [m= mysql_](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_real_query_cont(ret, m, s); });
+  }
+
+  auto
+  send_query(std::string_view stmt)
+  {
+    return make<int>(
+      [=, m= mysql_](int *ret)
+      { return mysql_send_query_start(ret, m, stmt.data(), stmt.size()); },
+      [m= mysql_](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_send_query_cont(ret, m, s); });
+  }
+
+  auto
+  read_query_result()
+  {
+    return simple<my_bool>(mysql_read_query_result_start,
+                           mysql_read_query_result_cont);
+  }
+
+  auto
+  store_result()
+  {
+    return simple<MYSQL_RES *>(mysql_store_result_start,
+                               mysql_store_result_cont);
+  }
+
+  auto
+  fetch_row(MYSQL_RES *result)
+  {
+    return make<MYSQL_ROW>(
+      [result](MYSQL_ROW *ret) { return mysql_fetch_row_start(ret, result); },
+      [result](MYSQL_ROW *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_fetch_row_cont(ret, result, s); });
+  }
+
+  /* mysql_fetch_rows_start(), returning the number of rows fetched. */
+  auto
+  fetch_rows(MYSQL_RES *result, MYSQL_ROW *rows, unsigned int max_rows)
+  {
+    return make<unsigned int>(
+      [=](unsigned int *ret)
+      { return mysql_fetch_rows_start(ret, result, rows, max_rows); },
+      [result](unsigned int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_fetch_rows_cont(ret, result, s); });
+  }
+
+  auto
+  free_result(MYSQL_RES *result)
+  {
+    return make<void>(
+      [result](char *) { return mysql_free_result_start(result); },
+      [result](char *, MYSQL_ASYNC_STATUS s)
+      { return mysql_free_result_cont(result, s); });
+  }
+
+  auto
+  next_result()
+  {
+    return simple<int>(mysql_next_result_start, mysql_next_result_cont);
+  }
+
+  auto
+  ping()
+  {
+    return simple<int>(mysql_ping_start, mysql_ping_cont);
+  }
+
+  auto
+  select_db(const char *db)
+  {
+    return make<int>(
+      [=, m= mysql_](int *ret) { return mysql_select_db_start(ret, m, db); },
+      [m= mysql_](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_select_db_cont(ret, m, s); });
+  }
+
+  auto
+  change_user(const char *user, const char *passwd, const char *db)
+  {
+    return make<my_bool>(
+      [=, m= mysql_](my_bool *ret)
+      { return mysql_change_user_start(ret, m, user, passwd, db); },
+      [m= mysql_](my_bool *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_change_user_cont(ret, m, s); });
+  }
+
+  auto
+  commit()
+  {
+    return simple<my_bool>(mysql_commit_start, mysql_commit_cont);
+  }
+
+  auto
+  rollback()
+  {
+    return simple<my_bool>(mysql_rollback_start, mysql_rollback_cont);
+  }
+
+  auto
+  autocommit(my_bool auto_mode)
+  {
+    return make<my_bool>(
+      [=, m= mysql_](my_bool *ret)
+      { return mysql_autocommit_start(ret, m, auto_mode); },
+      [m= mysql_](my_bool *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_autocommit_cont(ret, m, s); });
+  }
+
+  auto
+  pipeline_send(std::string_view stmt)
+  {
+    return make<int>(
+      [=, m= mysql_](int *ret)
+      {
+        return mysql_pipeline_send_start(ret, m, stmt.data(), stmt.size());
+      },
+      [m= mysql_](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_pipeline_send_cont(ret, m, s); });
+  }
+
+  auto
+  pipeline_read_result()
+  {
+    return simple<my_bool>(mysql_pipeline_read_result_start,
+                           mysql_pipeline_read_result_cont);
+  }
+
+  /*
+    Prepared statements, on a MYSQL_STMT from mysql_stmt_init() of this
+    connection.
+  */
+  auto
+  stmt_prepare(MYSQL_STMT *stmt, std::string_view query)
+  {
+    return make<int>(
+      [=](int *ret)
+      {
+        return mysql_stmt_prepare_start(ret, stmt, query.data(),
+                                        query.size());
+      },
+      [stmt](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_stmt_prepare_cont(ret, stmt, s); });
+  }
+
+  auto
+  stmt_execute(MYSQL_STMT *stmt)
+  {
+    return make<int>(
+      [stmt](int *ret) { return mysql_stmt_execute_start(ret, stmt); },
+      [stmt](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_stmt_execute_cont(ret, stmt, s); });
+  }
+
+  auto
+  stmt_store_result(MYSQL_STMT *stmt)
+  {
+    return make<int>(
+      [stmt](int *ret) { return mysql_stmt_store_result_start(ret, stmt); },
+      [stmt](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_stmt_store_result_cont(ret, stmt, s); });
+  }
+
+  auto
+  stmt_fetch(MYSQL_STMT *stmt)
+  {
+    return make<int>(
+      [stmt](int *ret) { return mysql_stmt_fetch_start(ret, stmt); },
+      [stmt](int *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_stmt_fetch_cont(ret, stmt, s); });
+  }
+
+  auto
+  stmt_send_long_data(MYSQL_STMT *stmt, unsigned int param_number,
+                      const char *data, unsigned long length)
+  {
+    return make<my_bool>(
+      [=](my_bool *ret)
+      {
+        return mysql_stmt_send_long_data_start(ret, stmt, param_number, data,
+                                               length);
+      },
+      [stmt](my_bool *ret, MYSQL_ASYNC_STATUS s)
+      { return mysql_stmt_send_long_data_cont(ret, stmt, s); });
+  }
+
+  /* mysql_close(), which frees the MYSQL handle when it completes. */
+  auto
+  close()
+  {
+    return make<void>(
+      [m= mysql_, r= &reactor_](char *)
+      {
+        MYSQL_ASYNC_STATUS status= mysql_close_start(m);
+        if (!status)
+          r->remove(m);
+        return status;
+      },
+      [m= mysql_, r= &reactor_](char *, MYSQL_ASYNC_STATUS s)
+      {
+        MYSQL_ASYNC_STATUS status= mysql_close_cont(m, s);
+        if (!status)
+          r->remove(m);
+        return status;
+      });
+  }
+
+private:
+  MYSQL *mysql_;
+  reactor &reactor_;
+};
+
+/*
+  Coroutine return type for running a coroutine on its own: it starts at
+  once, and its frame is freed when it finishes. Exceptions escaping it
+  terminate the program.
+*/
+struct detached
+{
+  struct promise_type
+  {
+    detached get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+}  // namespace mysql_async
+
+#endif  /* MYSQL_ASYNC_CORO_HPP */
@@ -0,0 +1,429 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the epoll-based event loop for non-blocking MySQL
+  connections.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <mysql/mysql.h>
+
+#include "mysql_async.h"
+#include "mysql_async_loop.h"
+#include "my_uring.h"
+
+struct mysql_async_loop {
+  int epfd;
+  /* Number of connections waiting for something. */
+  unsigned int active;
+  /* Set when registering a socket failed, reported from run_once(). */
+  int error;
+  /* Time in milliseconds, updated once per run_once(). */
+  unsigned long long now;
+  /* Timeouts of connections waiting with MYSQL_WAIT_TIMEOUT. */
+  struct my_timer_wheel wheel;
+  /*
+    Connections passed to mysql_async_loop_wait() that were already ready,
+    to be dispatched from the next mysql_async_loop_run_once().
+  */
+  struct mysql_async_loop_conn *ready;
+  /*
+    The io_uring of connections using it, in the epoll set with a NULL
+    data pointer; created on first use. ring_errno is set if that failed.
+  */
+  struct my_uring *ring;
+  int ring_errno;
+  /*
+    The batch from the last epoll_wait(): events[event_next, event_end)
+    are not yet dispatched. A connection removed while the batch is being
+    dispatched has its entries there changed to REMOVED_EVENT.
+  */
+  int event_next, event_end;
+  struct epoll_event events[MYSQL_ASYNC_LOOP_MAX_EVENTS];
+};
+
+/* Marks a connection that is not in the ready list. */
+#define NOT_READY ((struct mysql_async_loop_conn *)1)
+/* An event of a connection removed after epoll_wait() returned it. */
+#define REMOVED_EVENT ((void *)1)
+
+
+static unsigned long long
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+struct mysql_async_loop *
+mysql_async_loop_new(void)
+{
+  struct mysql_async_loop *loop;
+
+  if (!(loop= calloc(1, sizeof(*loop))))
+    return NULL;
+  if ((loop->epfd= epoll_create1(EPOLL_CLOEXEC)) < 0)
+  {
+    free(loop);
+    return NULL;
+  }
+  loop->now= now_ms();
+  my_timer_wheel_init(&loop->wheel, loop->now);
+  return loop;
+}
+
+
+void
+mysql_async_loop_free(struct mysql_async_loop *loop)
+{
+  if (loop->ring)
+    my_uring_free(loop->ring);
+  close(loop->epfd);
+  free(loop);
+}
+
+
+void
+mysql_async_loop_conn_init(struct mysql_async_loop_conn *conn, MYSQL *mysql,
+                           mysql_async_loop_cont_func cont, void *data)
+{
+  conn->mysql= mysql;
+  conn->cont= cont;
+  conn->data= data;
+  conn->fd= -1;
+  conn->status= 0;
+  conn->pending= 0;
+  my_timer_init(&conn->timer);
+  conn->next_ready= NOT_READY;
+}
+
+
+/*
+  Start waiting for status on a connection.
+  Returns the conditions that are already known to be fulfilled.
+*/
+static int
+loop_arm(struct mysql_async_loop *loop, struct mysql_async_loop_conn *conn,
+         MYSQL_ASYNC_STATUS status)
+{
+  int fd;
+
+  if (status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE))
+  {
+    fd= mysql_get_socket_fd(conn->mysql);
+    if (fd != conn->fd)
+    {
+      struct epoll_event ev;
+
+      /* First wait, or the library reconnected on a new socket. */
+      if (conn->fd >= 0)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+      ev.events= EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr= conn;
+      conn->pending= 0;
+      conn->fd= -1;
+      if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev))
+        loop->error= errno;
+      else
+        conn->fd= fd;
+    }
+  }
+  if (status & MYSQL_WAIT_TIMEOUT)
+    my_timer_add(&loop->wheel, &conn->timer, loop->now +
+                 (unsigned long long)mysql_get_timeout_value(conn->mysql) *
+                 1000);
+  conn->status= status;
+  loop->active++;
+  return conn->status & conn->pending;
+}
+
+
+static void
+loop_dispatch(struct mysql_async_loop *loop,
+              struct mysql_async_loop_conn *conn, int ready)
+{
+  MYSQL_ASYNC_STATUS status;
+
+  do
+  {
+    my_timer_cancel(&loop->wheel, &conn->timer);
+    conn->pending&= ~ready;
+    conn->status= 0;
+    loop->active--;
+    /*
+      Do not touch conn after the continuation returns 0, it may have been
+      removed and freed.
+    */
+    if (!(status= conn->cont(conn->mysql, (MYSQL_ASYNC_STATUS)ready,
+                             conn->data)))
+      return;
+    ready= loop_arm(loop, conn, status);
+  } while (ready);
+}
+
+
+int
+mysql_async_loop_wait(struct mysql_async_loop *loop,
+                      struct mysql_async_loop_conn *conn,
+                      MYSQL_ASYNC_STATUS status)
+{
+  loop->error= 0;
+  /* The loop may have been idle since the last run_once(). */
+  loop->now= now_ms();
+  if (loop_arm(loop, conn, status) && conn->next_ready == NOT_READY)
+  {
+    conn->next_ready= loop->ready;
+    loop->ready= conn;
+  }
+  if (loop->error)
+  {
+    errno= loop->error;
+    return -1;
+  }
+  return 0;
+}
+
+
+void
+mysql_async_loop_wait_ms(struct mysql_async_loop *loop,
+                         struct mysql_async_loop_conn *conn,
+                         unsigned int timeout_ms)
+{
+  loop->now= now_ms();
+  my_timer_add(&loop->wheel, &conn->timer, loop->now + timeout_ms);
+  conn->status= MYSQL_WAIT_TIMEOUT;
+  loop->active++;
+}
+
+
+void
+mysql_async_loop_remove(struct mysql_async_loop *loop,
+                        struct mysql_async_loop_conn *conn)
+{
+  struct mysql_async_loop_conn **p;
+
+  if (conn->next_ready != NOT_READY)
+  {
+    for (p= &loop->ready; *p; p= &(*p)->next_ready)
+    {
+      if (*p == conn)
+      {
+        *p= conn->next_ready;
+        break;
+      }
+    }
+    conn->next_ready= NOT_READY;
+  }
+  my_timer_cancel(&loop->wheel, &conn->timer);
+  if (conn->status)
+  {
+    conn->status= 0;
+    loop->active--;
+  }
+  if (conn->fd >= 0)
+  {
+    int i;
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->fd= -1;
+    /* conn may be freed when we return, so drop its undispatched events. */
+    for (i= loop->event_next; i < loop->event_end; i++)
+      if (loop->events[i].data.ptr == conn)
+        loop->events[i].data.ptr= REMOVED_EVENT;
+  }
+}
+
+
+int
+mysql_async_loop_use_uring(struct mysql_async_loop *loop,
+                           struct mysql_async_loop_conn *conn)
+{
+  struct epoll_event ev;
+
+  if (!loop->ring)
+  {
+    if (loop->ring_errno)
+    {
+      errno= loop->ring_errno;
+      return -1;
+    }
+    if (!(loop->ring= my_uring_new(MYSQL_ASYNC_LOOP_URING_ENTRIES)))
+    {
+      loop->ring_errno= errno;
+      return -1;
+    }
+    ev.events= EPOLLIN;
+    ev.data.ptr= NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, my_uring_fd(loop->ring), &ev))
+    {
+      loop->ring_errno= errno;
+      my_uring_free(loop->ring);
+      loop->ring= NULL;
+      errno= loop->ring_errno;
+      return -1;
+    }
+  }
+  if (mysql_async_set_uring(conn->mysql, loop->ring, conn))
+  {
+    errno= ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+
+static void
+loop_completion(struct my_uring_op *op, void *arg)
+{
+  struct mysql_async_loop_conn *conn=
+    (struct mysql_async_loop_conn *)op->owner;
+  int ready;
+
+  conn->pending|= MYSQL_WAIT_COMPLETION;
+  if ((ready= conn->status & conn->pending))
+    loop_dispatch((struct mysql_async_loop *)arg, conn, ready);
+}
+
+
+static void
+loop_timer_expired(struct my_timer *timer, void *arg)
+{
+  struct mysql_async_loop_conn *conn= (struct mysql_async_loop_conn *)
+    ((char *)timer - offsetof(struct mysql_async_loop_conn, timer));
+
+  loop_dispatch((struct mysql_async_loop *)arg, conn, MYSQL_WAIT_TIMEOUT);
+}
+
+
+int
+mysql_async_loop_run_once(struct mysql_async_loop *loop, int timeout_ms)
+{
+  int i, n, ready;
+  int count= 0;
+  struct mysql_async_loop_conn *conn;
+  unsigned long long next;
+
+  loop->error= 0;
+
+  /* One syscall for the I/O queued by all connections since last time. */
+  if (loop->ring && my_uring_queued(loop->ring) &&
+      my_uring_submit(loop->ring))
+    return -1;
+
+  if (loop->ready)
+    timeout_ms= 0;
+  else if ((next= my_timer_wheel_next(&loop->wheel)) != MY_TIMER_NEVER)
+  {
+    loop->now= now_ms();
+    if (next <= loop->now)
+      timeout_ms= 0;
+    else if (timeout_ms < 0 ||
+             next - loop->now < (unsigned long long)timeout_ms)
+      timeout_ms= (int)(next - loop->now);
+  }
+
+  n= epoll_wait(loop->epfd, loop->events, MYSQL_ASYNC_LOOP_MAX_EVENTS,
+                timeout_ms);
+  if (n < 0)
+  {
+    if (errno != EINTR)
+      return -1;
+    n= 0;
+  }
+  loop->now= now_ms();
+  loop->event_end= n;
+
+  /* Connections that were already ready when they started waiting. */
+  while ((conn= loop->ready))
+  {
+    loop->ready= conn->next_ready;
+    conn->next_ready= NOT_READY;
+    if ((ready= conn->status & conn->pending))
+    {
+      loop_dispatch(loop, conn, ready);
+      count++;
+    }
+  }
+
+  for (i= 0; i < n; i++)
+  {
+    uint32_t events= loop->events[i].events;
+    int bits= 0;
+
+    loop->event_next= i + 1;
+    conn= (struct mysql_async_loop_conn *)loop->events[i].data.ptr;
+    if (!conn)
+    {
+      count+= my_uring_reap(loop->ring, loop_completion, loop);
+      continue;
+    }
+    if (conn == REMOVED_EVENT)
+      continue;
+    /* On error or hangup, let the library find out when it retries. */
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+      bits|= MYSQL_WAIT_READ;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+      bits|= MYSQL_WAIT_WRITE;
+    conn->pending|= bits;
+    if ((ready= conn->status & conn->pending))
+    {
+      loop_dispatch(loop, conn, ready);
+      count++;
+    }
+  }
+  loop->event_next= loop->event_end= 0;
+
+  count+= my_timer_wheel_expire(&loop->wheel, loop->now, loop_timer_expired,
+                                loop);
+
+  if (loop->error)
+  {
+    errno= loop->error;
+    return -1;
+  }
+  return count;
+}
+
+
+int
+mysql_async_loop_run(struct mysql_async_loop *loop)
+{
+  while (loop->active)
+  {
+    if (mysql_async_loop_run_once(loop, -1) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+
+unsigned int
+mysql_async_loop_active(struct mysql_async_loop *loop)
+{
+  return loop->active;
+}
@@ -0,0 +1,170 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Event loop for driving many non-blocking MySQL connections from a single
+  thread, using Linux epoll.
+
+  The application embeds a struct mysql_async_loop_conn for each MYSQL
+  handle, and supplies a continuation function for it. Usage is like this:
+
+    static MYSQL_ASYNC_STATUS
+    my_cont(MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status, void *data)
+    {
+      struct my_state *s= data;
+      MYSQL_ASYNC_STATUS status;
+
+      status= mysql_real_query_cont(&s->err, mysql, ready_status);
+      if (status)
+        return status;                  // Still waiting
+      ...                               // Query done, start the next one
+      return mysql_real_query_start(&s->err, mysql, ...);
+    }
+
+    mysql_async_loop_conn_init(&s->conn, &s->mysql, my_cont, s);
+    status= mysql_real_query_start(&s->err, &s->mysql, ...);
+    if (status)
+      mysql_async_loop_wait(loop, &s->conn, status);
+    ...
+    mysql_async_loop_run(loop);
+
+  Whenever the condition(s) that a connection is waiting for occur, the
+  continuation is called with them. It returns the status of whatever
+  operation is then in progress on the connection, or 0 when there is none,
+  in which case the connection becomes idle until passed to
+  mysql_async_loop_wait() again.
+
+  Sockets are registered with epoll in edge-triggered mode once, and stay
+  registered while the connection is idle or waits for something else, so
+  in steady state there is no epoll_ctl() call per operation.
+
+  Timeouts (MYSQL_WAIT_TIMEOUT, with the time from mysql_get_timeout_value())
+  are kept in a timer wheel with millisecond ticks, so adding and cancelling
+  them is O(1) and finding the next one does not scan all connections.
+*/
+
+#ifndef MYSQL_ASYNC_LOOP_H
+#define MYSQL_ASYNC_LOOP_H
+
+#include "my_timer_wheel.h"
+
+/* Maximum number of events retrieved from the kernel with one epoll_wait(). */
+#define MYSQL_ASYNC_LOOP_MAX_EVENTS 256
+/* Size of the submission ring, for mysql_async_loop_use_uring(). */
+#define MYSQL_ASYNC_LOOP_URING_ENTRIES 1024
+
+typedef MYSQL_ASYNC_STATUS (*mysql_async_loop_cont_func)
+  (MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status, void *data);
+
+struct mysql_async_loop_conn {
+  MYSQL *mysql;
+  mysql_async_loop_cont_func cont;
+  void *data;
+
+  /* Private to the loop. */
+  /* The socket registered with epoll, or -1. */
+  int fd;
+  /* The conditions currently waited for, 0 when idle. */
+  int status;
+  /*
+    Readiness reported by epoll but not yet delivered to the connection,
+    because it was waiting for something else. Needed since with
+    edge-triggered epoll, the readiness will not be reported again.
+  */
+  int pending;
+  /* Pending in the loop's timer wheel when waiting for MYSQL_WAIT_TIMEOUT. */
+  struct my_timer timer;
+  struct mysql_async_loop_conn *next_ready;
+};
+
+struct mysql_async_loop;
+
+/* Returns NULL on error, with errno set. */
+extern struct mysql_async_loop *mysql_async_loop_new(void);
+extern void mysql_async_loop_free(struct mysql_async_loop *loop);
+
+extern void mysql_async_loop_conn_init(struct mysql_async_loop_conn *conn,
+                                       MYSQL *mysql,
+                                       mysql_async_loop_cont_func cont,
+                                       void *data);
+
+/*
+  Make an idle connection wait for status, as returned from some
+  foo_start() call. When the condition occurs, the continuation is called
+  from inside mysql_async_loop_run() or mysql_async_loop_run_once().
+
+  Returns 0 if ok, -1 on error (with errno set).
+*/
+extern int mysql_async_loop_wait(struct mysql_async_loop *loop,
+                                 struct mysql_async_loop_conn *conn,
+                                 MYSQL_ASYNC_STATUS status);
+
+/*
+  Make an idle connection wait for timeout_ms milliseconds only, as a plain
+  timer: the continuation is then called with MYSQL_WAIT_TIMEOUT. The
+  connection need not have a MYSQL handle (mysql may be NULL in
+  mysql_async_loop_conn_init()), in which case its continuation must
+  return 0. Cancel the timer with mysql_async_loop_remove().
+*/
+extern void mysql_async_loop_wait_ms(struct mysql_async_loop *loop,
+                                     struct mysql_async_loop_conn *conn,
+                                     unsigned int timeout_ms);
+
+/*
+  Make a connection (not in the middle of a call) do its socket I/O
+  through an io_uring shared by all connections of the loop, see
+  mysql_async_set_uring(). The operations queued by the continuations
+  are then submitted with one syscall per mysql_async_loop_run_once(),
+  and their completions are read from the ring without syscalls.
+
+  Returns -1 with errno set if the kernel has no usable io_uring (eg.
+  ENOSYS or EOPNOTSUPP) and the connection keeps using readiness, else 0.
+*/
+extern int mysql_async_loop_use_uring(struct mysql_async_loop *loop,
+                                      struct mysql_async_loop_conn *conn);
+
+/*
+  Unregister an idle connection, eg. before mysql_close(). This may also be
+  called from a continuation, for its own connection when the continuation
+  is going to return 0, or for any other; the connection may be freed
+  right after, even if it has events still to be dispatched in this round.
+*/
+extern void mysql_async_loop_remove(struct mysql_async_loop *loop,
+                                    struct mysql_async_loop_conn *conn);
+
+/*
+  Wait for at most timeout_ms milliseconds (-1 means no limit) for events,
+  and call the continuations of all connections that became ready.
+
+  Returns the number of continuations called, or -1 on error.
+*/
+extern int mysql_async_loop_run_once(struct mysql_async_loop *loop,
+                                     int timeout_ms);
+
+/*
+  Run until no connection is waiting for anything.
+
+  Returns 0 if ok, -1 on error.
+*/
+extern int mysql_async_loop_run(struct mysql_async_loop *loop);
+
+/* Number of connections currently waiting. */
+extern unsigned int mysql_async_loop_active(struct mysql_async_loop *loop);
+
+#endif  /* MYSQL_ASYNC_LOOP_H */
@@ -0,0 +1,512 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the async connection pool.
+
+  Each connection is in one of the states below. All network operations
+  (connect, ping, close) are run through the pool's loop connection, with
+  pool_cont() as continuation, dispatching on the state. Functions named
+  pool_*_done() handle the completion of an operation; they may start the
+  next one on the same connection, and return its wait status (or 0).
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+
+#include <mysql/mysql.h>
+
+#include "mysql_async.h"
+#include "mysql_async_pool.h"
+
+/*
+  Delay before opening connections again after a connect failed, doubled
+  on each failure in a row up to the maximum.
+*/
+#define POOL_RETRY_MIN_MS 100
+#define POOL_RETRY_MAX_MS 10000
+
+enum pool_conn_state {
+  POOL_CONNECTING,
+  /* Being pinged before being handed to waiter. */
+  POOL_CHECKING,
+  POOL_IDLE,
+  POOL_IN_USE,
+  POOL_CLOSING
+};
+
+/* An acquire waiting for a connection. */
+struct pool_waiter {
+  mysql_async_pool_func func;
+  void *data;
+  struct pool_waiter *next;
+};
+
+struct pool_conn {
+  MYSQL mysql;
+  struct mysql_async_loop_conn conn;
+  struct mysql_async_pool *pool;
+  enum pool_conn_state state;
+  /* Time (ms) the connection became idle. */
+  unsigned long long last_used;
+  /* Results of the connect and ping calls. */
+  MYSQL *ret_mysql;
+  int ret_int;
+  /* The acquire to hand the connection to after POOL_CHECKING. */
+  struct pool_waiter *waiter;
+  /* Next in the idle list. */
+  struct pool_conn *next;
+};
+
+struct mysql_async_pool {
+  struct mysql_async_loop *loop;
+  struct mysql_async_pool_config config;
+  /* Idle connections, most recently used first (warmest caches). */
+  struct pool_conn *idle;
+  /* Acquires waiting for a connection, oldest first. */
+  struct pool_waiter *wait_head, **wait_tail;
+  unsigned int waiting;
+  /* Timer for pool_fill() after a failed connect, and its next delay. */
+  struct mysql_async_loop_conn retry;
+  unsigned int retry_ms;
+  struct mysql_async_pool_stats stats;
+};
+
+
+static unsigned long long
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static struct pool_conn *
+pool_conn_of(MYSQL *mysql)
+{
+  return (struct pool_conn *)
+    ((char *)mysql - offsetof(struct pool_conn, mysql));
+}
+
+
+static void
+pool_wait(struct pool_conn *pc, MYSQL_ASYNC_STATUS status)
+{
+  /*
+    This can only fail if epoll cannot register the socket; the next
+    operation on the connection will then fail and close it.
+  */
+  if (status)
+    mysql_async_loop_wait(pc->pool->loop, &pc->conn, status);
+}
+
+
+static void
+waiter_push_head(struct mysql_async_pool *pool, struct pool_waiter *w)
+{
+  if (!(w->next= pool->wait_head))
+    pool->wait_tail= &w->next;
+  pool->wait_head= w;
+  pool->waiting++;
+}
+
+
+static void
+waiter_push_tail(struct mysql_async_pool *pool, struct pool_waiter *w)
+{
+  w->next= NULL;
+  *pool->wait_tail= w;
+  pool->wait_tail= &w->next;
+  pool->waiting++;
+}
+
+
+static struct pool_waiter *
+waiter_pop(struct mysql_async_pool *pool)
+{
+  struct pool_waiter *w;
+
+  if ((w= pool->wait_head))
+  {
+    if (!(pool->wait_head= w->next))
+      pool->wait_tail= &pool->wait_head;
+    pool->waiting--;
+  }
+  return w;
+}
+
+
+/* Hand over to the waiter and free it. */
+static void
+waiter_call(struct pool_waiter *w, MYSQL *mysql)
+{
+  mysql_async_pool_func func= w->func;
+  void *data= w->data;
+
+  free(w);
+  func(mysql, data);
+}
+
+
+/*
+  The socket is closed already, and so gone from epoll, but the loop
+  connection may still have the timer or ready list entry.
+*/
+static void
+pool_close_done(struct pool_conn *pc)
+{
+  mysql_async_loop_remove(pc->pool->loop, &pc->conn);
+  free(pc);
+}
+
+
+/* Close a connection with mysql_close_start(), and forget about it. */
+static MYSQL_ASYNC_STATUS
+pool_close(struct pool_conn *pc)
+{
+  MYSQL_ASYNC_STATUS status;
+
+  pc->state= POOL_CLOSING;
+  pc->pool->stats.total--;
+  if (!(status= mysql_close_start(&pc->mysql)))
+    pool_close_done(pc);
+  return status;
+}
+
+
+/*
+  A connection is ready for use: give it to the oldest waiter, or put it
+  in the idle list.
+*/
+static MYSQL_ASYNC_STATUS
+pool_conn_ready(struct pool_conn *pc)
+{
+  struct mysql_async_pool *pool= pc->pool;
+  struct pool_waiter *w;
+
+  if ((w= waiter_pop(pool)))
+  {
+    pc->state= POOL_IN_USE;
+    waiter_call(w, &pc->mysql);
+    return 0;
+  }
+  pc->state= POOL_IDLE;
+  pc->last_used= now_ms();
+  pc->next= pool->idle;
+  pool->idle= pc;
+  pool->stats.idle++;
+  return 0;
+}
+
+
+/* Arm the retry timer, unless it is pending already. */
+static void
+pool_retry(struct mysql_async_pool *pool)
+{
+  if (pool->retry.status)
+    return;
+  if (!pool->retry_ms)
+    pool->retry_ms= POOL_RETRY_MIN_MS;
+  mysql_async_loop_wait_ms(pool->loop, &pool->retry, pool->retry_ms);
+  if ((pool->retry_ms*= 2) > POOL_RETRY_MAX_MS)
+    pool->retry_ms= POOL_RETRY_MAX_MS;
+}
+
+
+static MYSQL_ASYNC_STATUS
+pool_connect_done(struct pool_conn *pc)
+{
+  struct mysql_async_pool *pool= pc->pool;
+  struct pool_waiter *w;
+
+  pool->stats.connecting--;
+  if (pc->ret_mysql)
+  {
+    pool->retry_ms= 0;
+    return pool_conn_ready(pc);
+  }
+
+  pool->stats.connect_failures++;
+  pool->stats.total--;
+  /* No network traffic to do for a failed connect. */
+  mysql_async_loop_remove(pool->loop, &pc->conn);
+  mysql_close(&pc->mysql);
+  free(pc);
+  /* Fail a waiter, unless another connect in progress can still serve it. */
+  if (pool->waiting > pool->stats.connecting && (w= waiter_pop(pool)))
+    waiter_call(w, NULL);
+  /* Try again later, or nothing would open connections till next acquire. */
+  pool_retry(pool);
+  return 0;
+}
+
+
+static MYSQL_ASYNC_STATUS pool_cont(MYSQL *mysql,
+                                    MYSQL_ASYNC_STATUS ready_status,
+                                    void *data);
+
+/* Start opening one more connection. Returns non-zero on out of memory. */
+static int
+pool_connect(struct mysql_async_pool *pool)
+{
+  struct pool_conn *pc;
+  MYSQL_ASYNC_STATUS status;
+  const struct mysql_async_pool_config *c= &pool->config;
+
+  if (!(pc= calloc(1, sizeof(*pc))))
+    return 1;
+  mysql_init(&pc->mysql);
+  mysql_async_loop_conn_init(&pc->conn, &pc->mysql, pool_cont, pc);
+  pc->pool= pool;
+  pc->state= POOL_CONNECTING;
+  pool->stats.total++;
+  pool->stats.connecting++;
+  pool->stats.connects++;
+  status= mysql_real_connect_start(&pc->ret_mysql, &pc->mysql, c->host,
+                                   c->user, c->passwd, c->db, c->port,
+                                   c->unix_socket, c->client_flags);
+  if (!status)
+    status= pool_connect_done(pc);
+  pool_wait(pc, status);
+  return 0;
+}
+
+
+/*
+  Open connections as needed to serve the waiters and keep min_idle idle
+  connections, within max_conns.
+*/
+static void
+pool_fill(struct mysql_async_pool *pool)
+{
+  unsigned long long failures= pool->stats.connect_failures;
+
+  while (pool->stats.total < pool->config.max_conns &&
+         (pool->stats.connecting < pool->waiting ||
+          pool->stats.idle + pool->stats.connecting < pool->config.min_idle))
+  {
+    /*
+      Do not spin on a connect that fails at once, eg. server not running;
+      the retry timer calls us again.
+    */
+    if (pool->stats.connect_failures != failures)
+      break;
+    if (pool_connect(pool))
+    {
+      pool_retry(pool);
+      break;
+    }
+  }
+}
+
+
+static MYSQL_ASYNC_STATUS
+pool_retry_cont(MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status, void *data)
+{
+  (void)mysql;
+  (void)ready_status;
+  pool_fill((struct mysql_async_pool *)data);
+  return 0;
+}
+
+
+static MYSQL_ASYNC_STATUS
+pool_check_done(struct pool_conn *pc)
+{
+  struct mysql_async_pool *pool= pc->pool;
+  struct pool_waiter *w= pc->waiter;
+  MYSQL_ASYNC_STATUS status;
+
+  pc->waiter= NULL;
+  if (!pc->ret_int)
+  {
+    pc->state= POOL_IN_USE;
+    waiter_call(w, &pc->mysql);
+    return 0;
+  }
+
+  /* Dead connection; replace it, letting the waiter keep its turn. */
+  pool->stats.check_failures++;
+  waiter_push_head(pool, w);
+  status= pool_close(pc);
+  pool_fill(pool);
+  return status;
+}
+
+
+static MYSQL_ASYNC_STATUS
+pool_cont(MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status, void *data)
+{
+  struct pool_conn *pc= (struct pool_conn *)data;
+  MYSQL_ASYNC_STATUS status;
+
+  switch (pc->state)
+  {
+  case POOL_CONNECTING:
+    if ((status= mysql_real_connect_cont(&pc->ret_mysql, mysql, ready_status)))
+      return status;
+    return pool_connect_done(pc);
+  case POOL_CHECKING:
+    if ((status= mysql_ping_cont(&pc->ret_int, mysql, ready_status)))
+      return status;
+    return pool_check_done(pc);
+  case POOL_CLOSING:
+    if ((status= mysql_close_cont(mysql, ready_status)))
+      return status;
+    pool_close_done(pc);
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+
+struct mysql_async_pool *
+mysql_async_pool_new(struct mysql_async_loop *loop,
+                     const struct mysql_async_pool_config *config)
+{
+  struct mysql_async_pool *pool;
+
+  if (!(pool= calloc(1, sizeof(*pool))))
+    return NULL;
+  pool->loop= loop;
+  pool->config= *config;
+  if (pool->config.max_conns < pool->config.min_idle)
+    pool->config.max_conns= pool->config.min_idle;
+  pool->wait_tail= &pool->wait_head;
+  mysql_async_loop_conn_init(&pool->retry, NULL, pool_retry_cont, pool);
+  pool_fill(pool);
+  return pool;
+}
+
+
+void
+mysql_async_pool_free(struct mysql_async_pool *pool)
+{
+  struct pool_conn *pc;
+  struct pool_waiter *w;
+
+  while ((pc= pool->idle))
+  {
+    pool->idle= pc->next;
+    mysql_async_loop_remove(pool->loop, &pc->conn);
+    mysql_close(&pc->mysql);
+    free(pc);
+  }
+  while ((w= waiter_pop(pool)))
+    free(w);
+  mysql_async_loop_remove(pool->loop, &pool->retry);
+  free(pool);
+}
+
+
+int
+mysql_async_pool_acquire(struct mysql_async_pool *pool, MYSQL **ret,
+                         mysql_async_pool_func func, void *data)
+{
+  struct pool_conn *pc;
+  struct pool_waiter *w;
+  unsigned long long now;
+
+  pool->stats.acquires++;
+  if ((pc= pool->idle))
+  {
+    pool->idle= pc->next;
+    pool->stats.idle--;
+    now= now_ms();
+    if (!pool->config.check_idle_ms ||
+        now - pc->last_used < pool->config.check_idle_ms)
+    {
+      pc->state= POOL_IN_USE;
+      pool->stats.immediate++;
+      *ret= &pc->mysql;
+      pool_fill(pool);
+      return 0;
+    }
+  }
+
+  pool->stats.waits++;
+  if (!(w= malloc(sizeof(*w))))
+  {
+    if (pc)
+      pool_conn_ready(pc);
+    errno= ENOMEM;
+    return -1;
+  }
+  w->func= func;
+  w->data= data;
+
+  if (pc)
+  {
+    /* Idle for long; make sure the server did not drop it meanwhile. */
+    MYSQL_ASYNC_STATUS status;
+
+    pool->stats.checks++;
+    pc->state= POOL_CHECKING;
+    pc->waiter= w;
+    pc->conn.cont= pool_cont;
+    pc->conn.data= pc;
+    if (!(status= mysql_ping_start(&pc->ret_int, &pc->mysql)))
+      status= pool_check_done(pc);
+    pool_wait(pc, status);
+  }
+  else
+  {
+    waiter_push_tail(pool, w);
+    pool_fill(pool);
+  }
+  return 1;
+}
+
+
+void
+mysql_async_pool_release(struct mysql_async_pool *pool, MYSQL *mysql,
+                         int reuse)
+{
+  struct pool_conn *pc= pool_conn_of(mysql);
+
+  /* Take back the loop connection from the application. */
+  pc->conn.cont= pool_cont;
+  pc->conn.data= pc;
+  if (!reuse)
+  {
+    pool_wait(pc, pool_close(pc));
+    pool_fill(pool);
+    return;
+  }
+  pool_wait(pc, pool_conn_ready(pc));
+}
+
+
+struct mysql_async_loop_conn *
+mysql_async_pool_loop_conn(MYSQL *mysql)
+{
+  return &pool_conn_of(mysql)->conn;
+}
+
+
+void
+mysql_async_pool_get_stats(const struct mysql_async_pool *pool,
+                           struct mysql_async_pool_stats *stats)
+{
+  *stats= pool->stats;
+}
@@ -0,0 +1,161 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Pool of non-blocking MySQL connections, driven by a mysql_async_loop.
+
+  Connections are opened concurrently in the background with
+  mysql_real_connect_start(), and kept open while idle. Acquiring an idle
+  connection is just a list operation, so in steady state there is no
+  network round trip per acquire. A connection that has been idle for
+  longer than check_idle_ms is first validated with mysql_ping_start(),
+  and replaced by a new one if that fails. After a failed connect, the
+  pool opens connections again from a timer in the loop, with a delay
+  that doubles on each failure in a row (from 100 ms up to 10 s), so it
+  gets back to min_idle once the server is reachable. Meanwhile the timer
+  keeps mysql_async_loop_run() from returning.
+
+  Each pooled MYSQL keeps its async context for its whole life, and the
+  stacks for async calls come from the stack pool, so reusing a connection
+  allocates nothing.
+
+    static void
+    got_conn(MYSQL *mysql, void *data)
+    {
+      if (!mysql)
+        ...                             // Could not connect
+      ...                               // Start using mysql
+    }
+
+    switch (mysql_async_pool_acquire(pool, &mysql, got_conn, data))
+    {
+    case 0: ...                         // mysql is ready for use now
+    case 1: ...                         // got_conn() will be called later
+    default: ...                        // Error
+    }
+    ...
+    mysql_async_pool_release(pool, mysql, 1);
+
+  The pool registers each connection with the loop, so the application
+  must not use a struct mysql_async_loop_conn of its own for a pooled
+  connection (the socket would be registered twice). Instead it gets the
+  pool's one from mysql_async_pool_loop_conn() and sets the cont and data
+  fields. This keeps the socket registered with epoll across acquire and
+  release, so those need no system calls.
+*/
+
+#ifndef MYSQL_ASYNC_POOL_H
+#define MYSQL_ASYNC_POOL_H
+
+#include "mysql_async_loop.h"
+
+struct mysql_async_pool_config {
+  /*
+    Arguments for mysql_real_connect(). The strings are not copied, and
+    must stay valid for the life of the pool.
+  */
+  const char *host;
+  const char *user;
+  const char *passwd;
+  const char *db;
+  unsigned int port;
+  const char *unix_socket;
+  unsigned long client_flags;
+  /* Number of idle connections to keep open, ready for use. */
+  unsigned int min_idle;
+  /* Maximum number of connections, in use or not. */
+  unsigned int max_conns;
+  /*
+    Ping a connection before handing it out if it has been idle for this
+    many milliseconds. 0 disables the check.
+  */
+  unsigned int check_idle_ms;
+};
+
+struct mysql_async_pool_stats {
+  unsigned long long acquires;
+  /* Acquires satisfied at once by an idle connection. */
+  unsigned long long immediate;
+  /* Acquires that had to wait for a connect or a check. */
+  unsigned long long waits;
+  unsigned long long connects;
+  unsigned long long connect_failures;
+  unsigned long long checks;
+  unsigned long long check_failures;
+  /* Current number of connections, and of those, idle and connecting. */
+  unsigned int total;
+  unsigned int idle;
+  unsigned int connecting;
+};
+
+/* Called with the acquired connection, or NULL if it could not connect. */
+typedef void (*mysql_async_pool_func)(MYSQL *mysql, void *data);
+
+struct mysql_async_pool;
+
+/*
+  Create a pool, and start opening min_idle connections in the loop.
+  Returns NULL on error.
+*/
+extern struct mysql_async_pool *
+mysql_async_pool_new(struct mysql_async_loop *loop,
+                     const struct mysql_async_pool_config *config);
+
+/*
+  Close all idle connections and free the pool. This uses the blocking
+  mysql_close(). All connections must have been released, and no connect
+  may be in progress (stats.connecting == 0).
+*/
+extern void mysql_async_pool_free(struct mysql_async_pool *pool);
+
+/*
+  Get a connection from the pool.
+
+  Returns 0 if an idle connection was available; it is stored in *ret.
+  Returns 1 if the caller has to wait; func(mysql, data) will be called
+  from the loop when a connection is ready (or failed to connect).
+  Returns -1 on error.
+
+  The connection must be idle (no call in progress) and have no
+  mysql_async_loop_wait() pending on it when it is released.
+*/
+extern int mysql_async_pool_acquire(struct mysql_async_pool *pool,
+                                    MYSQL **ret, mysql_async_pool_func func,
+                                    void *data);
+
+/*
+  Give a connection back to the pool. If reuse is 0 (eg. after a network
+  error, or with a result not fully read), the connection is closed and
+  replaced instead of reused.
+
+  If another acquire is waiting, its callback is called from here.
+*/
+extern void mysql_async_pool_release(struct mysql_async_pool *pool,
+                                     MYSQL *mysql, int reuse);
+
+/*
+  The loop connection of an acquired connection, for the application to
+  set cont and data in and pass to mysql_async_loop_wait().
+*/
+extern struct mysql_async_loop_conn *mysql_async_pool_loop_conn(MYSQL *mysql);
+
+extern void mysql_async_pool_get_stats(const struct mysql_async_pool *pool,
+                                       struct mysql_async_pool_stats *stats);
+
+#endif  /* MYSQL_ASYNC_POOL_H */
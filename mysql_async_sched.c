@@ -0,0 +1,659 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Implementation of the multi-threaded work-stealing scheduler.
+
+  Locking: each worker has a lock protecting its timer wheel and the
+  waiting state (status, fd, timer) of the connections it is home for.
+  Arming a wait, and claiming a waiting connection on an event or timeout,
+  are done under that lock, so a connection cannot be claimed before its
+  wait is completely armed. Run queues have a separate lock; the lock
+  order is worker lock, then queue lock.
+
+  The epoll data of a socket is not the connection pointer but a handle,
+  the index of a slot in the home worker's table plus the slot's
+  generation. An event returned by epoll_wait() just before the
+  connection was removed (and maybe freed) then no longer matches the
+  slot, and is dropped.
+
+  An idle worker blocks in epoll_wait() until its next timer, and is woken
+  through an eventfd in its epoll set when there is work to steal, an
+  earlier timer, or the run ends.
+*/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <mysql/mysql.h>
+
+#include "mysql_async.h"
+#include "mysql_async_sched.h"
+
+/* No slot, or the end of the free list. */
+#define NO_SLOT (~0U)
+/* epoll data of the worker's eventfd. */
+#define KICK_HANDLE (~(uint64_t)0)
+
+struct sched_slot {
+  /* NULL when free. */
+  struct mysql_async_sched_conn *conn;
+  /* Incremented when freed, so old handles to the slot do not match. */
+  unsigned int gen;
+  unsigned int next_free;
+};
+
+struct sched_worker {
+  struct mysql_async_sched *sched;
+  unsigned int index;
+  pthread_t thread;
+  int epfd;
+  /* In the epoll set, written to wake the worker from epoll_wait(). */
+  int kickfd;
+  pthread_mutex_t lock;
+  struct my_timer_wheel wheel;
+  /* Handles of the connections registered with epfd. */
+  struct sched_slot *slots;
+  unsigned int nslots, free_slot;
+  /*
+    Set (under lock) when about to block in epoll_wait() until
+    sleep_until. Another thread that clears it must write to kickfd.
+  */
+  volatile int sleeping;
+  unsigned long long sleep_until;
+  /* Run queue of connections ready to run, oldest first. */
+  pthread_mutex_t queue_lock;
+  struct mysql_async_sched_conn *head, **tail;
+  /* Length of the run queue; read without the lock as a hint by thieves. */
+  volatile unsigned int queued;
+  unsigned int rand_state;
+  struct mysql_async_sched_stats stats;
+  struct epoll_event events[MYSQL_ASYNC_SCHED_MAX_EVENTS];
+};
+
+struct mysql_async_sched {
+  unsigned int nthreads;
+  unsigned int next_home;
+  /* Connections waiting, queued or running. The workers stop at 0. */
+  volatile int active;
+  /* Set if a wait could not be armed from a worker. */
+  volatile int error;
+  /* Set to make the workers stop early, if not all of them could start. */
+  volatile int stop;
+  struct sched_worker *workers;
+};
+
+
+static unsigned long long
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+struct mysql_async_sched *
+mysql_async_sched_new(unsigned int nthreads)
+{
+  struct mysql_async_sched *sched;
+  unsigned int i;
+
+  if (!nthreads || !(sched= calloc(1, sizeof(*sched))))
+    return NULL;
+  if (!(sched->workers= calloc(nthreads, sizeof(*sched->workers))))
+  {
+    free(sched);
+    return NULL;
+  }
+  for (i= 0; i < nthreads; i++)
+  {
+    struct sched_worker *w= &sched->workers[i];
+
+    struct epoll_event ev;
+
+    w->sched= sched;
+    w->index= i;
+    w->kickfd= -1;
+    if ((w->epfd= epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+      sched->nthreads= i;
+      mysql_async_sched_free(sched);
+      return NULL;
+    }
+    ev.events= EPOLLIN;
+    ev.data.u64= KICK_HANDLE;
+    if ((w->kickfd= eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->kickfd, &ev))
+    {
+      if (w->kickfd >= 0)
+        close(w->kickfd);
+      close(w->epfd);
+      sched->nthreads= i;
+      mysql_async_sched_free(sched);
+      return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->queue_lock, NULL);
+    my_timer_wheel_init(&w->wheel, now_ms());
+    w->free_slot= NO_SLOT;
+    w->tail= &w->head;
+    w->rand_state= i + 1;
+    sched->nthreads= i + 1;
+  }
+  return sched;
+}
+
+
+void
+mysql_async_sched_free(struct mysql_async_sched *sched)
+{
+  unsigned int i;
+
+  for (i= 0; i < sched->nthreads; i++)
+  {
+    struct sched_worker *w= &sched->workers[i];
+
+    close(w->epfd);
+    close(w->kickfd);
+    free(w->slots);
+    pthread_mutex_destroy(&w->lock);
+    pthread_mutex_destroy(&w->queue_lock);
+  }
+  free(sched->workers);
+  free(sched);
+}
+
+
+void
+mysql_async_sched_conn_init(struct mysql_async_sched *sched,
+                            struct mysql_async_sched_conn *conn,
+                            MYSQL *mysql, mysql_async_sched_cont_func cont,
+                            void *data)
+{
+  conn->mysql= mysql;
+  conn->cont= cont;
+  conn->data= data;
+  conn->home= __sync_fetch_and_add(&sched->next_home, 1) % sched->nthreads;
+  conn->fd= -1;
+  conn->slot= NO_SLOT;
+  conn->status= 0;
+  conn->ready= 0;
+  my_timer_init(&conn->timer);
+  conn->next= NULL;
+}
+
+
+static void
+queue_push(struct sched_worker *w, struct mysql_async_sched_conn *conn)
+{
+  conn->next= NULL;
+  pthread_mutex_lock(&w->queue_lock);
+  *w->tail= conn;
+  w->tail= &conn->next;
+  w->queued++;
+  pthread_mutex_unlock(&w->queue_lock);
+}
+
+
+static struct mysql_async_sched_conn *
+queue_pop(struct sched_worker *w)
+{
+  struct mysql_async_sched_conn *conn;
+
+  if (!w->queued)
+    return NULL;
+  pthread_mutex_lock(&w->queue_lock);
+  if ((conn= w->head))
+  {
+    if (!(w->head= conn->next))
+      w->tail= &w->head;
+    w->queued--;
+  }
+  pthread_mutex_unlock(&w->queue_lock);
+  return conn;
+}
+
+
+/* Take a ready connection from another worker, starting at a random one. */
+static struct mysql_async_sched_conn *
+sched_steal(struct sched_worker *w)
+{
+  struct mysql_async_sched *sched= w->sched;
+  struct mysql_async_sched_conn *conn;
+  unsigned int i, start;
+
+  w->rand_state= w->rand_state * 1103515245 + 12345;
+  start= (w->rand_state >> 16) % sched->nthreads;
+  for (i= 0; i < sched->nthreads; i++)
+  {
+    struct sched_worker *victim=
+      &sched->workers[(start + i) % sched->nthreads];
+
+    if (victim != w && (conn= queue_pop(victim)))
+    {
+      w->stats.steals++;
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+
+/* Wake a worker if it is blocked in epoll_wait(). */
+static void
+sched_kick(struct sched_worker *w)
+{
+  uint64_t one= 1;
+
+  /* EAGAIN means the counter is full, so it is readable anyway. */
+  if (__sync_bool_compare_and_swap(&w->sleeping, 1, 0) &&
+      write(w->kickfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    w->sched->error= errno;
+}
+
+/* Wake up to count sleeping workers, to steal from w's run queue. */
+static void
+sched_kick_thieves(struct sched_worker *w, unsigned int count)
+{
+  struct mysql_async_sched *sched= w->sched;
+  unsigned int i;
+
+  /* Pairs with the barrier in sched_idle(). */
+  __sync_synchronize();
+  for (i= 0; count && i < sched->nthreads; i++)
+  {
+    struct sched_worker *thief= &sched->workers[i];
+
+    if (thief != w && thief->sleeping)
+    {
+      sched_kick(thief);
+      count--;
+    }
+  }
+}
+
+static void
+sched_kick_all(struct mysql_async_sched *sched, unsigned int nworkers)
+{
+  unsigned int i;
+
+  __sync_synchronize();
+  for (i= 0; i < nworkers; i++)
+    sched_kick(&sched->workers[i]);
+}
+
+
+/*
+  Give a connection a slot in the home worker's table. Called with the
+  home worker's lock held.
+*/
+static int
+sched_slot_alloc(struct sched_worker *home,
+                 struct mysql_async_sched_conn *conn)
+{
+  struct sched_slot *slot;
+
+  if (home->free_slot == NO_SLOT)
+  {
+    unsigned int i, n= home->nslots ? home->nslots * 2 : 64;
+
+    if (!(slot= realloc(home->slots, n * sizeof(*slot))))
+    {
+      errno= ENOMEM;
+      return -1;
+    }
+    for (i= home->nslots; i < n; i++)
+    {
+      slot[i].conn= NULL;
+      slot[i].gen= 0;
+      slot[i].next_free= i + 1 < n ? i + 1 : NO_SLOT;
+    }
+    home->slots= slot;
+    home->free_slot= home->nslots;
+    home->nslots= n;
+  }
+  conn->slot= home->free_slot;
+  slot= &home->slots[conn->slot];
+  home->free_slot= slot->next_free;
+  slot->conn= conn;
+  return 0;
+}
+
+static void
+sched_slot_free(struct sched_worker *home, struct mysql_async_sched_conn *conn)
+{
+  struct sched_slot *slot= &home->slots[conn->slot];
+
+  slot->conn= NULL;
+  slot->gen++;
+  slot->next_free= home->free_slot;
+  home->free_slot= conn->slot;
+  conn->slot= NO_SLOT;
+}
+
+
+/*
+  Register the socket of a connection for the events in status, with
+  EPOLLONESHOT. Called with the home worker's lock held.
+*/
+static int
+sched_arm_fd(struct sched_worker *home, struct mysql_async_sched_conn *conn,
+             int status)
+{
+  struct epoll_event ev;
+  int fd= mysql_get_socket_fd(conn->mysql);
+
+  if (conn->slot == NO_SLOT && sched_slot_alloc(home, conn))
+    return -1;
+  ev.events= EPOLLONESHOT |
+    (status & MYSQL_WAIT_READ ? EPOLLIN | EPOLLRDHUP : 0) |
+    (status & MYSQL_WAIT_WRITE ? EPOLLOUT : 0);
+  ev.data.u64= (uint64_t)home->slots[conn->slot].gen << 32 | conn->slot;
+  if (fd == conn->fd)
+    return epoll_ctl(home->epfd, EPOLL_CTL_MOD, fd, &ev);
+
+  /* First wait, or the library reconnected on a new socket. */
+  if (conn->fd >= 0)
+    epoll_ctl(home->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  conn->fd= -1;
+  if (epoll_ctl(home->epfd, EPOLL_CTL_ADD, fd, &ev))
+    return -1;
+  conn->fd= fd;
+  return 0;
+}
+
+
+int
+mysql_async_sched_wait(struct mysql_async_sched *sched,
+                       struct mysql_async_sched_conn *conn,
+                       MYSQL_ASYNC_STATUS status)
+{
+  struct sched_worker *home= &sched->workers[conn->home];
+  int err= 0;
+
+  __sync_fetch_and_add(&sched->active, 1);
+  pthread_mutex_lock(&home->lock);
+  conn->status= status;
+  if (status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE))
+    err= sched_arm_fd(home, conn, status);
+  if (!err && (status & MYSQL_WAIT_TIMEOUT))
+  {
+    unsigned long long expire= now_ms() +
+      (unsigned long long)mysql_get_timeout_value(conn->mysql) * 1000;
+
+    my_timer_add(&home->wheel, &conn->timer, expire);
+    /* The home worker may be sleeping past it. */
+    if (home->sleeping && expire < home->sleep_until)
+      sched_kick(home);
+  }
+  if (err)
+  {
+    err= errno;
+    conn->status= 0;
+  }
+  pthread_mutex_unlock(&home->lock);
+  if (err)
+  {
+    __sync_fetch_and_sub(&sched->active, 1);
+    errno= err;
+    return -1;
+  }
+  return 0;
+}
+
+
+void
+mysql_async_sched_remove(struct mysql_async_sched *sched,
+                         struct mysql_async_sched_conn *conn)
+{
+  struct sched_worker *home= &sched->workers[conn->home];
+
+  pthread_mutex_lock(&home->lock);
+  my_timer_cancel(&home->wheel, &conn->timer);
+  if (conn->fd >= 0)
+  {
+    epoll_ctl(home->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->fd= -1;
+  }
+  /* Events already returned by epoll_wait() no longer find it. */
+  if (conn->slot != NO_SLOT)
+    sched_slot_free(home, conn);
+  pthread_mutex_unlock(&home->lock);
+}
+
+
+/* Called with the home worker's lock held. */
+static void
+sched_timer_expired(struct my_timer *timer, void *arg)
+{
+  struct sched_worker *w= (struct sched_worker *)arg;
+  struct mysql_async_sched_conn *conn= (struct mysql_async_sched_conn *)
+    ((char *)timer - offsetof(struct mysql_async_sched_conn, timer));
+
+  conn->status= 0;
+  conn->ready= MYSQL_WAIT_TIMEOUT;
+  w->stats.timeouts++;
+  queue_push(w, conn);
+}
+
+
+/* Wait for events and timeouts, and queue the connections that are ready. */
+static void
+sched_poll(struct sched_worker *w, int timeout_ms)
+{
+  int i, n;
+
+  n= epoll_wait(w->epfd, w->events, MYSQL_ASYNC_SCHED_MAX_EVENTS, timeout_ms);
+  pthread_mutex_lock(&w->lock);
+  for (i= 0; i < n; i++)
+  {
+    uint64_t handle= w->events[i].data.u64;
+    uint32_t events= w->events[i].events;
+    struct sched_slot *slot;
+    struct mysql_async_sched_conn *conn;
+    int bits= 0;
+
+    if (handle == KICK_HANDLE)
+    {
+      uint64_t count;
+
+      /* Reset the counter; EAGAIN if that was done already. */
+      if (read(w->kickfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        w->sched->error= errno;
+      continue;
+    }
+    slot= &w->slots[(unsigned int)handle];
+    if (slot->gen != (unsigned int)(handle >> 32))
+      continue;                         /* Removed since */
+    conn= slot->conn;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+      bits|= MYSQL_WAIT_READ;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+      bits|= MYSQL_WAIT_WRITE;
+    if (!(bits&= conn->status))
+    {
+      /*
+        Left over from an earlier wait that ended by timeout. The one-shot
+        registration is used up now, so re-arm it for the current wait.
+      */
+      if (!(conn->status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE)) ||
+          !sched_arm_fd(w, conn, conn->status))
+        continue;
+      /*
+        Without the registration it would never be woken. Run it as if the
+        socket were ready, so the library retries and sees any error.
+      */
+      w->sched->error= errno;
+      bits= conn->status & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE);
+    }
+    my_timer_cancel(&w->wheel, &conn->timer);
+    conn->status= 0;
+    conn->ready= bits;
+    queue_push(w, conn);
+  }
+  my_timer_wheel_expire(&w->wheel, now_ms(), sched_timer_expired, w);
+  pthread_mutex_unlock(&w->lock);
+  /* We take the next one ourselves, others may take the rest. */
+  if (w->queued > 1)
+    sched_kick_thieves(w, w->queued - 1);
+}
+
+
+/* True if some worker has connections ready to run. */
+static int
+sched_work_queued(struct mysql_async_sched *sched)
+{
+  unsigned int i;
+
+  for (i= 0; i < sched->nthreads; i++)
+    if (sched->workers[i].queued)
+      return 1;
+  return 0;
+}
+
+
+/*
+  Nothing to run: block until an event, the next timer, or a kick. The
+  sleeping flag is set before checking for work one last time, so work
+  queued after that check sees it and kicks us.
+*/
+static void
+sched_idle(struct sched_worker *w)
+{
+  struct mysql_async_sched *sched= w->sched;
+  unsigned long long now;
+  int timeout_ms= -1;
+
+  pthread_mutex_lock(&w->lock);
+  w->sleep_until= my_timer_wheel_next(&w->wheel);
+  w->sleeping= 1;
+  pthread_mutex_unlock(&w->lock);
+  __sync_synchronize();
+  if (sched->active <= 0 || sched->stop || sched_work_queued(sched))
+    timeout_ms= 0;
+  else if (w->sleep_until != MY_TIMER_NEVER)
+  {
+    now= now_ms();
+    timeout_ms= w->sleep_until <= now ? 0 : (int)(w->sleep_until - now);
+  }
+  sched_poll(w, timeout_ms);
+  w->sleeping= 0;
+}
+
+
+static void
+sched_run_conn(struct sched_worker *w, struct mysql_async_sched_conn *conn)
+{
+  struct mysql_async_sched *sched= w->sched;
+  MYSQL_ASYNC_STATUS status;
+
+  w->stats.runs++;
+  /* Do not touch conn after the continuation returns 0. */
+  status= conn->cont(conn->mysql, (MYSQL_ASYNC_STATUS)conn->ready, conn->data);
+  if (status && mysql_async_sched_wait(sched, conn, status))
+    sched->error= errno;
+  if (__sync_sub_and_fetch(&sched->active, 1) <= 0)
+    sched_kick_all(sched, sched->nthreads);     /* The run is over. */
+}
+
+
+static void *
+sched_worker_run(void *arg)
+{
+  struct sched_worker *w= (struct sched_worker *)arg;
+  struct mysql_async_sched *sched= w->sched;
+  struct mysql_async_sched_conn *conn;
+  unsigned int runs= 0;
+
+  mysql_thread_init();
+  while (sched->active > 0 && !sched->stop)
+  {
+    if ((conn= queue_pop(w)) || (conn= sched_steal(w)))
+    {
+      sched_run_conn(w, conn);
+      /* Check for new events now and then, even when busy. */
+      if (++runs < MYSQL_ASYNC_SCHED_MAX_EVENTS)
+        continue;
+      runs= 0;
+      sched_poll(w, 0);
+    }
+    else
+    {
+      runs= 0;
+      sched_idle(w);
+    }
+  }
+  mysql_thread_end();
+  return NULL;
+}
+
+
+int
+mysql_async_sched_run(struct mysql_async_sched *sched)
+{
+  unsigned int i, started;
+
+  sched->error= 0;
+  sched->stop= 0;
+  for (started= 0; started < sched->nthreads; started++)
+  {
+    struct sched_worker *w= &sched->workers[started];
+
+    if ((errno= pthread_create(&w->thread, NULL, sched_worker_run, w)))
+    {
+      /* Nobody would poll the events of the missing workers. */
+      sched->error= errno;
+      sched->stop= 1;
+      sched_kick_all(sched, started);
+      break;
+    }
+  }
+  for (i= 0; i < started; i++)
+    pthread_join(sched->workers[i].thread, NULL);
+  if (sched->error)
+  {
+    errno= sched->error;
+    return -1;
+  }
+  return 0;
+}
+
+
+void
+mysql_async_sched_get_stats(struct mysql_async_sched *sched,
+                            struct mysql_async_sched_stats *stats)
+{
+  unsigned int i;
+
+  stats->runs= stats->steals= stats->timeouts= 0;
+  for (i= 0; i < sched->nthreads; i++)
+  {
+    stats->runs+= sched->workers[i].stats.runs;
+    stats->steals+= sched->workers[i].stats.steals;
+    stats->timeouts+= sched->workers[i].stats.timeouts;
+  }
+}
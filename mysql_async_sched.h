@@ -0,0 +1,130 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Multi-threaded scheduler for non-blocking MySQL connections.
+
+  This is the multi-threaded counterpart of mysql_async_loop.h, with the
+  same continuation interface. It runs N worker threads. Each connection
+  has a home worker, whose epoll set its socket is registered in and whose
+  timer wheel holds its timeout. When a connection becomes ready, its home
+  worker puts it on its run queue; a worker that runs out of work steals
+  ready connections from the other workers' run queues. So the continuation
+  of a connection (and the suspended async call inside it) may run in any
+  worker thread, one at a time.
+
+  This is safe because a suspended my_context holds only registers and a
+  stack, and the async calls carry errno and my_errno across each yield.
+  Each worker calls mysql_thread_init() when it starts.
+
+  Sockets are registered with EPOLLONESHOT, so that one readiness event
+  goes to exactly one worker; this costs one epoll_ctl() per wait. A
+  worker with nothing to run or steal blocks in epoll_wait() until it is
+  woken for new work, its next timeout, or the end of the run.
+*/
+
+#ifndef MYSQL_ASYNC_SCHED_H
+#define MYSQL_ASYNC_SCHED_H
+
+#include "my_timer_wheel.h"
+
+/* Maximum number of events retrieved from the kernel with one epoll_wait(). */
+#define MYSQL_ASYNC_SCHED_MAX_EVENTS 64
+
+typedef MYSQL_ASYNC_STATUS (*mysql_async_sched_cont_func)
+  (MYSQL *mysql, MYSQL_ASYNC_STATUS ready_status, void *data);
+
+struct mysql_async_sched_conn {
+  MYSQL *mysql;
+  mysql_async_sched_cont_func cont;
+  void *data;
+
+  /* Private to the scheduler. */
+  /* Index of the home worker. */
+  unsigned int home;
+  /* The socket registered with the home worker's epoll set, or -1. */
+  int fd;
+  /* Slot in the home worker's handle table, while registered. */
+  unsigned int slot;
+  /*
+    The conditions waited for, 0 when not waiting. Whoever changes it
+    from non-zero to 0 (epoll event or timeout) gets to run the connection.
+  */
+  int status;
+  /* The conditions that occured, passed to the continuation. */
+  int ready;
+  /* Pending in the home worker's timer wheel. */
+  struct my_timer timer;
+  /* Next in a run queue. */
+  struct mysql_async_sched_conn *next;
+};
+
+struct mysql_async_sched_stats {
+  /* Continuations run. */
+  unsigned long long runs;
+  /* Of those, taken from another worker's run queue. */
+  unsigned long long steals;
+  /* Continuations run due to timeout. */
+  unsigned long long timeouts;
+};
+
+struct mysql_async_sched;
+
+/* Create a scheduler with nthreads workers. Returns NULL on error. */
+extern struct mysql_async_sched *mysql_async_sched_new(unsigned int nthreads);
+extern void mysql_async_sched_free(struct mysql_async_sched *sched);
+
+/* Assigns the connection a home worker, round-robin. */
+extern void mysql_async_sched_conn_init(struct mysql_async_sched *sched,
+                                        struct mysql_async_sched_conn *conn,
+                                        MYSQL *mysql,
+                                        mysql_async_sched_cont_func cont,
+                                        void *data);
+
+/*
+  Make a connection wait for status. May be called from any thread,
+  including from the continuation of another connection, but not for a
+  connection that is already waiting.
+
+  Returns 0 if ok, -1 on error (with errno set).
+*/
+extern int mysql_async_sched_wait(struct mysql_async_sched *sched,
+                                  struct mysql_async_sched_conn *conn,
+                                  MYSQL_ASYNC_STATUS status);
+
+/*
+  Unregister a connection that is not waiting, eg. before mysql_close().
+  May be called from its own continuation when that is going to return 0.
+  The connection may be freed right after; events for it that a worker
+  has not handled yet are dropped.
+*/
+extern void mysql_async_sched_remove(struct mysql_async_sched *sched,
+                                     struct mysql_async_sched_conn *conn);
+
+/*
+  Start the worker threads and run until no connection is waiting for
+  anything. Returns 0 if ok, -1 on error.
+*/
+extern int mysql_async_sched_run(struct mysql_async_sched *sched);
+
+/* Statistics summed over all workers; call when not running. */
+extern void mysql_async_sched_get_stats(struct mysql_async_sched *sched,
+                                        struct mysql_async_sched_stats *stats);
+
+#endif  /* MYSQL_ASYNC_SCHED_H */
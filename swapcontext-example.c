@@ -21,9 +21,11 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
 
 #include "my_context.h"
+#include "my_stack_pool.h"
 
 enum wait_status {
   WAIT_READ= 1,
@@ -51,8 +53,11 @@ struct my_state {
   union {
     int r_int;
   } ret_result;
-  /* Memory for stack for async context. */
-  char *stack_mem;
+  /*
+    Stack for the async context. Taken from the stack pool when an async call
+    is started, and returned to it when the call completes.
+  */
+  struct my_stack *stack;
 
   /* Implementation-specific async context. */
   struct my_context async_context;
@@ -62,9 +67,7 @@ static int
 state_init(struct my_state *s)
 {
   s->async_call_active= 0;
-  s->stack_mem= malloc(STACK_SIZE);
-  if (!s->stack_mem)
-    return -1;
+  s->stack= NULL;
 
   return 0;
 }
@@ -72,8 +75,20 @@ state_init(struct my_state *s)
 static void
 state_deinit(struct my_state *s)
 {
-  if (s->stack_mem)
-    free(s->stack_mem);
+  if (s->stack)
+    my_stack_free(s->stack);
+  my_stack_pool_thread_end();
+}
+
+static void
+state_release_stack(struct my_state *s)
+{
+  /* The stack was painted in foo_start(), so we can see how much was used. */
+  printf("Stack used: %lu of %lu bytes\n",
+         (unsigned long)my_stack_used(s->stack),
+         (unsigned long)s->stack->stack_size);
+  my_stack_free(s->stack);
+  s->stack= NULL;
 }
 
 
@@ -173,12 +188,16 @@ foo_start(int *ret, struct my_state *s, int param)
     we need to block on I/O.
   */
   s->param.p_foo.param= param;
+  if (!(s->stack= my_stack_alloc(STACK_SIZE)))
+    return 1;
+  my_stack_paint(s->stack);
   s->async_call_active= 1;
   res= my_context_spawn(&s->async_context, foo_start_internal, s,
-                        s->stack_mem, STACK_SIZE);
+                        s->stack->stack, s->stack->stack_size);
   if (res < 0)
   {
     /* Error. */
+    state_release_stack(s);
     return 1;
   }
   else if (res > 0)
@@ -189,6 +208,7 @@ foo_start(int *ret, struct my_state *s, int param)
   else
   {
     /* Finished. */
+    state_release_stack(s);
     *ret= s->ret_result.r_int;
     return 0;
   }
@@ -211,6 +231,7 @@ foo_cont(int *ret, struct my_state *s)
   if (res < 0)
   {
     fprintf(stderr, "Aieie, my_context_continue() failed: %d\n", res);
+    state_release_stack(s);
     *ret= -1;
     return 0;
   }
@@ -222,6 +243,7 @@ foo_cont(int *ret, struct my_state *s)
   else
   {
     /* Finished. */
+    state_release_stack(s);
     *ret= s->ret_result.r_int;
     return 0;
   }
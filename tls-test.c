@@ -0,0 +1,256 @@
+/*
+  Copyright 2011 Kristian Nielsen
+
+  Experiments with non-blocking libmysql.
+
+  This is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Test of the TLS code of mysql_async.c (my_ssl_*_async() and
+  mysql_async_ssl_packet_ready()), which is only compiled with
+  HAVE_OPENSSL.
+
+  mysql_async.c is included after the stand-in for libmysql in
+  libmysql-stub.h, so that neither the client library nor a server is
+  needed. The server side is OpenSSL in a thread, on the other end of a
+  socketpair, with a key and self-signed certificate made at startup. The
+  client runs the TLS handshake and a request/reply as the body of
+  mysql_ping_start() / mysql_ping_cont(), driven by poll() like an
+  application would.
+*/
+
+#include "libmysql-stub.h"
+
+static int mysql_ping(MYSQL *mysql);
+
+#include "mysql_async.c"
+
+#include <stdio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+/* Two packets, sent by the server in one TLS record. */
+static const char reply[]= "\005\000\000\000hello" "\003\000\000\001abc";
+#define REPLY_LEN (sizeof(reply) - 1)
+#define REQUEST "ping"
+#define REQUEST_LEN (sizeof(REQUEST) - 1)
+
+static int failures;
+
+static void
+check(int ok, const char *what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if (!ok)
+    failures++;
+}
+
+
+static void
+die(const char *what)
+{
+  fprintf(stderr, "tls-test: %s\n", what);
+  ERR_print_errors_fp(stderr);
+  exit(2);
+}
+
+
+/* A server context with a fresh EC key and a self-signed certificate. */
+static SSL_CTX *
+server_ctx_new(void)
+{
+  SSL_CTX *ctx;
+  EVP_PKEY_CTX *kctx;
+  EVP_PKEY *key= NULL;
+  X509 *cert;
+
+  if (!(kctx= EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) ||
+      EVP_PKEY_keygen_init(kctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,
+                                             NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(kctx, &key) <= 0)
+    die("cannot make key");
+  EVP_PKEY_CTX_free(kctx);
+
+  if (!(cert= X509_new()))
+    die("cannot make certificate");
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                             (const unsigned char *)"tls-test", -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(cert));
+  if (!X509_sign(cert, key, EVP_sha256()))
+    die("cannot sign certificate");
+
+  if (!(ctx= SSL_CTX_new(TLS_server_method())) ||
+      SSL_CTX_use_certificate(ctx, cert) != 1 ||
+      SSL_CTX_use_PrivateKey(ctx, key) != 1)
+    die("cannot make server context");
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return ctx;
+}
+
+
+/* Blocking server: handshake, read the request, send the reply. */
+static void *
+server_thread(void *arg)
+{
+  SSL *ssl= (SSL *)arg;
+  char buf[REQUEST_LEN];
+  int got= 0, res;
+
+  if (SSL_accept(ssl) != 1)
+    die("server handshake failed");
+  while (got < (int)REQUEST_LEN)
+  {
+    if ((res= SSL_read(ssl, buf + got, REQUEST_LEN - got)) <= 0)
+      die("server read failed");
+    got+= res;
+  }
+  if (memcmp(buf, REQUEST, REQUEST_LEN))
+    die("server got a wrong request");
+  if (SSL_write(ssl, reply, REPLY_LEN) != (int)REPLY_LEN)
+    die("server write failed");
+  SSL_shutdown(ssl);
+  return NULL;
+}
+
+
+/* Results of the client side, checked by main(). */
+static int connect_res, write_res, read_ok;
+static my_bool ready_rest, ready_header, ready_none;
+
+/*
+  The client conversation, run in the async context as the body of
+  mysql_ping_start(). Reads go one byte at a time, so that all but the
+  first are served from the decrypted record.
+*/
+static int
+mysql_ping(MYSQL *mysql)
+{
+  struct mysql_async_context *b= mysql->async_context;
+  SSL *ssl= (SSL *)mysql->net.vio->ssl_arg;
+  char buf[REPLY_LEN];
+  uint i;
+
+  if ((connect_res= my_ssl_connect_async(b, ssl, 5)) != 1)
+    return 1;
+  if ((write_res= my_ssl_write_async(b, ssl, REQUEST, REQUEST_LEN, 5)) !=
+      (int)REQUEST_LEN)
+    return 1;
+
+  /* The first packet. */
+  for (i= 0; i < NET_HEADER_SIZE + 5; i++)
+    if (my_ssl_read_async(b, ssl, buf + i, 1, 5) != 1)
+      return 1;
+  /* The whole second packet is pending in the TLS library. */
+  mysql->net.vio->read_pos= mysql->net.vio->read_end= buf + i;
+  ready_rest= mysql_async_packet_ready(mysql);
+  /* Its header is in the Vio buffer, the payload still in the record. */
+  for (; i < REPLY_LEN - 3; i++)
+    if (my_ssl_read_async(b, ssl, buf + i, 1, 5) != 1)
+      return 1;
+  mysql->net.vio->read_end= buf + i;
+  ready_header= mysql_async_packet_ready(mysql);
+  for (; i < REPLY_LEN; i++)
+    if (my_ssl_read_async(b, ssl, buf + i, 1, 5) != 1)
+      return 1;
+  mysql->net.vio->read_pos= mysql->net.vio->read_end= buf + i;
+  ready_none= mysql_async_packet_ready(mysql);
+
+  read_ok= !memcmp(buf, reply, REPLY_LEN);
+  return 0;
+}
+
+
+int
+main(void)
+{
+  SSL_CTX *server_ctx, *client_ctx;
+  SSL *server_ssl, *client_ssl;
+  pthread_t thr;
+  int fds[2];
+  int ret= 1, yields= 0;
+  MYSQL_ASYNC_STATUS status;
+  static Vio vio;
+  static MYSQL mysql;
+  struct mysql_async_recv_stats recv;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    die("socketpair failed");
+  /* As my_connect_async() leaves the socket of a connection. */
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+  server_ctx= server_ctx_new();
+  if (!(server_ssl= SSL_new(server_ctx)) || !SSL_set_fd(server_ssl, fds[1]))
+    die("cannot make server connection");
+  if (pthread_create(&thr, NULL, server_thread, server_ssl))
+    die("cannot start server thread");
+
+  /* No verification of the certificate; this tests the transport only. */
+  if (!(client_ctx= SSL_CTX_new(TLS_client_method())) ||
+      !(client_ssl= SSL_new(client_ctx)) || !SSL_set_fd(client_ssl, fds[0]))
+    die("cannot make client connection");
+  vio.ssl_arg= client_ssl;
+  mysql.net.vio= &vio;
+
+  status= mysql_ping_start(&ret, &mysql);
+  while (status)
+  {
+    struct pollfd pfd;
+
+    yields++;
+    pfd.fd= fds[0];
+    pfd.events= (status & MYSQL_WAIT_READ ? POLLIN : 0) |
+                (status & MYSQL_WAIT_WRITE ? POLLOUT : 0);
+    pfd.revents= 0;
+    if (poll(&pfd, 1, 5000) <= 0)
+      die("timeout waiting for the server");
+    status= mysql_ping_cont(&ret, &mysql,
+                            (pfd.revents & POLLIN ? MYSQL_WAIT_READ : 0) |
+                            (pfd.revents & POLLOUT ? MYSQL_WAIT_WRITE : 0));
+  }
+  pthread_join(thr, NULL);
+
+  mysql_async_get_recv_stats(&mysql, &recv);
+  check(ret == 0, "call completed");
+  check(yields > 0, "handshake suspended the call");
+  check(connect_res == 1, "my_ssl_connect_async()");
+  check(write_res == (int)REQUEST_LEN, "my_ssl_write_async()");
+  check(read_ok, "my_ssl_read_async() data");
+  check(recv.bytes == REPLY_LEN && recv.reads == REPLY_LEN,
+        "receive counters");
+  check(recv.buffered_reads >= REPLY_LEN - 1,
+        "reads served from the decrypted record");
+  check(ready_rest, "packet ready, all in the TLS library");
+  check(ready_header, "packet ready, header in the Vio buffer");
+  check(!ready_none, "no packet ready when all is read");
+
+  mysql_async_free_context(mysql.async_context);
+  SSL_free(client_ssl);
+  SSL_free(server_ssl);
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(server_ctx);
+  close(fds[0]);
+  close(fds[1]);
+  return failures ? 1 : 0;
+}